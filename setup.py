@@ -58,7 +58,8 @@ class Tester(Command):
 def install(use_cuda, use_nccl):
     ext_libs = []
     if pf.system() == 'Linux':
-        ext_args = ['-w']
+        ext_libs += ['rt']
+        ext_args = ['-w', '-fopenmp']
     elif pf.system() == 'Darwin':
         ext_args = ['-mmacosx-version-min=10.13']
     else:
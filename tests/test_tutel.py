@@ -32,7 +32,18 @@ class HelloworldCaller():
         a2a_ffn_overlap_degree=1,
         num_steps=100,
         use_model_parallel=False,
-        device='cuda'
+        device='cuda',
+        a2a_compression='',
+        grad_bucket_mb=0,
+        expert_type='ffn',
+        activation_fn='relu',
+        recompute='',
+        eval=False,
+        quant_bits=8,
+        capacity_factor=None,
+        replicate_hot_experts=0,
+        shared_expert_hidden=0,
+        gate_type='top'
         ):
         # Disable NCCL SHM because it's capacity is limited in Azure pipeline
         new_env = os.environ.copy()
@@ -44,6 +55,25 @@ class HelloworldCaller():
                 command += ' --parallel_type model'
             else:
                 command += ' --parallel_type data'
+            if a2a_compression:
+                command += ' --a2a_compression ' + a2a_compression
+            if grad_bucket_mb:
+                command += ' --grad_bucket_mb ' + str(grad_bucket_mb)
+            command += ' --expert_type ' + expert_type + ' --activation_fn ' + activation_fn
+            if recompute:
+                command += ' --recompute ' + recompute
+            if eval:
+                command += ' --eval'
+            if expert_type == 'ffn_q':
+                command += ' --quant_bits ' + str(quant_bits)
+            if capacity_factor is not None:
+                command += ' --capacity_factor ' + str(capacity_factor)
+            if replicate_hot_experts:
+                command += ' --replicate_hot_experts ' + str(replicate_hot_experts)
+            if shared_expert_hidden:
+                command += ' --shared_expert_hidden ' + str(shared_expert_hidden)
+            if gate_type != 'top':
+                command += ' --gate_type ' + gate_type
         else:
             raise Exception('Unhandled helloworld_file: %s' % helloworld_file)
 
@@ -82,6 +112,20 @@ class TutelTestCase(unittest.TestCase):
                     self.data[i]['losses'][j] = round(float(self.data[i]['losses'][j]), 1)
         self.tutelCaller = HelloworldCaller()
 
+    def assertLossesClose(self, losses, ref_losses, tol=1e-3):
+        """Checks that two helloworld runs report as many losses, each close to the reference"""
+        self.assertEqual(len(losses), len(ref_losses))
+        for loss, ref_loss in zip(losses, ref_losses):
+            self.assertTrue(math.isclose(loss, ref_loss, rel_tol=tol, abs_tol=tol))
+
+    def assertFusedLossesClose(self, **kwargs):
+        """Runs helloworld on cpu with and without TUTEL_FUSED_EXPERTS, checks that losses are close and returns the fused ones"""
+        with patch.dict('os.environ', {'TUTEL_FUSED_EXPERTS': '0'}):
+            losses = self.tutelCaller.run(device='cpu', show_step_time=False, **kwargs)
+        fused_losses = self.tutelCaller.run(device='cpu', show_step_time=False, **kwargs)
+        self.assertLossesClose(fused_losses, losses)
+        return fused_losses
+
     def test_cpu_kernel(self):
         """Test cpu kernel"""
         cuda_losses = self.tutelCaller.run(nproc_per_node=1, num_steps=10, device='cuda', show_step_time=False)
@@ -175,6 +219,623 @@ class TutelTestCase(unittest.TestCase):
             self.tutelCaller.run(nproc_per_node=2, helloworld_file='helloworld', top=2, dtype='float64', num_local_experts=2, show_step_time=False, batch_size=1, a2a_ffn_overlap_degree=2)
             )
 
+    def test_a2a_compression(self):
+        """Test compressed all_to_all payloads with cpu (gloo) backend"""
+        for compression in ['fp8', 'int8']:
+            losses = self.tutelCaller.run(nproc_per_node=2, num_steps=10, device='cpu', show_step_time=False)
+            compressed_losses = self.tutelCaller.run(nproc_per_node=2, num_steps=10, device='cpu', show_step_time=False, a2a_compression=compression)
+            self.assertLossesClose(compressed_losses, losses, tol=0.05)
+
+    def test_zero_gather_async_grad(self):
+        """Test prefetched zero_gather of sharded experts with background grad reduce_scatter on cpu (gloo) backend"""
+        losses = self.tutelCaller.run(nproc_per_node=2, num_local_experts=-2, num_steps=10, device='cpu', show_step_time=False)
+        with patch.dict('os.environ', {'TUTEL_ZERO_ASYNC_GRAD': '1'}):
+            async_losses = self.tutelCaller.run(nproc_per_node=2, num_local_experts=-2, num_steps=10, device='cpu', show_step_time=False)
+        self.assertEqual(losses, async_losses)
+
+    def test_zero_gather_overlap(self):
+        """Test that sharded expert params after fc1 are gathered in background and waited for after the compute before them"""
+        import torch
+        from types import SimpleNamespace
+        from tutel import net
+        from tutel.experts.ffn import FusedExpertsNetwork
+        from tutel.experts.llama_ffn import LlamaFFNNetwork
+        events, names, matmul = [], {}, torch.matmul
+        record = lambda event, x: (events.append(event), x)[1]
+        fake_gather = lambda input, group=None: record(('gather', names[input.data_ptr()]), torch.cat([input, input]) if names[input.data_ptr()].startswith('W_') else input)
+        fake_prefetch = lambda inputs, group=None: events.append(('prefetch', [names[x.data_ptr()] for x in inputs if x is not None]))
+        activation_fn = lambda x: record('activation', torch.relu(x))
+
+        ffn = FusedExpertsNetwork(8, 16, 2, 1, activation_fn=activation_fn)
+        llama_ffn = LlamaFFNNetwork(8, 16, 2, 2, activation_fn=activation_fn)
+        for module in [ffn, llama_ffn]:
+            names.update({p.data_ptr(): n for n, p in module.named_parameters()})
+        ctx = SimpleNamespace(adaptive_degree=0, num_global_experts=2, group=None, megablocks_size=0, sharded_count=1, model_dim=8)
+        with patch.object(net, 'zero_gather', fake_gather), patch.object(net, 'zero_gather_prefetch', fake_prefetch), \
+                patch.object(LlamaFFNNetwork, '_get_sharded_group', lambda self, group: None), \
+                patch.object(torch, 'matmul', lambda *args: record('matmul', matmul(*args))):
+            ffn(torch.randn([2, 3, 8]), ctx)
+            self.assertEqual(events, [
+                ('gather', 'batched_fc1_w'), ('prefetch', ['batched_fc1_bias', 'batched_fc2_w', 'batched_fc2_bias']), 'matmul',
+                ('gather', 'batched_fc1_bias'), 'activation', ('gather', 'batched_fc2_w'), ('gather', 'batched_fc2_bias'), 'matmul'])
+            events.clear()
+            llama_ffn(torch.randn([2, 3, 8]), ctx)
+            self.assertEqual(events, [
+                ('gather', 'W_fc1'), ('prefetch', ['W_fc2', 'W_fc3']), 'matmul', 'activation', ('gather', 'W_fc2'), 'matmul', ('gather', 'W_fc3'), 'matmul'])
+
+    def test_recompute_boundary(self):
+        """Test that recomputing expert compute in backward keeps grads unchanged without gathering params again"""
+        import torch
+        from types import SimpleNamespace
+        from tutel import net
+        from tutel.impls import expert_ops
+        from tutel.experts.ffn import FusedExpertsNetwork
+        from tutel.experts.llama_ffn import LlamaFFNNetwork
+        gathers = []
+        fake_gather = lambda input, group=None: (gathers.append(input), torch.cat([input, input]) if input.dim() == 1 else input)[1]
+        torch.manual_seed(0)
+        for module in [FusedExpertsNetwork(8, 16, 2, 1), LlamaFFNNetwork(8, 16, 2, 2)]:
+            x = torch.randn([2, 3, 8], requires_grad=True)
+            results = []
+            for recompute in [None, 'expert_hidden', 'full']:
+                ctx = SimpleNamespace(adaptive_degree=0, num_global_experts=2, group=None, megablocks_size=0, sharded_count=1, model_dim=8, recompute=recompute)
+                with patch.object(net, 'zero_gather', fake_gather), patch.object(net, 'zero_gather_prefetch', lambda inputs, group=None: None), \
+                        patch.object(LlamaFFNNetwork, '_get_sharded_group', lambda self, group: None), patch.object(expert_ops, 'TUTEL_FUSED_EXPERTS', False):
+                    y = module(x, ctx)
+                    num_gathers = len(gathers)
+                    grads = torch.autograd.grad(y.sum(), [x] + list(module.parameters()))
+                    self.assertEqual(len(gathers), num_gathers)
+                    gathers.clear()
+                results.append([y] + list(grads))
+            for result in results[1:]:
+                for a, b in zip(results[0], result):
+                    self.assertTrue(torch.allclose(a, b))
+
+    def test_bucketed_grad_allreduce(self):
+        """Test bucketed async all_reduce of shared grads on cpu (gloo) backend"""
+        losses = self.tutelCaller.run(nproc_per_node=2, num_steps=10, device='cpu', show_step_time=False)
+        bucketed_losses = self.tutelCaller.run(nproc_per_node=2, num_steps=10, device='cpu', show_step_time=False, grad_bucket_mb=0.001)
+        self.assertEqual(losses, bucketed_losses)
+
+    def test_shm_a2a(self):
+        """Test shared-memory all_to_all between cpu ranks, including background exchanges overlapped with shared experts"""
+        for nproc_per_node, shared_expert_hidden in itertools.product([2, 4], [0, 512]):
+            losses = self.tutelCaller.run(nproc_per_node=nproc_per_node, num_steps=10, device='cpu', show_step_time=False, shared_expert_hidden=shared_expert_hidden)
+            with patch.dict('os.environ', {'TUTEL_SHM_A2A': '1', 'TUTEL_SHM_RING_BYTES': '65536'}):
+                shm_losses = self.tutelCaller.run(nproc_per_node=nproc_per_node, num_steps=10, device='cpu', show_step_time=False, shared_expert_hidden=shared_expert_hidden)
+            self.assertEqual(losses, shm_losses)
+
+    def test_fused_swiglu_expert(self):
+        """Test fused SwiGLU experts against unfused matmuls on cpu"""
+        import torch
+        from tutel.impls import expert_ops
+        torch.manual_seed(0)
+        x, w1, w2, w3 = [torch.randn(shape, requires_grad=True) for shape in ([2, 5, 8], [2, 8, 16], [2, 8, 16], [2, 16, 8])]
+        dy = torch.randn([2, 5, 8])
+        expected = torch.matmul(torch.nn.functional.silu(torch.matmul(x, w1)) * torch.matmul(x, w2), w3)
+        output = expert_ops.swiglu_expert(x, w1, w2, w3)
+        self.assertTrue(torch.allclose(output, expected, rtol=1e-4, atol=1e-4))
+        grads = torch.autograd.grad(expected, [x, w1, w2, w3], dy)
+        fused_grads = torch.autograd.grad(output, [x, w1, w2, w3], dy)
+        for grad, fused_grad in zip(grads, fused_grads):
+            self.assertTrue(torch.allclose(grad, fused_grad, rtol=1e-4, atol=1e-4))
+
+        for nproc_per_node in [1, 2]:
+            self.assertFusedLossesClose(nproc_per_node=nproc_per_node, num_steps=10, expert_type='llama_ffn', activation_fn='silu')
+
+    def test_fused_ffn_epilogue(self):
+        """Test fused bias + activation epilogue of ffn experts against unfused ops on cpu"""
+        for nproc_per_node, activation_fn in itertools.product([1, 2], ['relu', 'gelu', 'silu']):
+            self.assertFusedLossesClose(nproc_per_node=nproc_per_node, num_steps=10, activation_fn=activation_fn)
+
+    def test_recompute(self):
+        """Test that recomputing expert activations in backward keeps losses unchanged on cpu"""
+        for nproc_per_node, expert_type in itertools.product([1, 2], ['ffn', 'llama_ffn']):
+            losses = self.tutelCaller.run(nproc_per_node=nproc_per_node, num_steps=10, device='cpu', show_step_time=False, expert_type=expert_type)
+            for recompute in ['expert_hidden', 'full']:
+                recompute_losses = self.tutelCaller.run(nproc_per_node=nproc_per_node, num_steps=10, device='cpu', show_step_time=False, expert_type=expert_type, recompute=recompute)
+                self.assertEqual(losses, recompute_losses)
+
+    def test_replicate_hot_experts(self):
+        """Test replicating hot experts to match static expert placement for dropless routing on cpu"""
+        losses = self.tutelCaller.run(nproc_per_node=2, num_steps=10, device='cpu', show_step_time=False, capacity_factor=0)
+        for replicate_hot_experts in [1, 2]:
+            replicated_losses = self.tutelCaller.run(nproc_per_node=2, num_steps=10, device='cpu', show_step_time=False, capacity_factor=0, replicate_hot_experts=replicate_hot_experts)
+            self.assertLossesClose(replicated_losses, losses)
+
+    def test_replica_plan(self):
+        """Test that replica slots are only used once the load gathered with the dropless capacity places a replica"""
+        import torch
+        from tutel.impls.replication import HotExpertReplicator
+        replicator = HotExpertReplicator(2, 2, 1, None)
+        self.assertFalse(replicator.has_replicas)
+        dispatch_count = torch.tensor([9, 1, 0, 0])
+        dispatch_count.global_counts = torch.tensor([[6, 1, 0, 0], [3, 0, 0, 0]])
+        replicator.update(dispatch_count, None, None)
+        self.assertTrue(replicator.has_replicas)
+        self.assertEqual(replicator.replica_experts, [-1, 0])
+        self.assertEqual(replicator.expert_slots[0].tolist(), [0, 5])
+        self.assertEqual(replicator.num_used_slots(replicator.replica_experts), 0)
+
+    def test_shared_experts(self):
+        """Test shared experts fused into fast_decode against a separate addition on cpu (gloo)"""
+        import torch
+        from tutel import moe
+        torch.manual_seed(0)
+        scores = torch.randn([64, 4]).softmax(dim=1)
+        crit, _ = moe.extract_critical(scores, top_k=2, loss_fn=None, capacity_factor=1.0)
+        data = torch.randn([crit[0], crit[4], 16], requires_grad=True)
+        residual = torch.randn([64, 16], requires_grad=True)
+        expected = moe.fast_decode(data, crit) + residual
+        output = moe.fast_decode(data, crit, residual=residual * 1)
+        self.assertTrue(torch.allclose(output, expected, atol=1e-5))
+        grads = torch.autograd.grad(expected.square().sum(), [data, residual])
+        fused_grads = torch.autograd.grad(output.square().sum(), [data, residual])
+        for x, y in zip(grads, fused_grads):
+            self.assertTrue(torch.allclose(x, y, atol=1e-5))
+
+        # A user module whose last op saves its output for backward
+        shared_experts = torch.nn.Sequential(torch.nn.Linear(16, 16), torch.nn.Sigmoid())
+        layer = moe.moe_layer(gate_type={'type': 'top', 'k': 2}, experts={'type': 'ffn', 'num_experts_per_device': 4, 'hidden_size_per_expert': 32}, model_dim=16, shared_experts=shared_experts)
+        x = torch.randn([2, 8, 16], requires_grad=True)
+        output = layer(x)
+        grads = torch.autograd.grad(output.square().sum(), [x, shared_experts[0].weight])
+        layer.shared_experts = None
+        expected = layer(x) + shared_experts(x.view(-1, 16)).view(x.shape)
+        self.assertTrue(torch.allclose(output, expected, atol=1e-5))
+        for grad, expected_grad in zip(grads, torch.autograd.grad(expected.square().sum(), [x, shared_experts[0].weight])):
+            self.assertTrue(torch.allclose(grad, expected_grad, atol=1e-5))
+
+        for nproc_per_node in [1, 2]:
+            self.assertFusedLossesClose(nproc_per_node=nproc_per_node, num_steps=10, shared_expert_hidden=512)
+
+    def test_fused_gate_cpu(self):
+        """Test the fused cpu linear gate routing against softmax, top-k and gshard_loss in torch"""
+        import torch
+        from tutel import moe
+        from tutel.impls.fast_dispatch import fused_gate_topk
+        from tutel.impls.losses import gshard_loss
+        if not hasattr(torch.ops.tutel_ops, 'moe_gate_topk'):
+            self.skipTest('tutel_ops.moe_gate_topk is not built.')
+        torch.manual_seed(0)
+        for top_k, num_experts in [(1, 4), (2, 8), (4, 20)]:
+            x, wg = torch.randn([96, 32], requires_grad=True), torch.randn([num_experts, 32], requires_grad=True)
+            scores = torch.softmax(torch.matmul(x, wg.t()), dim=1)
+            crit, l_aux = moe.extract_critical(scores, top_k=top_k, loss_fn=gshard_loss)
+            fused_scores, routed = fused_gate_topk(x, wg, top_k)
+            fused_crit, fused_l_aux = moe.extract_critical(fused_scores, top_k=top_k, routed=routed)
+            self.assertTrue(torch.allclose(scores, fused_scores, atol=1e-6))
+            self.assertTrue(torch.allclose(l_aux, fused_l_aux, atol=1e-5))
+            for i in (1, 2):
+                for a, b in zip(crit[i], fused_crit[i]):
+                    self.assertTrue(torch.equal(a, b))
+            self.assertEqual(crit[4], fused_crit[4])
+            target = lambda crit, l_aux: sum((x * torch.arange(1, x.numel() + 1)).sum() for x in crit[3]) + l_aux * 10
+            grads = torch.autograd.grad(target(crit, l_aux), [x, wg])
+            fused_grads = torch.autograd.grad(target(fused_crit, fused_l_aux), [x, wg])
+            for a, b in zip(grads, fused_grads):
+                self.assertTrue(torch.allclose(a, b, rtol=1e-4, atol=1e-4))
+
+        for nproc_per_node in [1, 2]:
+            self.assertFusedLossesClose(nproc_per_node=nproc_per_node, num_steps=10)
+
+    def test_native_losses_cpu(self):
+        """Test native cpu gshard and load-importance losses against torch, and across thread counts"""
+        import torch
+        from tutel.impls import expert_ops, losses
+        if not hasattr(torch.ops.tutel_ops, 'moe_load_importance_stats'):
+            self.skipTest('tutel_ops.moe_load_importance_stats is not built.')
+        torch.manual_seed(0)
+        logits = torch.randn([1000, 16], requires_grad=True)
+        def run_losses():
+            scores = torch.softmax(logits, dim=1)
+            topk_logits, topk_ids = logits.topk(2, dim=1)
+            l_gshard = losses.gshard_loss(scores, topk_ids)
+            l_load = losses.load_importance_loss(scores, topk_logits, 16, 1.0)
+            return [l_gshard, l_load] + list(torch.autograd.grad(l_gshard + l_load, [logits]))
+        with patch.object(expert_ops, 'TUTEL_FUSED_EXPERTS', False):
+            ref = run_losses()
+        num_threads = torch.get_num_threads()
+        results = []
+        for threads in sorted({1, 4, num_threads}):
+            torch.set_num_threads(threads)
+            results.append(run_losses())
+        torch.set_num_threads(num_threads)
+        for x, y in zip(ref, results[0]):
+            self.assertTrue(torch.allclose(x, y, rtol=1e-4, atol=1e-6))
+        for result in results[1:]:
+            for x, y in zip(results[0], result):
+                self.assertTrue(torch.equal(x, y))
+
+    def test_cosine_gate_cpu(self):
+        """Test the native cpu cosine router and its cached expert embeddings against torch"""
+        import torch
+        from tutel.gates.cosine_top import CosineTopKGate
+        from tutel.impls import expert_ops
+        if not hasattr(torch.ops.tutel_ops, 'cosine_logits'):
+            self.skipTest('tutel_ops.cosine_logits is not built.')
+        torch.manual_seed(0)
+        for dtype in [torch.float32, torch.bfloat16]:
+            gate = CosineTopKGate(model_dim=64, num_global_experts=12, k=2, proj_dim=40).to(dtype)
+            x = torch.randn([100, 64], dtype=dtype)
+            for step in range(2):
+                with torch.no_grad():
+                    with patch.object(expert_ops, 'TUTEL_FUSED_EXPERTS', False):
+                        ref = gate(x)
+                    logits = gate(x)
+                    gate.sim_matrix.add_(torch.randn_like(gate.sim_matrix) * 0.01)
+                tol = 1e-5 if dtype == torch.float32 else 5e-2
+                self.assertTrue(torch.allclose(logits.float(), ref.float(), rtol=tol, atol=tol))
+
+    def test_sorted_locations_cpu(self):
+        """Test native cpu batch-prioritized locations against argsort-based ones in torch"""
+        import torch
+        from tutel import moe
+        from tutel.impls import expert_ops
+        if not hasattr(torch.ops.tutel_ops, 'moe_sorted_locations'):
+            self.skipTest('tutel_ops.moe_sorted_locations is not built.')
+        torch.manual_seed(0)
+        for top_k, num_samples in [(1, 100), (2, 20000), (4, 5000)]:
+            scores = torch.randn([num_samples, 16]).softmax(dim=1)
+            with patch.object(expert_ops, 'TUTEL_FUSED_EXPERTS', False):
+                ref, _ = moe.extract_critical(scores, top_k=top_k, loss_fn=None, batch_prioritized_routing=True)
+            crit, _ = moe.extract_critical(scores, top_k=top_k, loss_fn=None, batch_prioritized_routing=True)
+            for x, y in zip(ref[2], crit[2]):
+                self.assertTrue(torch.equal(x, y))
+            self.assertEqual(ref[4], crit[4])
+            dispatch_count = sum(torch.bincount(x.long(), minlength=16) for x in crit[1])
+            self.assertTrue(torch.equal(crit[-1], dispatch_count))
+
+    def test_expert_choice(self):
+        """Test expert-choice routing of the native cpu op against torch, and end-to-end on cpu (gloo)"""
+        import torch
+        from tutel import moe
+        from tutel.impls import expert_ops
+        torch.manual_seed(0)
+        for top_k, capacity_factor in [(1, 1.0), (2, 1.5), (1, 4.0)]:
+            scores = torch.randn([96, 8]).softmax(dim=1)
+            crit, l_aux = moe.extract_critical(scores, top_k=top_k, capacity_factor=capacity_factor, expert_choice=True)
+            with patch.object(expert_ops, 'TUTEL_FUSED_EXPERTS', False):
+                ref, _ = moe.extract_critical(scores, top_k=top_k, capacity_factor=capacity_factor, expert_choice=True)
+            for i in (1, 2, 3):
+                self.assertEqual(len(crit[i]), len(ref[i]))
+                for x, y in zip(crit[i], ref[i]):
+                    self.assertTrue(torch.equal(x, y))
+            indices, locations = torch.stack(crit[1]), torch.stack(crit[2])
+            picks = min(crit[4], scores.size(0))
+            for e in range(8):
+                selected = (indices == e).nonzero()[:, 1]
+                self.assertEqual(selected.numel(), picks)
+                self.assertTrue(torch.equal(locations[indices == e].sort().values, torch.arange(picks, dtype=torch.int32)))
+                self.assertTrue(torch.equal(selected.sort().values, scores[:, e].topk(picks).indices.sort().values))
+            self.assertEqual(float(l_aux), 0.0)
+
+        for nproc_per_node in [1, 2]:
+            fused_losses = self.assertFusedLossesClose(nproc_per_node=nproc_per_node, num_steps=10, gate_type='expert_choice')
+            self.assertTrue(all(math.isfinite(x) for x in fused_losses))
+
+    def test_deterministic_routing(self):
+        """Test that deterministic routing on cpu is bitwise identical at 1, 4 and N threads, and breaks ties to lower ids"""
+        import torch
+        from tutel import moe
+        from tutel.impls import losses
+        from tutel.impls.fast_dispatch import fused_gate_topk
+        torch.manual_seed(0)
+        x, wg = torch.randn([4096, 64]), torch.randn([16, 64])
+        wg[5] = wg[3]
+        # Scores with plenty of ties across experts and tokens
+        tied_scores = torch.randint(0, 4, [4096, 16]).float().softmax(dim=1)
+        loss_fn = lambda scores, topk_ids: losses.gshard_loss(scores, topk_ids, deterministic=True)
+        def route():
+            results = []
+            if hasattr(torch.ops.tutel_ops, 'moe_gate_topk'):
+                scores, routed = fused_gate_topk(x, wg, 2)
+                results.append(moe.extract_critical(scores, top_k=2, routed=routed, deterministic=True))
+            for batch_prioritized_routing in [False, True]:
+                results.append(moe.extract_critical(tied_scores, top_k=2, loss_fn=loss_fn, batch_prioritized_routing=batch_prioritized_routing, deterministic=True))
+            results.append(moe.extract_critical(tied_scores, top_k=2, capacity_factor=2.0, expert_choice=True, deterministic=True))
+            flatten = lambda x: sum([flatten(y) for y in x], []) if isinstance(x, (tuple, list)) else [x]
+            return flatten(results)
+
+        num_threads = torch.get_num_threads()
+        results = []
+        for threads in sorted({1, 4, num_threads}):
+            torch.set_num_threads(threads)
+            results.append(route())
+        torch.set_num_threads(num_threads)
+        for result in results[1:]:
+            self.assertEqual(len(result), len(results[0]))
+            for x, y in zip(results[0], result):
+                self.assertTrue(torch.equal(x, y) if isinstance(x, torch.Tensor) else x == y)
+
+        crit, _ = moe.extract_critical(tied_scores, top_k=1, deterministic=True)
+        self.assertTrue(torch.equal(crit[1][0], tied_scores.argmax(dim=1).int()))
+
+    def test_quantized_experts(self):
+        """Test weight-only int8/int4 experts against dense ffn experts on cpu"""
+        for nproc_per_node in [1, 2]:
+            losses = self.tutelCaller.run(nproc_per_node=nproc_per_node, num_steps=4, device='cpu', show_step_time=False, eval=True)
+            for quant_bits, rel_tol in [(8, 1e-2), (4, 1e-1)]:
+                quant_losses = self.assertFusedLossesClose(nproc_per_node=nproc_per_node, num_steps=4, eval=True, expert_type='ffn_q', quant_bits=quant_bits)
+                self.assertLossesClose(quant_losses, losses, tol=rel_tol)
+
+    def test_mapped_experts(self):
+        """Test memory-mapped experts against dense ffn experts on cpu"""
+        import tempfile
+        import torch
+        from tutel.impls.expert_store import ExpertStore, save_expert_store
+        with tempfile.TemporaryDirectory() as expert_dir:
+            path = os.path.join(expert_dir, 'experts')
+            w, b = torch.randn([4, 8, 16], dtype=torch.bfloat16), torch.randn([4, 8])
+            save_expert_store(path, {'w': w, 'b': b})
+            store = ExpertStore(path, max_resident_experts=2)
+            for e in range(4):
+                self.assertTrue(torch.equal(store.get(e)['w'], w[e]))
+                self.assertTrue(torch.equal(store.get(e)['b'], b[e]))
+            store.touch([3, 1])
+            store.touch([0, 3])
+            self.assertEqual(list(store.resident), [0, 3])
+
+            from tutel.experts.ffn_mmap import MappedExpertsNetwork
+            with self.assertRaises(AssertionError):
+                MappedExpertsNetwork(8, 16, 2, 1, path=os.path.join(expert_dir, 'missing'))
+            self.assertEqual(MappedExpertsNetwork(8, 16, 2, 1, path=os.path.join(expert_dir, 'missing'), initialize=True).store.num_experts, 2)
+
+            # Experts receiving only all-zero tokens still output their biased ffn, experts receiving no tokens are skipped
+            from types import SimpleNamespace
+            mapped = MappedExpertsNetwork(8, 16, 2, 1, path=os.path.join(expert_dir, 'biased'), initialize=True)
+            fc1_w, fc1_bias, fc2_w, fc2_bias = torch.randn([2, 16, 8]), torch.randn([2, 16]), torch.randn([2, 16, 8]), torch.randn([2, 8])
+            mapped.load_dense(fc1_w, fc1_bias, fc2_w, fc2_bias)
+            x = torch.zeros([2, 3, 8])
+            expected = torch.matmul(torch.relu(torch.matmul(x, fc1_w.permute(0, 2, 1)) + fc1_bias.unsqueeze(1)), fc2_w) + fc2_bias.unsqueeze(1)
+            dispatch_count = torch.tensor([2, 0])
+            dispatch_count.global_counts = dispatch_count.view(1, -1)
+            y = mapped(x, SimpleNamespace(dispatch_count=dispatch_count, group=None))
+            self.assertTrue(torch.allclose(y[0], expected[0], atol=1e-4))
+            self.assertTrue(torch.equal(y[1], torch.zeros_like(y[1])))
+            y = mapped(x, SimpleNamespace(dispatch_count=torch.tensor([2, 0]), group=None))
+            self.assertTrue(torch.allclose(y, expected, atol=1e-4))
+
+        for nproc_per_node, capacity_factor in itertools.product([1, 2], [None, 0]):
+            losses = self.tutelCaller.run(nproc_per_node=nproc_per_node, num_steps=4, device='cpu', show_step_time=False, eval=True, capacity_factor=capacity_factor)
+            mapped_losses = self.tutelCaller.run(nproc_per_node=nproc_per_node, num_steps=4, device='cpu', show_step_time=False, eval=True, expert_type='ffn_mmap', capacity_factor=capacity_factor)
+            self.assertLossesClose(mapped_losses, losses)
+
+    def test_fp8_block_gemm_cpu(self):
+        """Test cpu bf16 x fp8 block-scaled gemm and glu experts against from_float8_blockwise()"""
+        import torch
+        from tutel import ops
+        torch.manual_seed(0)
+        samples, model_dim, inter, experts, top_k = 5, 320, 256, 4, 2
+        x = torch.randn([1, samples, model_dim], dtype=torch.bfloat16)
+
+        w, ws = ops.to_float8_blockwise(torch.randn([200, model_dim]))
+        y = ops.gemm_nt_bf16xfp8_block_scal_out(x, w, ws, None, None)
+        ref = torch.matmul(x.float(), ops.from_float8_blockwise(w, ws, dtype=torch.float32).t())
+        self.assertLess(float((y.float() - ref).abs().max()), 1e-2 * float(ref.abs().max()))
+
+        gate_up_w, gate_up_s = ops.to_float8_blockwise(torch.randn([experts, inter * 2, model_dim]) * 0.1)
+        down_w, down_s = ops.to_float8_blockwise(torch.randn([experts, model_dim, inter]) * 0.1)
+        expert_ids, expert_weight = torch.randint(0, experts, [samples, top_k], dtype=torch.int32), torch.rand([samples, top_k])
+        y = ops.glu_expert_bf16xf8_block_scal(x, expert_ids, expert_weight, gate_up_w, gate_up_s, down_w, down_s, torch.empty_like(x))
+        gate_up, down = ops.from_float8_blockwise(gate_up_w, gate_up_s, dtype=torch.float32), ops.from_float8_blockwise(down_w, down_s, dtype=torch.float32)
+        ref = torch.zeros([samples, model_dim])
+        for i in range(samples):
+            for k in range(top_k):
+                gate, up = torch.matmul(gate_up[int(expert_ids[i, k])], x[0, i].float()).chunk(2)
+                ref[i] += expert_weight[i, k] * torch.matmul(down[int(expert_ids[i, k])], torch.nn.functional.silu(gate) * up)
+        self.assertLess(float((y.view(samples, -1).float() - ref).abs().max()), 1e-2 * float(ref.abs().max()))
+
+    def test_native_quantizers_cpu(self):
+        """Test cpu quantization kernels to be bit-exact with tutel.ops python references"""
+        import torch
+        from tutel import ops
+        torch.manual_seed(0)
+        for dtype in [torch.float32, torch.bfloat16, torch.float16]:
+            x = torch.randn([3, 200, 320], dtype=dtype) * torch.logspace(-6, 2, 200).view(1, -1, 1).to(dtype)
+            x[0, 0].zero_()
+            scale_o, results = torch.rand([3, 4]), []
+            for native in [True, False]:
+                with patch.object(ops, 'TUTEL_NATIVE_QUANT', native):
+                    q = ops.to_float8_rowwise(x)
+                    w, ws = ops.to_float8_blockwise(x)
+                    w2, ws2 = ops.to_float8_blockwise(x[1], block_size=64)
+                    fp4, fp4_s, fp4_o = ops.to_float4_groupwise(x)
+                    y, y_o = ops.from_float4_groupwise(fp4, fp4_s), ops.from_float4_groupwise(fp4, fp4_s, scale_o, dtype=dtype)
+                    results.append([q.view(torch.uint8), q.scale_inv, w.view(torch.uint8), ws, w2.view(torch.uint8), ws2, fp4, fp4_s.view(torch.uint8), fp4_o, y, y_o])
+            for native, ref in zip(*results):
+                self.assertEqual(native.shape, ref.shape)
+                self.assertEqual(native.dtype, ref.dtype)
+                self.assertTrue(torch.equal(native, ref))
+
+    def test_native_marlin_pack_cpu(self):
+        """Test cpu marlin pack/unpack kernels against tutel.ops python references"""
+        import torch
+        from tutel import ops
+        torch.manual_seed(0)
+        w = torch.randint(0, 256, [2, 128, 4, 16], dtype=torch.uint8)
+        results = []
+        for native in [True, False]:
+            with patch.object(ops, 'TUTEL_NATIVE_QUANT', native):
+                y, y_nv = ops.marlin_pack(w), ops.marlin_nvfp4_pack(w.view(2, 128, 8, 8))
+                out = torch.empty_like(y)
+                ops.marlin_pack(w, out=out)
+                results.append([y, y_nv, out, ops.marlin_unpack(y, 32), ops.marlin_nvfp4_revert(y_nv)])
+        for native, ref in zip(*results):
+            self.assertEqual(native.shape, ref.shape)
+            self.assertTrue(torch.equal(native, ref))
+        self.assertTrue(torch.equal(results[0][3].flatten(), w.flatten()))
+        self.assertTrue(torch.equal(results[0][4].flatten(), w.flatten()))
+
+    def test_marlin_permute_scales(self):
+        """Test marlin_permute_scales() with a composed gather index against permuting scales step by step"""
+        import torch
+        from tutel import ops
+        torch.manual_seed(0)
+
+        def permute_scales_ref(s, group_size):
+            scale_perm = [i + 8 * j for i in range(8) for j in range(8)]
+            scale_perm_single = [2 * i + j for i in range(4) for j in [0, 1, 8, 9, 16, 17, 24, 25]]
+            if group_size != 16:
+                s = s.view(torch.float8_e8m0fnu)
+            s = s.transpose(1, 2).to(torch.bfloat16)
+            size_k, size_n = s.size(-2) * group_size, s.size(-1)
+            if group_size < size_k and group_size != -1:
+                s = s.reshape((s.size(0), -1, len(scale_perm)))[:, :, scale_perm]
+            else:
+                s = s.reshape((s.size(0), -1, len(scale_perm_single)))[:, :, scale_perm_single]
+            s = s.reshape((s.size(0), -1, size_n)).contiguous()
+            if group_size == 16:
+                s = s.to(torch.half)
+            s = s.view(s.size(0), s.size(1) // 2, 2, -1, 8).permute(0, 1, 3, 2, 4).reshape(s.size(0), s.size(1), -1)
+            s = s.view(s.size(0), -1, 4)[:, :, [0, 2, 1, 3]].view(s.size(0), s.size(1), -1)
+            if group_size != 16:
+                return s.to(torch.float8_e8m0fnu)
+            s = ((s * (2**7)).view(torch.int16) << 1).view(torch.float8_e4m3fn)
+            return s[:, :, 1::2].contiguous()
+
+        for k_groups in [2, 4]:
+            mx_scales = torch.randint(100, 140, [2, 128, k_groups], dtype=torch.uint8)
+            nv_scales = torch.rand([2, 128, k_groups]) * 2 + 0.01
+            for s, group_size in [(mx_scales, 32), (nv_scales.to(torch.float8_e4m3fn), 16), (nv_scales.to(torch.bfloat16), 16)]:
+                y, ref = ops.marlin_permute_scales(s, group_size), permute_scales_ref(s, group_size)
+                self.assertEqual(y.dtype, ref.dtype)
+                self.assertTrue(torch.equal(y.view(torch.uint8), ref.view(torch.uint8)))
+
+    def test_native_routers_cpu(self):
+        """Test cpu fused scaled top-k routers against tutel.ops python references"""
+        import torch
+        from tutel import ops
+        torch.manual_seed(0)
+        configs = [
+            dict(top_k=8, n_group=8, topk_group=4, score_func='sigmoid', routed_scale=2.5),
+            dict(top_k=8, score_func='sigmoid', routed_scale=2.827),
+            dict(top_k=8, score_func='softmax'),
+            dict(top_k=6, n_group=4, topk_group=2, score_func='softmax', normalize=False),
+        ]
+        # Distinct logits per row that are exact in bf16, so that no ties leave the selection to tie-breaking
+        distinct_logits = lambda rows: torch.stack([torch.randperm(256) for _ in range(rows)]).sub(128).div(32)
+        for config, dtype in itertools.product(configs, [torch.float32, torch.bfloat16]):
+            logits, bias = distinct_logits(200).view(2, 100, 256).to(dtype), torch.randn([256]) * 0.1
+            if config['score_func'] == 'softmax':
+                bias = None
+            results = []
+            for native in [True, False]:
+                with patch.object(ops, 'TUTEL_NATIVE_QUANT', native):
+                    results.append(ops.moe_scaled_topk(logits, bias=bias, **config))
+            self.assertTrue(torch.equal(results[0][1], results[1][1]))
+            self.assertTrue(torch.allclose(results[0][0], results[1][0], rtol=1e-5, atol=1e-6))
+
+        logits, bias = distinct_logits(100).bfloat16(), torch.randn([256], dtype=torch.bfloat16) * 0.1
+        for name, config in [('deepseek_moe_sigmoid_scaled_topk', configs[0]), ('kimi_moe_sigmoid_scaled_topk', configs[1])]:
+            if hasattr(torch.ops.tutel_ops, name):
+                with patch.object(ops, 'TUTEL_NATIVE_QUANT', False):
+                    ref = ops.moe_scaled_topk(logits, bias=bias, **config)
+                top_v, top_k = torch.empty([100, 4]), torch.empty([100, 4], dtype=torch.int32)
+                getattr(torch.ops.tutel_ops, name)(logits, bias, top_v, top_k)
+                self.assertTrue(torch.equal(top_k, ref[1][:, :4]))
+        if hasattr(torch.ops.tutel_ops, 'qwen3_moe_scaled_topk'):
+            probs = distinct_logits(100).softmax(dim=-1)
+            with patch.object(ops, 'TUTEL_NATIVE_QUANT', False):
+                ref = ops.moe_scaled_topk(probs, 8, score_func='none')
+            top_v, top_k = torch.ops.tutel_ops.qwen3_moe_scaled_topk(probs)
+            self.assertTrue(torch.equal(top_k, ref[1]))
+            self.assertTrue(torch.allclose(top_v, ref[0], rtol=1e-5, atol=1e-6))
+
+    def test_native_rmsnorm_cpu(self):
+        """Test cpu rmsnorm and fused residual add + rmsnorm against torch references"""
+        import torch
+        from tutel import ops
+        if not hasattr(torch.ops.tutel_ops, 'add_rmsnorm'):
+            self.skipTest('tutel_ops.add_rmsnorm is not built.')
+        torch.manual_seed(0)
+        rmsnorm = lambda x, w, eps: x.float() * torch.rsqrt(x.float().pow(2).mean(-1, keepdim=True) + eps) * w.float()
+        for dtype, tol in [(torch.float32, 1e-5), (torch.bfloat16, 2e-2)]:
+            x, t, w = torch.randn([2, 5, 200], dtype=dtype), torch.randn([2, 5, 200], dtype=dtype), torch.randn([200], dtype=dtype)
+            h, y = torch.ops.tutel_ops.add_rmsnorm(x, t, w, 1e-6)
+            self.assertTrue(torch.equal(h, x + t))
+            self.assertTrue(torch.allclose(y.float(), rmsnorm(h, w, 1e-6), rtol=tol, atol=tol))
+            if hasattr(torch.ops.tutel_ops, 'rmsnorm_bf16'):
+                y = torch.ops.tutel_ops.rmsnorm_bf16(x, w[:128].contiguous(), 1e-6, 64)
+                self.assertEqual(list(y.shape), [2, 5, 128])
+                self.assertTrue(torch.allclose(y.float(), rmsnorm(x[..., 64:192], w[:128], 1e-6), rtol=tol, atol=tol))
+
+    def test_native_rotary_kvcache_cpu(self):
+        """Test cpu fused q/k norm, rotary embedding and kv-cache write against torch references"""
+        import torch
+        from tutel import ops
+        if not hasattr(torch.ops.tutel_ops, 'norm_rotary_kvcache'):
+            self.skipTest('tutel_ops.norm_rotary_kvcache is not built.')
+        torch.manual_seed(0)
+        batch, seqlen, n_heads, kv_heads, head_dim, num_slots = 2, 3, 4, 2, 64, 10
+        freqs = torch.arange(32).float().view(-1, 1) * torch.pow(10000, -torch.arange(0, head_dim, 2).float() / head_dim)
+        cos, sin = freqs.cos(), freqs.sin()
+
+        def reference(x, w, pos):
+            if w is not None:
+                x = x.float() * torch.rsqrt(x.float().pow(2).mean(-1, keepdim=True) + 1e-6) * w.float()
+            x1, x2 = x.float().chunk(2, dim=-1)
+            c, s = cos[pos].unsqueeze(-2), sin[pos].unsqueeze(-2)
+            return torch.cat([x1 * c - x2 * s, x2 * c + x1 * s], dim=-1)
+
+        for dtype, tol in [(torch.float32, 1e-5), (torch.bfloat16, 2e-2)]:
+            qkv = torch.randn([batch, seqlen, (n_heads + 2 * kv_heads) * head_dim], dtype=dtype)
+            q_norm, k_norm = torch.randn([head_dim], dtype=dtype), torch.randn([head_dim], dtype=dtype)
+            positions, slots = torch.randint(0, 32, [batch, seqlen]), torch.tensor([[7, 0, -1], [3, 9, 4]])
+            q, k, v = qkv.view(batch, seqlen, -1, head_dim).split([n_heads, kv_heads, kv_heads], dim=2)
+            for norms in [(q_norm, k_norm), (None, None)]:
+                key_cache, val_cache = torch.zeros([num_slots, kv_heads, head_dim], dtype=dtype), torch.zeros([num_slots, kv_heads, head_dim], dtype=dtype)
+                q_out = torch.ops.tutel_ops.norm_rotary_kvcache(qkv, positions, slots, cos, sin, key_cache, val_cache, norms[0], norms[1], n_heads, 1e-6)
+                self.assertTrue(torch.allclose(q_out.float(), reference(q, norms[0], positions), rtol=tol, atol=tol))
+                written = slots.view(-1) >= 0
+                k_ref = reference(k, norms[1], positions).flatten(0, 1)[written]
+                self.assertTrue(torch.allclose(key_cache[slots.view(-1)[written]].float(), k_ref, rtol=tol, atol=tol))
+                self.assertTrue(torch.equal(val_cache[slots.view(-1)[written]], v.flatten(0, 1)[written]))
+                self.assertEqual(int((key_cache.abs().sum([1, 2]) > 0).sum()), int(written.sum()))
+
+        # Positions past the kv cache rows of a sequence are rejected, even though the rotary cache covers them
+        key_cache, val_cache = [torch.zeros([batch, 4, kv_heads, head_dim], dtype=torch.bfloat16) for _ in range(2)]
+        qkv, qk_norm = torch.randn([batch, seqlen, (n_heads + 2 * kv_heads) * head_dim], dtype=torch.bfloat16), torch.ones([2 * head_dim], dtype=torch.bfloat16)
+        torch.ops.tutel_ops.qwen3_norm_rotary_kvcache2_bf16(cos, sin, torch.tensor([[0, 1, 3], [1, 2, 3]]), qkv, key_cache, val_cache, qk_norm, n_heads)
+        for positions in [torch.tensor([[0, 1, 4], [1, 2, 3]]), torch.tensor([[0, -1, 2], [1, 2, 3]]), torch.tensor([0, 1, 2])]:
+            with self.assertRaises(RuntimeError):
+                torch.ops.tutel_ops.qwen3_norm_rotary_kvcache2_bf16(cos, sin, positions, qkv, key_cache, val_cache, qk_norm, n_heads)
+
+    def test_paged_kv_cache(self):
+        """Test tutel.serving.KVCache block allocation, prefix sharing with copy-on-write and kv index generation"""
+        import torch
+        from tutel.serving import KVCache
+        cache = KVCache(num_blocks=6, block_size=4, kv_heads=1, head_dim=2, num_layers=2, dtype=torch.float32)
+        write = lambda slots, value: [cache.keys(l).index_fill_(0, slots, value) for l in range(2)]
+
+        cache.add_sequence('a')
+        write(cache.append('a', 6), 1.0)
+        self.assertEqual(cache.num_free_blocks, 4)
+        cache.add_sequence('b', fork_from='a')
+        self.assertEqual(cache.num_free_blocks, 4)
+
+        # The shared full block stays shared, the shared partial block is copied before 'b' writes to it
+        slots = cache.append('b', 3)
+        write(slots, 2.0)
+        self.assertEqual(cache.num_free_blocks, 2)
+        self.assertEqual(cache.block_tables['a'][0], cache.block_tables['b'][0])
+        self.assertTrue(torch.equal(cache.keys(1)[cache.slots('a')].view(-1), torch.ones([12])))
+        self.assertTrue(torch.equal(cache.keys(1)[cache.slots('b')].view(-1), torch.tensor([1.0] * 12 + [2.0] * 6)))
+
+        kv_indices, kv_ranges = cache.kv_indices(['a', 'b'])
+        self.assertEqual(kv_indices.dtype, torch.int32)
+        self.assertEqual(kv_ranges.tolist(), [0, 6, 15])
+        self.assertEqual(kv_indices[6:].tolist(), cache.slots('b').tolist())
+        self.assertEqual(cache.blocks_needed('a', 3), 1)
+        with self.assertRaises(AssertionError):
+            cache.append('a', 11)
+
+        cache.free_sequence('a')
+        self.assertEqual(cache.num_free_blocks, 3)
+        cache.free_sequence('b')
+        self.assertEqual(cache.num_free_blocks, 6)
+        self.assertEqual(sum(cache.ref_counts), 0)
+
     def test_a2a_algos(self):
         def get_loss_and_step_time(args):
             with contextlib.redirect_stdout(io.StringIO()) as f:
@@ -0,0 +1,1380 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Host-side kernels used by `tutel_ops` when tensors live on CPU.
+//
+// Every kernel works on raw pointers and a [begin, end) range of independent
+// work items (rows, tokens, ..), so that callers decide the threading policy
+// (e.g. at::parallel_for) and this header stays free of torch dependencies.
+// AVX-512 paths are compiled with function-level target attributes and only
+// taken when the running CPU reports support, with a scalar path otherwise.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define TUTEL_CPU_AVX512 1
+#define TUTEL_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,avx512dq,fma,f16c")))
+#else
+#define TUTEL_CPU_AVX512 0
+#define TUTEL_TARGET_AVX512
+#endif
+
+namespace cpu {
+
+inline bool has_avx512() {
+#if TUTEL_CPU_AVX512
+  static const bool supported = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq");
+  return supported;
+#else
+  return false;
+#endif
+}
+
+struct bf16 { uint16_t bits; };
+struct fp16 { uint16_t bits; };
+
+inline float bits_to_float(uint32_t u) { float f; memcpy(&f, &u, 4); return f; }
+inline uint32_t float_to_bits(float f) { uint32_t u; memcpy(&u, &f, 4); return u; }
+
+inline float to_float(float x) { return x; }
+inline float to_float(bf16 x) { return bits_to_float(uint32_t(x.bits) << 16); }
+inline float to_float(fp16 x) {
+  uint32_t sign = uint32_t(x.bits & 0x8000) << 16, expo = (x.bits >> 10) & 0x1F, mant = x.bits & 0x3FF;
+  if (expo == 0x1F)
+    return bits_to_float(sign | 0x7F800000u | (mant << 13));
+  if (expo == 0) {
+    float v = float(mant) * (1.0f / 16777216.0f);
+    return sign ? -v : v;
+  }
+  return bits_to_float(sign | ((expo + 112) << 23) | (mant << 13));
+}
+
+inline void from_float(float *out, float v) { *out = v; }
+inline void from_float(bf16 *out, float v) {
+  uint32_t u = float_to_bits(v);
+  if ((u & 0x7FFFFFFFu) > 0x7F800000u) {
+    out->bits = 0x7FC0;
+    return;
+  }
+  out->bits = uint16_t((u + 0x7FFFu + ((u >> 16) & 1u)) >> 16);
+}
+inline void from_float(fp16 *out, float v) {
+  uint32_t u = float_to_bits(v), sign = (u >> 16) & 0x8000, a = u & 0x7FFFFFFFu;
+  if (a > 0x7F800000u) {
+    out->bits = uint16_t(sign | 0x7E00);
+  } else if (a >= 0x477FF000u) {
+    out->bits = uint16_t(sign | 0x7C00);
+  } else if (a < 0x38800000u) {
+    // Subnormal range of fp16: the step size is 2^-24, so scaling is exact and nearbyint() rounds to even.
+    out->bits = uint16_t(sign | uint32_t(std::nearbyint(bits_to_float(a) * 16777216.0f)));
+  } else {
+    a += 0xFFFu + ((a >> 13) & 1u);
+    out->bits = uint16_t(sign | ((a - (112u << 23)) >> 13));
+  }
+}
+
+// fp8 e4m3fn (no inf, max = 448) following c10: round-to-nearest-even, NaN from 480 up. Negative zero is flushed to 0x00
+// unless `keep_neg_zero` is set to match torch casts bit-exactly.
+inline uint8_t fp8e4m3_from_float(float v, bool keep_neg_zero = false) {
+  uint32_t u = float_to_bits(v), sign = u & 0x80000000u, f = u ^ sign, code;
+  if (f >= (1087u << 20))
+    code = 0x7F;
+  else if (f < (121u << 23))
+    code = float_to_bits(bits_to_float(f) + bits_to_float(141u << 23)) - (141u << 23);
+  else
+    code = (f + (uint32_t(7 - 127) << 23) + 0x7FFFFu + ((f >> 20) & 1u)) >> 20;
+  return code || keep_neg_zero ? uint8_t(code | (sign >> 24)) : 0;
+}
+
+inline const float* fp8e4m3_table() {
+  static float table[256];
+  static bool initialized = [] {
+    for (int i = 0; i < 256; ++i) {
+      int expo = (i >> 3) & 15, mant = i & 7;
+      float v = expo ? std::ldexp(1.0f + mant / 8.0f, expo - 7) : std::ldexp(mant / 8.0f, -6);
+      table[i] = (i & 0x80) ? -v : v;
+    }
+    table[0x7F] = table[0xFF] = NAN;
+    return true;
+  }();
+  (void)initialized;
+  return table;
+}
+
+#if TUTEL_CPU_AVX512
+TUTEL_TARGET_AVX512 inline __m512 vload(const float *p, __mmask16 m) { return _mm512_maskz_loadu_ps(m, p); }
+TUTEL_TARGET_AVX512 inline __m512 vload(const bf16 *p, __mmask16 m) {
+  return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_maskz_loadu_epi16(m, p)), 16));
+}
+TUTEL_TARGET_AVX512 inline __m512 vload(const fp16 *p, __mmask16 m) { return _mm512_cvtph_ps(_mm256_maskz_loadu_epi16(m, p)); }
+
+TUTEL_TARGET_AVX512 inline void vstore(float *p, __m512 v, __mmask16 m) { _mm512_mask_storeu_ps(p, m, v); }
+TUTEL_TARGET_AVX512 inline void vstore(bf16 *p, __m512 v, __mmask16 m) {
+  __m512i u = _mm512_castps_si512(v);
+  __m512i r = _mm512_add_epi32(u, _mm512_add_epi32(_mm512_set1_epi32(0x7FFF), _mm512_and_si512(_mm512_srli_epi32(u, 16), _mm512_set1_epi32(1))));
+  __mmask16 is_nan = _mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q);
+  r = _mm512_mask_mov_epi32(_mm512_srli_epi32(r, 16), is_nan, _mm512_set1_epi32(0x7FC0));
+  _mm256_mask_storeu_epi16(p, m, _mm512_cvtepi32_epi16(r));
+}
+TUTEL_TARGET_AVX512 inline void vstore(fp16 *p, __m512 v, __mmask16 m) {
+  _mm256_mask_storeu_epi16(p, m, _mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+}
+
+TUTEL_TARGET_AVX512 inline __mmask16 tail_mask(int64_t remain) { return remain >= 16 ? __mmask16(0xFFFF) : __mmask16((1u << remain) - 1); }
+
+TUTEL_TARGET_AVX512 inline __m128i fp8e4m3_from_float_x16(__m512 v, bool keep_neg_zero = false) {
+  __m512i u = _mm512_castps_si512(v), sign = _mm512_srli_epi32(_mm512_and_si512(u, _mm512_set1_epi32(0x80000000)), 24);
+  __m512i f = _mm512_and_si512(u, _mm512_set1_epi32(0x7FFFFFFF));
+  __mmask16 is_nan = _mm512_cmpge_epu32_mask(f, _mm512_set1_epi32(1087 << 20));
+  __mmask16 is_sub = _mm512_cmplt_epu32_mask(f, _mm512_set1_epi32(121 << 23));
+  __m512i sub = _mm512_sub_epi32(_mm512_castps_si512(_mm512_add_ps(_mm512_castsi512_ps(f), _mm512_castsi512_ps(_mm512_set1_epi32(141 << 23)))), _mm512_set1_epi32(141 << 23));
+  __m512i nrm = _mm512_add_epi32(f, _mm512_set1_epi32(int32_t(uint32_t(7 - 127) << 23) + 0x7FFFF));
+  nrm = _mm512_srli_epi32(_mm512_add_epi32(nrm, _mm512_and_si512(_mm512_srli_epi32(f, 20), _mm512_set1_epi32(1))), 20);
+  __m512i code = _mm512_mask_mov_epi32(_mm512_mask_blend_epi32(is_sub, nrm, sub), is_nan, _mm512_set1_epi32(0x7F));
+  __mmask16 signed_mask = keep_neg_zero ? __mmask16(0xFFFF) : _mm512_test_epi32_mask(code, code);
+  return _mm512_cvtepi32_epi8(_mm512_mask_or_epi32(code, signed_mask, code, sign));
+}
+
+// Reinterprets e4m3 bits as fp16 (exponent bias 15 instead of 7), so the result must be scaled by 2^8 afterwards.
+TUTEL_TARGET_AVX512 inline __m512 fp8e4m3_to_float_x16_div256(__m128i b) {
+  __m512i w = _mm512_cvtepu8_epi32(b);
+  __m512i h = _mm512_or_si512(_mm512_slli_epi32(_mm512_and_si512(w, _mm512_set1_epi32(0x80)), 8), _mm512_slli_epi32(_mm512_and_si512(w, _mm512_set1_epi32(0x7F)), 7));
+  return _mm512_cvtph_ps(_mm512_cvtepi32_epi16(h));
+}
+#endif
+
+/////////////////////////////////////////////////////////////////////////////
+// Row-wise compression for all-to-all payloads.
+//
+// Each row of `cols` elements is packed into `cols + 4` bytes: the quantized
+// payload followed by a float32 dequantization scale, so that payloads and
+// scales travel in one exchange and any contiguous range of rows can be split
+// across peers. Mode 1 is fp8 e4m3fn (saturated at 224, same as
+// `tutel.ops.to_float8_rowwise()`), mode 2 is symmetric int8.
+
+enum { ROWWISE_FP8 = 1, ROWWISE_INT8 = 2 };
+
+inline int64_t rowwise_packed_cols(int64_t cols) { return cols + int64_t(sizeof(float)); }
+
+template <typename T>
+inline void rowwise_compress_scalar(const T *x, int64_t cols, uint8_t *out, int mode) {
+  float amax = 0.0f;
+  for (int64_t j = 0; j < cols; ++j)
+    amax = std::max(amax, std::fabs(to_float(x[j])));
+  amax = std::max(amax, 1e-12f);
+  float fp_max = mode == ROWWISE_FP8 ? 224.0f : 127.0f, scale = fp_max / amax, scale_inv = 1.0f / scale;
+  if (mode == ROWWISE_FP8) {
+    for (int64_t j = 0; j < cols; ++j)
+      out[j] = fp8e4m3_from_float(std::min(std::max(to_float(x[j]) * scale, -fp_max), fp_max));
+  } else {
+    for (int64_t j = 0; j < cols; ++j)
+      out[j] = uint8_t(int8_t(std::min(std::max(std::nearbyint(to_float(x[j]) * scale), -fp_max), fp_max)));
+  }
+  memcpy(out + cols, &scale_inv, sizeof(float));
+}
+
+template <typename T>
+inline void rowwise_decompress_scalar(const uint8_t *in, int64_t cols, T *y, int mode) {
+  float scale_inv;
+  memcpy(&scale_inv, in + cols, sizeof(float));
+  if (mode == ROWWISE_FP8) {
+    const float *table = fp8e4m3_table();
+    for (int64_t j = 0; j < cols; ++j)
+      from_float(y + j, table[in[j]] * scale_inv);
+  } else {
+    for (int64_t j = 0; j < cols; ++j)
+      from_float(y + j, float(int8_t(in[j])) * scale_inv);
+  }
+}
+
+#if TUTEL_CPU_AVX512
+template <typename T>
+TUTEL_TARGET_AVX512 void rowwise_compress_avx512(const T *x, int64_t cols, uint8_t *out, int mode) {
+  __m512 vmax = _mm512_setzero_ps();
+  for (int64_t j = 0; j < cols; j += 16)
+    vmax = _mm512_max_ps(vmax, _mm512_abs_ps(vload(x + j, tail_mask(cols - j))));
+  float amax = std::max(_mm512_reduce_max_ps(vmax), 1e-12f);
+  float fp_max = mode == ROWWISE_FP8 ? 224.0f : 127.0f, scale = fp_max / amax, scale_inv = 1.0f / scale;
+  __m512 vscale = _mm512_set1_ps(scale), vhi = _mm512_set1_ps(fp_max), vlo = _mm512_set1_ps(-fp_max);
+  for (int64_t j = 0; j < cols; j += 16) {
+    __mmask16 m = tail_mask(cols - j);
+    __m512 v = _mm512_min_ps(_mm512_max_ps(_mm512_mul_ps(vload(x + j, m), vscale), vlo), vhi);
+    __m128i q;
+    if (mode == ROWWISE_FP8)
+      q = fp8e4m3_from_float_x16(v);
+    else
+      q = _mm512_cvtepi32_epi8(_mm512_cvt_roundps_epi32(v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+    _mm_mask_storeu_epi8(out + j, m, q);
+  }
+  memcpy(out + cols, &scale_inv, sizeof(float));
+}
+
+template <typename T>
+TUTEL_TARGET_AVX512 void rowwise_decompress_avx512(const uint8_t *in, int64_t cols, T *y, int mode) {
+  float scale_inv;
+  memcpy(&scale_inv, in + cols, sizeof(float));
+  __m512 vscale = _mm512_set1_ps(mode == ROWWISE_FP8 ? scale_inv * 256.0f : scale_inv);
+  for (int64_t j = 0; j < cols; j += 16) {
+    __mmask16 m = tail_mask(cols - j);
+    __m128i q = _mm_maskz_loadu_epi8(m, in + j);
+    __m512 v = mode == ROWWISE_FP8 ? fp8e4m3_to_float_x16_div256(q) : _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(q));
+    vstore(y + j, _mm512_mul_ps(v, vscale), m);
+  }
+}
+#endif
+
+template <typename T>
+void rowwise_compress(const T *x, int64_t cols, uint8_t *out, int mode, int64_t begin, int64_t end) {
+  const int64_t packed_cols = rowwise_packed_cols(cols);
+#if TUTEL_CPU_AVX512
+  if (has_avx512()) {
+    for (int64_t i = begin; i < end; ++i)
+      rowwise_compress_avx512(x + i * cols, cols, out + i * packed_cols, mode);
+    return;
+  }
+#endif
+  for (int64_t i = begin; i < end; ++i)
+    rowwise_compress_scalar(x + i * cols, cols, out + i * packed_cols, mode);
+}
+
+template <typename T>
+void rowwise_decompress(const uint8_t *in, int64_t cols, T *y, int mode, int64_t begin, int64_t end) {
+  const int64_t packed_cols = rowwise_packed_cols(cols);
+#if TUTEL_CPU_AVX512
+  if (has_avx512()) {
+    for (int64_t i = begin; i < end; ++i)
+      rowwise_decompress_avx512(in + i * packed_cols, cols, y + i * cols, mode);
+    return;
+  }
+#endif
+  for (int64_t i = begin; i < end; ++i)
+    rowwise_decompress_scalar(in + i * packed_cols, cols, y + i * cols, mode);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Blocked GEMM accumulation on float activations.
+//
+// c[rows, n] += a[rows, k] * b[k, n], with `a` and `c` in float and `b` stored
+// row-major in float/bf16/fp16 (converted on load). This is the building block
+// of fused expert kernels below, which keep a small block of rows resident in
+// cache and apply elementwise epilogues between projections.
+
+template <typename TB>
+inline void gemm_block_acc_scalar(const float *a, int64_t lda, const TB *b, int64_t ldb, float *c, int64_t ldc, int64_t rows, int64_t k, int64_t n) {
+  for (int64_t r = 0; r < rows; ++r)
+    for (int64_t kk = 0; kk < k; ++kk) {
+      float av = a[r * lda + kk];
+      const TB *bk = b + kk * ldb;
+      for (int64_t j = 0; j < n; ++j)
+        c[r * ldc + j] += av * to_float(bk[j]);
+    }
+}
+
+#if TUTEL_CPU_AVX512
+// Register tile of R (<= 4) rows x 64 columns (4 zmm per row), with masked column tails.
+template <int R, typename TB>
+TUTEL_TARGET_AVX512 inline void gemm_micro_avx512(const float *a, int64_t lda, const TB *b, int64_t ldb, float *c, int64_t ldc, int64_t k, int64_t n) {
+  __mmask16 m[4];
+  for (int j = 0; j < 4; ++j)
+    m[j] = tail_mask(std::max<int64_t>(0, n - 16 * j));
+  __m512 acc[R][4];
+  for (int r = 0; r < R; ++r)
+    for (int j = 0; j < 4; ++j)
+      acc[r][j] = vload(c + r * ldc + 16 * j, m[j]);
+  for (int64_t kk = 0; kk < k; ++kk) {
+    __m512 bv[4];
+    for (int j = 0; j < 4; ++j)
+      bv[j] = vload(b + kk * ldb + 16 * j, m[j]);
+    for (int r = 0; r < R; ++r) {
+      __m512 av = _mm512_set1_ps(a[r * lda + kk]);
+      for (int j = 0; j < 4; ++j)
+        acc[r][j] = _mm512_fmadd_ps(av, bv[j], acc[r][j]);
+    }
+  }
+  for (int r = 0; r < R; ++r)
+    for (int j = 0; j < 4; ++j)
+      vstore(c + r * ldc + 16 * j, acc[r][j], m[j]);
+}
+
+template <typename TB>
+TUTEL_TARGET_AVX512 void gemm_block_acc_avx512(const float *a, int64_t lda, const TB *b, int64_t ldb, float *c, int64_t ldc, int64_t rows, int64_t k, int64_t n) {
+  for (int64_t j = 0; j < n; j += 64) {
+    int64_t nj = std::min<int64_t>(64, n - j);
+    int64_t r = 0;
+    for (; r + 4 <= rows; r += 4)
+      gemm_micro_avx512<4>(a + r * lda, lda, b + j, ldb, c + r * ldc + j, ldc, k, nj);
+    switch (rows - r) {
+      case 3: gemm_micro_avx512<3>(a + r * lda, lda, b + j, ldb, c + r * ldc + j, ldc, k, nj); break;
+      case 2: gemm_micro_avx512<2>(a + r * lda, lda, b + j, ldb, c + r * ldc + j, ldc, k, nj); break;
+      case 1: gemm_micro_avx512<1>(a + r * lda, lda, b + j, ldb, c + r * ldc + j, ldc, k, nj); break;
+    }
+  }
+}
+#endif
+
+template <typename TB>
+inline void gemm_block_acc(const float *a, int64_t lda, const TB *b, int64_t ldb, float *c, int64_t ldc, int64_t rows, int64_t k, int64_t n) {
+#if TUTEL_CPU_AVX512
+  if (has_avx512())
+    return gemm_block_acc_avx512(a, lda, b, ldb, c, ldc, rows, k, n);
+#endif
+  gemm_block_acc_scalar(a, lda, b, ldb, c, ldc, rows, k, n);
+}
+
+// c[rows, n] += a[rows, k] * b[n, k]^T, i.e. `b` is stored as row-major [n, k] (e.g. nn.Linear weights).
+template <typename TB>
+inline void gemm_nt_block_acc_scalar(const float *a, int64_t lda, const TB *b, int64_t ldb, float *c, int64_t ldc, int64_t rows, int64_t k, int64_t n) {
+  for (int64_t r = 0; r < rows; ++r)
+    for (int64_t j = 0; j < n; ++j) {
+      float sum = 0.0f;
+      for (int64_t kk = 0; kk < k; ++kk)
+        sum += a[r * lda + kk] * to_float(b[j * ldb + kk]);
+      c[r * ldc + j] += sum;
+    }
+}
+
+#if TUTEL_CPU_AVX512
+// Register tile of R rows x C columns of dot products, vectorized along k and reduced at the end.
+template <int R, int C, typename TB>
+TUTEL_TARGET_AVX512 inline void gemm_nt_micro_avx512(const float *a, int64_t lda, const TB *b, int64_t ldb, float *c, int64_t ldc, int64_t k) {
+  __m512 acc[R][C];
+  for (int r = 0; r < R; ++r)
+    for (int j = 0; j < C; ++j)
+      acc[r][j] = _mm512_setzero_ps();
+  for (int64_t kk = 0; kk < k; kk += 16) {
+    __mmask16 m = tail_mask(k - kk);
+    __m512 bv[C];
+    for (int j = 0; j < C; ++j)
+      bv[j] = vload(b + j * ldb + kk, m);
+    for (int r = 0; r < R; ++r) {
+      __m512 av = _mm512_maskz_loadu_ps(m, a + r * lda + kk);
+      for (int j = 0; j < C; ++j)
+        acc[r][j] = _mm512_fmadd_ps(av, bv[j], acc[r][j]);
+    }
+  }
+  for (int r = 0; r < R; ++r)
+    for (int j = 0; j < C; ++j)
+      c[r * ldc + j] += _mm512_reduce_add_ps(acc[r][j]);
+}
+
+template <int R, typename TB>
+TUTEL_TARGET_AVX512 inline void gemm_nt_rows_avx512(const float *a, int64_t lda, const TB *b, int64_t ldb, float *c, int64_t ldc, int64_t k, int64_t n) {
+  int64_t j = 0;
+  for (; j + 4 <= n; j += 4)
+    gemm_nt_micro_avx512<R, 4>(a, lda, b + j * ldb, ldb, c + j, ldc, k);
+  for (; j < n; ++j)
+    gemm_nt_micro_avx512<R, 1>(a, lda, b + j * ldb, ldb, c + j, ldc, k);
+}
+
+template <typename TB>
+TUTEL_TARGET_AVX512 void gemm_nt_block_acc_avx512(const float *a, int64_t lda, const TB *b, int64_t ldb, float *c, int64_t ldc, int64_t rows, int64_t k, int64_t n) {
+  int64_t r = 0;
+  for (; r + 4 <= rows; r += 4)
+    gemm_nt_rows_avx512<4>(a + r * lda, lda, b, ldb, c + r * ldc, ldc, k, n);
+  for (; r < rows; ++r)
+    gemm_nt_rows_avx512<1>(a + r * lda, lda, b, ldb, c + r * ldc, ldc, k, n);
+}
+#endif
+
+template <typename TB>
+inline void gemm_nt_block_acc(const float *a, int64_t lda, const TB *b, int64_t ldb, float *c, int64_t ldc, int64_t rows, int64_t k, int64_t n) {
+#if TUTEL_CPU_AVX512
+  if (has_avx512())
+    return gemm_nt_block_acc_avx512(a, lda, b, ldb, c, ldc, rows, k, n);
+#endif
+  gemm_nt_block_acc_scalar(a, lda, b, ldb, c, ldc, rows, k, n);
+}
+
+template <typename T>
+inline void load_rows_as_float(const T *x, int64_t cols, int64_t rows, float *out) {
+  for (int64_t i = 0; i < rows * cols; ++i)
+    out[i] = to_float(x[i]);
+}
+
+template <typename T>
+inline void store_rows_from_float(const float *x, int64_t cols, int64_t rows, T *out) {
+  for (int64_t i = 0; i < rows * cols; ++i)
+    from_float(out + i, x[i]);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Fused SwiGLU expert: y = (silu(x @ w1) * (x @ w2)) @ w3 for one expert.
+//
+// x: [rows, model_dim], w1/w2: [model_dim, hidden], w3: [hidden, out_dim].
+// Rows [begin, end) are processed as one resident block: gate and up tiles of
+// `hidden_block` columns are computed from the same float copy of x, combined
+// in place, and immediately accumulated into the down projection, so that no
+// [rows, hidden] intermediate is ever materialized.
+
+constexpr int64_t SWIGLU_ROW_BLOCK = 32, SWIGLU_HIDDEN_BLOCK = 256;
+
+template <typename T>
+void swiglu_expert(const T *x, const T *w1, const T *w2, const T *w3, T *y, int64_t model_dim, int64_t hidden, int64_t out_dim, int64_t begin, int64_t end) {
+  const int64_t rows = end - begin, hb = SWIGLU_HIDDEN_BLOCK;
+  if (rows <= 0)
+    return;
+  std::vector<float> xf(rows * model_dim), gate(rows * hb), up(rows * hb), yacc(rows * out_dim, 0.0f);
+  load_rows_as_float(x + begin * model_dim, model_dim, rows, xf.data());
+
+  for (int64_t h = 0; h < hidden; h += hb) {
+    int64_t nh = std::min(hb, hidden - h);
+    std::fill(gate.begin(), gate.end(), 0.0f);
+    std::fill(up.begin(), up.end(), 0.0f);
+    gemm_block_acc(xf.data(), model_dim, w1 + h, hidden, gate.data(), hb, rows, model_dim, nh);
+    gemm_block_acc(xf.data(), model_dim, w2 + h, hidden, up.data(), hb, rows, model_dim, nh);
+    for (int64_t r = 0; r < rows; ++r)
+      for (int64_t j = 0; j < nh; ++j) {
+        float g = gate[r * hb + j];
+        gate[r * hb + j] = g / (1.0f + std::exp(-g)) * up[r * hb + j];
+      }
+    gemm_block_acc(gate.data(), hb, w3 + h * out_dim, out_dim, yacc.data(), out_dim, rows, nh, out_dim);
+  }
+  store_rows_from_float(yacc.data(), out_dim, rows, y + begin * out_dim);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Batched GEMM with bias + activation epilogue for one expert.
+//
+// y = act(x @ w + bias), with x: [rows, k] and w: [k, n], or [n, k] if
+// `w_transposed`. Columns [col_begin, col_end) of rows [begin, end) are
+// accumulated in float, then bias, activation and store happen in the same
+// pass over the tile. If `z` is given, the pre-activation is stored too, which
+// is all that backward needs to recompute the activation.
+
+enum { ACT_NONE = 0, ACT_RELU = 1, ACT_GELU = 2, ACT_SILU = 3 };
+
+inline float apply_activation(float v, int act) {
+  switch (act) {
+    case ACT_RELU: return v > 0.0f ? v : 0.0f;
+    case ACT_GELU: return 0.5f * v * (1.0f + std::erf(v * 0.70710678118654752f));
+    case ACT_SILU: return v / (1.0f + std::exp(-v));
+    default: return v;
+  }
+}
+
+constexpr int64_t EPILOGUE_ROW_BLOCK = 32, EPILOGUE_COL_BLOCK = 512;
+
+template <typename T>
+inline void store_bias_act(const float *acc, int64_t rows, int64_t cols, const T *bias, T *y, T *z, int64_t n, int act, int64_t begin, int64_t col_begin) {
+  for (int64_t r = 0; r < rows; ++r)
+    for (int64_t j = 0; j < cols; ++j) {
+      float v = acc[r * cols + j] + (bias ? to_float(bias[col_begin + j]) : 0.0f);
+      int64_t offset = (begin + r) * n + col_begin + j;
+      if (z)
+        from_float(z + offset, v);
+      from_float(y + offset, apply_activation(v, act));
+    }
+}
+
+template <typename T>
+void bmm_bias_act(const T *x, const T *w, const T *bias, T *y, T *z, int64_t k, int64_t n, bool w_transposed, int act,
+                  int64_t begin, int64_t end, int64_t col_begin, int64_t col_end) {
+  const int64_t rows = end - begin, cols = col_end - col_begin;
+  if (rows <= 0 || cols <= 0)
+    return;
+  std::vector<float> xf(rows * k), acc(rows * cols, 0.0f);
+  load_rows_as_float(x + begin * k, k, rows, xf.data());
+  if (w_transposed)
+    gemm_nt_block_acc(xf.data(), k, w + col_begin * k, k, acc.data(), cols, rows, k, cols);
+  else
+    gemm_block_acc(xf.data(), k, w + col_begin, n, acc.data(), cols, rows, k, cols);
+  store_bias_act(acc.data(), rows, cols, bias, y, z, n, act, begin, col_begin);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Weight-only quantized GEMM.
+//
+// Quantized weights are row-major [n, k] with symmetric per-group scales:
+// w[j, kk] = q[j, kk] * scales[j, kk / group]. For bits == 8, q is int8; for
+// bits == 4, two signed nibbles share one byte, lower nibble first. Weights are
+// decoded to float in registers right before the FMA, so no dequantized copy is
+// ever written to memory.
+
+inline float dequant_weight(const uint8_t *q, const float *scales, int64_t group, int bits, int64_t kk) {
+  int v = bits == 8 ? int(int8_t(q[kk])) : ((((kk & 1) ? q[kk >> 1] >> 4 : q[kk >> 1]) & 15) ^ 8) - 8;
+  return float(v) * scales[kk / group];
+}
+
+inline void qgemm_nt_block_acc_scalar(const float *a, int64_t lda, const uint8_t *q, int64_t ldq, const float *scales, int64_t lds, int64_t group, int bits,
+                                      float *c, int64_t ldc, int64_t rows, int64_t k, int64_t n) {
+  std::vector<float> wf(k);
+  for (int64_t j = 0; j < n; ++j) {
+    for (int64_t kk = 0; kk < k; ++kk)
+      wf[kk] = dequant_weight(q + j * ldq, scales + j * lds, group, bits, kk);
+    for (int64_t r = 0; r < rows; ++r) {
+      float sum = 0.0f;
+      for (int64_t kk = 0; kk < k; ++kk)
+        sum += a[r * lda + kk] * wf[kk];
+      c[r * ldc + j] += sum;
+    }
+  }
+}
+
+#if TUTEL_CPU_AVX512
+// Decodes one step of quantized weights: 16 int8 values for BITS == 8, or 32 int4 values for BITS == 4,
+// returned as even (v[0]) and odd (v[1]) positions, since `a` is split the same way beforehand.
+template <int BITS>
+TUTEL_TARGET_AVX512 inline void dequant_step(const uint8_t *q, int64_t kk, float scale, __m512 *v) {
+  __m512 s = _mm512_set1_ps(scale);
+  if (BITS == 8) {
+    v[0] = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i*)(q + kk)))), s);
+  } else {
+    __m512i bytes = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(q + kk / 2)));
+    v[0] = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srai_epi32(_mm512_slli_epi32(bytes, 28), 28)), s);
+    v[1] = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srai_epi32(_mm512_slli_epi32(bytes, 24), 28)), s);
+  }
+}
+
+// Requires k % STEP == 0 and group % STEP == 0, so that every step shares one scale.
+template <int BITS, int R, int C>
+TUTEL_TARGET_AVX512 inline void qgemm_nt_micro_avx512(const float *a, int64_t lda, const uint8_t *q, int64_t ldq, const float *scales, int64_t lds, int64_t group,
+                                                      float *c, int64_t ldc, int64_t k) {
+  constexpr int STEP = BITS == 8 ? 16 : 32, HALVES = STEP / 16;
+  __m512 acc[R][C];
+  for (int r = 0; r < R; ++r)
+    for (int j = 0; j < C; ++j)
+      acc[r][j] = _mm512_setzero_ps();
+  for (int64_t kk = 0; kk < k; kk += STEP) {
+    __m512 bv[C][HALVES];
+    for (int j = 0; j < C; ++j)
+      dequant_step<BITS>(q + j * ldq, kk, scales[j * lds + kk / group], bv[j]);
+    for (int r = 0; r < R; ++r)
+      for (int h = 0; h < HALVES; ++h) {
+        __m512 av = _mm512_loadu_ps(a + r * lda + kk + h * 16);
+        for (int j = 0; j < C; ++j)
+          acc[r][j] = _mm512_fmadd_ps(av, bv[j][h], acc[r][j]);
+      }
+  }
+  for (int r = 0; r < R; ++r)
+    for (int j = 0; j < C; ++j)
+      c[r * ldc + j] += _mm512_reduce_add_ps(acc[r][j]);
+}
+
+template <int BITS, int R>
+TUTEL_TARGET_AVX512 inline void qgemm_nt_rows_avx512(const float *a, int64_t lda, const uint8_t *q, int64_t ldq, const float *scales, int64_t lds, int64_t group,
+                                                     float *c, int64_t ldc, int64_t k, int64_t n) {
+  int64_t j = 0;
+  for (; j + 4 <= n; j += 4)
+    qgemm_nt_micro_avx512<BITS, R, 4>(a, lda, q + j * ldq, ldq, scales + j * lds, lds, group, c + j, ldc, k);
+  for (; j < n; ++j)
+    qgemm_nt_micro_avx512<BITS, R, 1>(a, lda, q + j * ldq, ldq, scales + j * lds, lds, group, c + j, ldc, k);
+}
+
+template <int BITS>
+TUTEL_TARGET_AVX512 void qgemm_nt_block_acc_avx512(const float *a, int64_t lda, const uint8_t *q, int64_t ldq, const float *scales, int64_t lds, int64_t group,
+                                                   float *c, int64_t ldc, int64_t rows, int64_t k, int64_t n) {
+  std::vector<float> split;
+  if (BITS == 4) {
+    // Reorder each 32 values of `a` as 16 even positions followed by 16 odd ones, matching dequant_step<4>.
+    split.resize(rows * k);
+    const __m512i even = _mm512_set_epi32(30, 28, 26, 24, 22, 20, 18, 16, 14, 12, 10, 8, 6, 4, 2, 0);
+    const __m512i odd = _mm512_add_epi32(even, _mm512_set1_epi32(1));
+    for (int64_t r = 0; r < rows; ++r)
+      for (int64_t kk = 0; kk < k; kk += 32) {
+        __m512 lo = _mm512_loadu_ps(a + r * lda + kk), hi = _mm512_loadu_ps(a + r * lda + kk + 16);
+        _mm512_storeu_ps(split.data() + r * k + kk, _mm512_permutex2var_ps(lo, even, hi));
+        _mm512_storeu_ps(split.data() + r * k + kk + 16, _mm512_permutex2var_ps(lo, odd, hi));
+      }
+    a = split.data(), lda = k;
+  }
+  int64_t r = 0;
+  for (; r + 4 <= rows; r += 4)
+    qgemm_nt_rows_avx512<BITS, 4>(a + r * lda, lda, q, ldq, scales, lds, group, c + r * ldc, ldc, k, n);
+  for (; r < rows; ++r)
+    qgemm_nt_rows_avx512<BITS, 1>(a + r * lda, lda, q, ldq, scales, lds, group, c + r * ldc, ldc, k, n);
+}
+#endif
+
+inline void qgemm_nt_block_acc(const float *a, int64_t lda, const uint8_t *q, int64_t ldq, const float *scales, int64_t lds, int64_t group, int bits,
+                               float *c, int64_t ldc, int64_t rows, int64_t k, int64_t n) {
+#if TUTEL_CPU_AVX512
+  if (has_avx512() && bits == 8 && k % 16 == 0 && group % 16 == 0)
+    return qgemm_nt_block_acc_avx512<8>(a, lda, q, ldq, scales, lds, group, c, ldc, rows, k, n);
+  if (has_avx512() && bits == 4 && k % 32 == 0 && group % 32 == 0)
+    return qgemm_nt_block_acc_avx512<4>(a, lda, q, ldq, scales, lds, group, c, ldc, rows, k, n);
+#endif
+  qgemm_nt_block_acc_scalar(a, lda, q, ldq, scales, lds, group, bits, c, ldc, rows, k, n);
+}
+
+// y = act(x @ dequant(q)^T + bias), with x: [rows, k] and q: [n, k * bits / 8] for one expert.
+template <typename T>
+void qbmm_bias_act(const T *x, const uint8_t *q, const float *scales, const T *bias, T *y, int64_t k, int64_t n, int64_t group, int bits, int act,
+                   int64_t begin, int64_t end, int64_t col_begin, int64_t col_end) {
+  const int64_t rows = end - begin, cols = col_end - col_begin, ldq = k * bits / 8, lds = k / group;
+  if (rows <= 0 || cols <= 0)
+    return;
+  std::vector<float> xf(rows * k), acc(rows * cols, 0.0f);
+  load_rows_as_float(x + begin * k, k, rows, xf.data());
+  qgemm_nt_block_acc(xf.data(), k, q + col_begin * ldq, ldq, scales + col_begin * lds, lds, group, bits, acc.data(), cols, rows, k, cols);
+  store_bias_act(acc.data(), rows, cols, bias, y, (T*)nullptr, n, act, begin, col_begin);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// bf16 x fp8 e4m3fn GEMM with 128x128 block scales.
+//
+// w: [n, k] fp8 bytes with float scales [ceil(n / 128), ceil(k / 128)], in
+// the layout of `tutel.ops.to_float8_blockwise()`. Weights are decoded in
+// registers and block scales are applied per 16-wide step, so no dequantized
+// copy of the weight is materialized.
+
+constexpr int64_t FP8_BLOCK = 128;
+
+inline void fp8_gemm_nt_block_acc_scalar(const float *a, int64_t lda, const uint8_t *w, int64_t ldw, const float *const *scales,
+                                         float *c, int64_t ldc, int64_t rows, int64_t k, int64_t n) {
+  const float *table = fp8e4m3_table();
+  std::vector<float> wf(k);
+  for (int64_t j = 0; j < n; ++j) {
+    for (int64_t kk = 0; kk < k; ++kk)
+      wf[kk] = table[w[j * ldw + kk]] * scales[j][kk / FP8_BLOCK];
+    for (int64_t r = 0; r < rows; ++r) {
+      float sum = 0.0f;
+      for (int64_t kk = 0; kk < k; ++kk)
+        sum += a[r * lda + kk] * wf[kk];
+      c[r * ldc + j] += sum;
+    }
+  }
+}
+
+#if TUTEL_CPU_AVX512
+// Requires k % 16 == 0, so that every 16-wide step shares one block scale.
+template <int R, int C>
+TUTEL_TARGET_AVX512 inline void fp8_gemm_nt_micro_avx512(const float *a, int64_t lda, const uint8_t *w, int64_t ldw, const float *const *scales,
+                                                         float *c, int64_t ldc, int64_t k) {
+  __m512 acc[R][C];
+  for (int r = 0; r < R; ++r)
+    for (int j = 0; j < C; ++j)
+      acc[r][j] = _mm512_setzero_ps();
+  for (int64_t kk = 0; kk < k; kk += 16) {
+    __m512 bv[C];
+    for (int j = 0; j < C; ++j)
+      bv[j] = _mm512_mul_ps(fp8e4m3_to_float_x16_div256(_mm_loadu_si128((const __m128i*)(w + j * ldw + kk))), _mm512_set1_ps(scales[j][kk / FP8_BLOCK] * 256.0f));
+    for (int r = 0; r < R; ++r) {
+      __m512 av = _mm512_loadu_ps(a + r * lda + kk);
+      for (int j = 0; j < C; ++j)
+        acc[r][j] = _mm512_fmadd_ps(av, bv[j], acc[r][j]);
+    }
+  }
+  for (int r = 0; r < R; ++r)
+    for (int j = 0; j < C; ++j)
+      c[r * ldc + j] += _mm512_reduce_add_ps(acc[r][j]);
+}
+
+template <int R>
+TUTEL_TARGET_AVX512 inline void fp8_gemm_nt_rows_avx512(const float *a, int64_t lda, const uint8_t *w, int64_t ldw, const float *const *scales,
+                                                        float *c, int64_t ldc, int64_t k, int64_t n) {
+  int64_t j = 0;
+  for (; j + 4 <= n; j += 4)
+    fp8_gemm_nt_micro_avx512<R, 4>(a, lda, w + j * ldw, ldw, scales + j, c + j, ldc, k);
+  for (; j < n; ++j)
+    fp8_gemm_nt_micro_avx512<R, 1>(a, lda, w + j * ldw, ldw, scales + j, c + j, ldc, k);
+}
+
+TUTEL_TARGET_AVX512 inline void fp8_gemm_nt_block_acc_avx512(const float *a, int64_t lda, const uint8_t *w, int64_t ldw, const float *const *scales,
+                                                             float *c, int64_t ldc, int64_t rows, int64_t k, int64_t n) {
+  int64_t r = 0;
+  for (; r + 4 <= rows; r += 4)
+    fp8_gemm_nt_rows_avx512<4>(a + r * lda, lda, w, ldw, scales, c + r * ldc, ldc, k, n);
+  for (; r < rows; ++r)
+    fp8_gemm_nt_rows_avx512<1>(a + r * lda, lda, w, ldw, scales, c + r * ldc, ldc, k, n);
+}
+#endif
+
+// c[rows, n] += a[rows, k] * dequant(w[n, k])^T, where scales[j] points to the block scales of row j of w.
+inline void fp8_gemm_nt_block_acc(const float *a, int64_t lda, const uint8_t *w, int64_t ldw, const float *const *scales,
+                                  float *c, int64_t ldc, int64_t rows, int64_t k, int64_t n) {
+#if TUTEL_CPU_AVX512
+  if (has_avx512() && k % 16 == 0)
+    return fp8_gemm_nt_block_acc_avx512(a, lda, w, ldw, scales, c, ldc, rows, k, n);
+#endif
+  fp8_gemm_nt_block_acc_scalar(a, lda, w, ldw, scales, c, ldc, rows, k, n);
+}
+
+// out[dst[r], col_begin:col_end] = x[src[r], :] @ dequant(w[col_begin:col_end, :])^T for r in [0, rows),
+// where null `src` or `dst` stands for the identity mapping.
+template <typename T, typename TO>
+void fp8_gather_gemm_nt(const T *x, int64_t ldx, const int64_t *src, const int64_t *dst, int64_t rows,
+                        const uint8_t *w, const float *scal, int64_t k, int64_t col_begin, int64_t col_end, TO *out, int64_t ldo) {
+  const int64_t cols = col_end - col_begin, lds = (k + FP8_BLOCK - 1) / FP8_BLOCK;
+  if (rows <= 0 || cols <= 0)
+    return;
+  std::vector<float> xf(rows * k), acc(rows * cols, 0.0f);
+  std::vector<const float*> scales(cols);
+  for (int64_t r = 0; r < rows; ++r)
+    load_rows_as_float(x + (src ? src[r] : r) * ldx, k, 1, xf.data() + r * k);
+  for (int64_t j = 0; j < cols; ++j)
+    scales[j] = scal + (col_begin + j) / FP8_BLOCK * lds;
+  fp8_gemm_nt_block_acc(xf.data(), k, w + col_begin * k, k, scales.data(), acc.data(), cols, rows, k, cols);
+  for (int64_t r = 0; r < rows; ++r)
+    store_rows_from_float(acc.data() + r * cols, cols, 1, out + (dst ? dst[r] : r) * ldo + col_begin);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Fused quantizers of `tutel.ops`, bit-exact with their torch references.
+//
+// Each step repeats the float32 arithmetic of the reference, including
+// `b / a` on a tensor `a` being evaluated as `a.reciprocal() * b`. Only
+// `to_float8_rowwise()` keeps negative zero of its e4m3fn cast.
+
+#if TUTEL_CPU_AVX512
+TUTEL_TARGET_AVX512 inline void fp8e4m3_from_float_avx512(const float *v, uint8_t *out, int64_t n, bool keep_neg_zero) {
+  for (int64_t i = 0; i < n; i += 16) {
+    __mmask16 m = tail_mask(n - i);
+    _mm_mask_storeu_epi8(out + i, m, fp8e4m3_from_float_x16(_mm512_maskz_loadu_ps(m, v + i), keep_neg_zero));
+  }
+}
+#endif
+
+inline void fp8e4m3_from_float(const float *v, uint8_t *out, int64_t n, bool keep_neg_zero = false) {
+#if TUTEL_CPU_AVX512
+  if (has_avx512())
+    return fp8e4m3_from_float_avx512(v, out, n, keep_neg_zero);
+#endif
+  for (int64_t i = 0; i < n; ++i)
+    out[i] = fp8e4m3_from_float(v[i], keep_neg_zero);
+}
+
+template <typename T>
+inline float rounded_to(float v) {
+  T t;
+  from_float(&t, v);
+  return to_float(t);
+}
+
+// Rows [begin, end) of `tutel.ops.to_float8_rowwise(x, dim=-1)`, which keeps negative zero.
+template <typename T>
+void to_float8_rowwise(const T *x, int64_t cols, float fp8_max, uint8_t *out, float *scale_inv, int64_t begin, int64_t end) {
+  const float amax_min = rounded_to<T>(1e-12f);
+  std::vector<float> v(cols);
+  for (int64_t r = begin; r < end; ++r) {
+    const T *row = x + r * cols;
+    float amax = 0.0f;
+    for (int64_t j = 0; j < cols; ++j)
+      amax = std::max(amax, std::fabs(to_float(row[j])));
+    float scale = (1.0f / std::max(amax, amax_min)) * fp8_max;
+    for (int64_t j = 0; j < cols; ++j)
+      v[j] = std::min(std::max(to_float(row[j]) * scale, -fp8_max), fp8_max);
+    fp8e4m3_from_float(v.data(), out + r * cols, cols, true);
+    scale_inv[r] = 1.0f / scale;
+  }
+}
+
+// Tiles [begin, end) of `tutel.ops.to_float8_blockwise()` for one [rows, cols] matrix, tiles in row-major order.
+template <typename T>
+void to_float8_blockwise(const T *w, int64_t rows, int64_t cols, int64_t block, uint8_t *out, float *scales, int64_t begin, int64_t end) {
+  const int64_t col_blocks = (cols + block - 1) / block;
+  std::vector<float> v(block);
+  for (int64_t t = begin; t < end; ++t) {
+    int64_t r0 = t / col_blocks * block, r1 = std::min(rows, r0 + block), c0 = t % col_blocks * block, c1 = std::min(cols, c0 + block);
+    float amax = 0.0f;
+    for (int64_t r = r0; r < r1; ++r)
+      for (int64_t c = c0; c < c1; ++c)
+        amax = std::max(amax, std::fabs(to_float(w[r * cols + c])));
+    float ws = amax / 224.0f, s = std::max(ws, 1e-5f);
+    scales[t] = ws;
+    for (int64_t r = r0; r < r1; ++r) {
+      for (int64_t c = c0; c < c1; ++c)
+        v[c - c0] = std::min(to_float(w[r * cols + c]) / s, 224.0f);
+      fp8e4m3_from_float(v.data(), out + r * cols + c0, c1 - c0);
+    }
+  }
+}
+
+constexpr int64_t FP4_GROUP = 16;
+
+template <typename T>
+inline float fp4_group_scale(const T *x) {
+  float amax = 0.0f;
+  for (int64_t j = 0; j < FP4_GROUP; ++j)
+    amax = std::max(amax, std::fabs(to_float(x[j])));
+  float scale = amax / 6.0f;
+  return scale > 1e-4f ? scale : 1e-4f;
+}
+
+// Groups [begin, end) of `tutel.ops.to_float4_groupwise()`: two e2m1 codes per byte (lower first) and one e4m3fn scale per group,
+// where `scale_o` is the max group scale over the whole tensor divided by 448.
+template <typename T>
+void to_float4_groupwise(const T *x, float scale_o, uint8_t *out, uint8_t *scales, int64_t begin, int64_t end) {
+  static const float boundaries[16] = {-10, -5, -3.5, -2.5, -1.75, -1.25, -0.75, -0.25, 0, 0.25, 0.75, 1.25, 1.75, 2.5, 3.5, 5};
+  static const uint8_t map_ids[17] = {0, 15, 14, 13, 12, 11, 10, 9, 0, 8, 1, 2, 3, 4, 5, 6, 7};
+  for (int64_t g = begin; g < end; ++g) {
+    const T *group = x + g * FP4_GROUP;
+    float scale = fp4_group_scale(group);
+    uint8_t codes[FP4_GROUP];
+    for (int64_t j = 0; j < FP4_GROUP; ++j) {
+      float v = to_float(group[j]) / scale;
+      int64_t id = std::upper_bound(boundaries, boundaries + 16, v) - boundaries;
+      codes[j] = map_ids[std::min<int64_t>(std::max<int64_t>(id, 1), 16)];
+    }
+    for (int64_t j = 0; j < FP4_GROUP / 2; ++j)
+      out[g * FP4_GROUP / 2 + j] = uint8_t(codes[2 * j] + (codes[2 * j + 1] << 4));
+    scales[g] = fp8e4m3_from_float(scale / scale_o);
+  }
+}
+
+// Rows [begin, end) of `tutel.ops.from_float4_groupwise()`: w: [rows, cols / 2], scales: [rows, cols / group] in e4m3fn,
+// products are rounded to bf16 first, then optionally multiplied by scale_o[row / rows_per_scale] and rounded to T.
+template <typename T>
+void from_float4_groupwise(const uint8_t *w, const uint8_t *scales, const float *scale_o, int64_t rows_per_scale, int64_t cols, int64_t group, T *out, int64_t begin, int64_t end) {
+  static const float e2m1[16] = {0, 0.5, 1, 1.5, 2, 3, 4, 6, -0.0f, -0.5, -1, -1.5, -2, -3, -4, -6};
+  const float *fp8 = fp8e4m3_table();
+  for (int64_t r = begin; r < end; ++r)
+    for (int64_t c = 0; c < cols; ++c) {
+      uint8_t b = w[r * cols / 2 + c / 2];
+      float v = rounded_to<bf16>(e2m1[(c & 1) ? b >> 4 : b & 15] * fp8[scales[r * (cols / group) + c / group]]);
+      if (scale_o)
+        v *= scale_o[r / rows_per_scale];
+      from_float(out + r * cols + c, v);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Marlin fp4 weight layouts of `tutel.ops.marlin_pack()` and `tutel.ops.marlin_nvfp4_pack()`.
+//
+// Row kt of the packed [K / 16, N * 2] int32 weight holds k-tile kt: nibble i of word o is w[n][k]
+// with (k % 16, n % 64) = layout[(o % 128) * 8 + i], n / 64 = o / 128 and k / 16 = kt, which lets
+// both directions stream one k-tile at a time instead of permuting the whole tensor.
+
+enum { MARLIN_FP4 = 0, MARLIN_NVFP4 = 1 };
+
+struct MarlinCoord {
+  uint8_t k, n;
+};
+
+inline const MarlinCoord* marlin_layout(int layout) {
+  static const std::vector<MarlinCoord> tables = [] {
+    std::vector<MarlinCoord> t(2048);
+    std::vector<int> perm;
+    for (int i = 0; i < 32; ++i) {
+      int perm1[8], col = i / 4, rows[4] = {2 * (i % 4), 2 * (i % 4) + 1, 2 * (i % 4 + 4), 2 * (i % 4 + 4) + 1};
+      for (int block = 0; block < 2; ++block)
+        for (int r = 0; r < 4; ++r)
+          perm1[block * 4 + r] = 16 * rows[r] + col + 8 * block;
+      for (int j = 0; j < 4; ++j)
+        for (int p : perm1)
+          perm.push_back(p + 256 * j);
+    }
+    const int interleave[8] = {0, 2, 4, 6, 1, 3, 5, 7};
+    for (int p = 0; p < 1024; ++p) {
+      int src = perm[p / 8 * 8 + interleave[p % 8]];
+      t[MARLIN_FP4 * 1024 + p] = {uint8_t(src % 256 / 16), uint8_t(src / 256 * 16 + src % 16)};
+    }
+    for (int o = 0; o < 128; ++o)
+      for (int i = 0; i < 8; ++i) {
+        int f = o % 4, b = o / 4 % 4, h = o / 16, c = i / 4, g = i / 2 % 2, a = i % 2;
+        t[MARLIN_NVFP4 * 1024 + o * 8 + i] = {uint8_t(a * 8 + b * 2 + c), uint8_t(f * 16 + g * 8 + h)};
+      }
+    return t;
+  }();
+  return tables.data() + layout * 1024;
+}
+
+// K-tiles [begin, end) of one expert: w: [n, k / 2] with two nibbles per byte (lower first), out: [k / 16, n * 2].
+inline void marlin_pack_fp4(const uint8_t *w, int64_t n, int64_t k, const MarlinCoord *layout, uint32_t *out, int64_t begin, int64_t end) {
+  const int64_t ldw = k / 2;
+  for (int64_t kt = begin; kt < end; ++kt) {
+    const uint8_t *tile = w + kt * 8;
+    uint32_t *dst = out + kt * n * 2;
+    for (int64_t o = 0; o < n * 2; ++o) {
+      const MarlinCoord *coord = layout + o % 128 * 8;
+      const uint8_t *base = tile + o / 128 * 64 * ldw;
+      uint32_t word = 0;
+      for (int i = 0; i < 8; ++i)
+        word |= uint32_t(base[coord[i].n * ldw + coord[i].k / 2] >> (coord[i].k % 2 * 4) & 15) << (4 * i);
+      dst[o] = word;
+    }
+  }
+}
+
+// Inverse of marlin_pack_fp4() for k-tiles [begin, end).
+inline void marlin_unpack_fp4(const uint32_t *packed, int64_t n, int64_t k, const MarlinCoord *layout, uint8_t *w, int64_t begin, int64_t end) {
+  const int64_t ldw = k / 2;
+  for (int64_t kt = begin; kt < end; ++kt) {
+    uint8_t *tile = w + kt * 8;
+    const uint32_t *src = packed + kt * n * 2;
+    for (int64_t r = 0; r < n; ++r)
+      memset(tile + r * ldw, 0, 8);
+    for (int64_t o = 0; o < n * 2; ++o) {
+      const MarlinCoord *coord = layout + o % 128 * 8;
+      uint8_t *base = tile + o / 128 * 64 * ldw;
+      for (int i = 0; i < 8; ++i)
+        base[coord[i].n * ldw + coord[i].k / 2] |= uint8_t((src[o] >> (4 * i) & 15) << (coord[i].k % 2 * 4));
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Scaled top-k routers: DeepSeek-V3 / Kimi-K2 (sigmoid) and Qwen3 (softmax).
+//
+// One pass per token row: scores s = sigmoid(x), softmax(x) or x and selection
+// keys s + bias are computed 16 experts at a time. If n_group > 1, selection
+// is limited to the `topk_group` groups of contiguous experts whose best two
+// keys sum the highest. The k best keys are kept by insertion into a short
+// sorted list, and outputs are the unbiased scores of the selected experts in
+// descending order of keys, renormalized to sum to 1 if `normalize`, times `scale`.
+
+enum { ROUTER_SOFTMAX = 0, ROUTER_SIGMOID = 1, ROUTER_NONE = 2 };
+
+template <typename T>
+inline void router_scores_scalar(const T *x, const float *bias, int64_t n, int score_func, float *s, float *key) {
+  if (score_func == ROUTER_SIGMOID) {
+    for (int64_t j = 0; j < n; ++j)
+      s[j] = 1.0f / (1.0f + std::exp(-to_float(x[j])));
+  } else if (score_func == ROUTER_NONE) {
+    for (int64_t j = 0; j < n; ++j)
+      s[j] = to_float(x[j]);
+  } else {
+    float vmax = -INFINITY, sum = 0.0f;
+    for (int64_t j = 0; j < n; ++j)
+      vmax = std::max(vmax, to_float(x[j]));
+    for (int64_t j = 0; j < n; ++j)
+      sum += (s[j] = std::exp(to_float(x[j]) - vmax));
+    for (int64_t j = 0; j < n; ++j)
+      s[j] /= sum;
+  }
+  for (int64_t j = 0; j < n; ++j)
+    key[j] = bias ? s[j] + bias[j] : s[j];
+}
+
+#if TUTEL_CPU_AVX512
+// exp(x) = 2^m * exp(r), with x = m * ln2 + r and a degree-6 polynomial for exp(r), within 2 ulp.
+TUTEL_TARGET_AVX512 inline __m512 vexp(__m512 x) {
+  x = _mm512_max_ps(_mm512_min_ps(x, _mm512_set1_ps(88.7228f)), _mm512_set1_ps(-104.0f));
+  __m512 m = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512 r = _mm512_fnmadd_ps(m, _mm512_set1_ps(0.693359375f), x);
+  r = _mm512_fnmadd_ps(m, _mm512_set1_ps(-2.12194440e-4f), r);
+  __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+  p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+  return _mm512_scalef_ps(p, m);
+}
+
+template <typename T>
+TUTEL_TARGET_AVX512 void router_scores_avx512(const T *x, const float *bias, int64_t n, int score_func, float *s, float *key) {
+  const __m512 one = _mm512_set1_ps(1.0f);
+  if (score_func != ROUTER_SOFTMAX) {
+    for (int64_t j = 0; j < n; j += 16) {
+      __mmask16 m = (__mmask16)((n - j) >= 16 ? 0xFFFF : ((1u << (n - j)) - 1));
+      __m512 v = vload(x + j, m);
+      if (score_func == ROUTER_SIGMOID)
+        v = _mm512_div_ps(one, _mm512_add_ps(one, vexp(_mm512_sub_ps(_mm512_setzero_ps(), v))));
+      _mm512_mask_storeu_ps(s + j, m, v);
+      _mm512_mask_storeu_ps(key + j, m, bias ? _mm512_add_ps(v, _mm512_maskz_loadu_ps(m, bias + j)) : v);
+    }
+    return;
+  }
+  __m512 vmax = _mm512_set1_ps(-INFINITY), vsum = _mm512_setzero_ps();
+  for (int64_t j = 0; j < n; j += 16) {
+    __mmask16 m = (__mmask16)((n - j) >= 16 ? 0xFFFF : ((1u << (n - j)) - 1));
+    vmax = _mm512_mask_max_ps(vmax, m, vmax, vload(x + j, m));
+  }
+  vmax = _mm512_set1_ps(_mm512_reduce_max_ps(vmax));
+  for (int64_t j = 0; j < n; j += 16) {
+    __mmask16 m = (__mmask16)((n - j) >= 16 ? 0xFFFF : ((1u << (n - j)) - 1));
+    __m512 v = _mm512_maskz_mov_ps(m, vexp(_mm512_sub_ps(vload(x + j, m), vmax)));
+    vsum = _mm512_add_ps(vsum, v);
+    _mm512_mask_storeu_ps(s + j, m, v);
+  }
+  __m512 vinv = _mm512_div_ps(one, _mm512_set1_ps(_mm512_reduce_add_ps(vsum)));
+  for (int64_t j = 0; j < n; j += 16) {
+    __mmask16 m = (__mmask16)((n - j) >= 16 ? 0xFFFF : ((1u << (n - j)) - 1));
+    __m512 v = _mm512_mul_ps(_mm512_maskz_loadu_ps(m, s + j), vinv);
+    _mm512_mask_storeu_ps(s + j, m, v);
+    _mm512_mask_storeu_ps(key + j, m, bias ? _mm512_add_ps(v, _mm512_maskz_loadu_ps(m, bias + j)) : v);
+  }
+}
+#endif
+
+template <typename T>
+inline void router_scores(const T *x, const float *bias, int64_t n, int score_func, float *s, float *key) {
+#if TUTEL_CPU_AVX512
+  if (has_avx512())
+    return router_scores_avx512(x, bias, n, score_func, s, key);
+#endif
+  router_scores_scalar(x, bias, n, score_func, s, key);
+}
+
+// Inserts (v, id) into the descending list (top_v, top_id) of `len` <= k entries; earlier ids win ties and NaNs never enter a full list.
+inline void insert_topk(float *top_v, int32_t *top_id, int64_t &len, int64_t k, float v, int32_t id) {
+  if (len == k && !(v > top_v[k - 1]))
+    return;
+  int64_t i = len < k ? len++ : k - 1;
+  for (; i > 0 && v > top_v[i - 1]; --i)
+    top_v[i] = top_v[i - 1], top_id[i] = top_id[i - 1];
+  top_v[i] = v, top_id[i] = id;
+}
+
+// Rows [begin, end) of x: [rows, n] into top_v: [rows, k] and top_id: [rows, k], requiring k <= n / n_group * topk_group.
+template <typename T>
+void scaled_topk(const T *x, const float *bias, int64_t n, int64_t k, int64_t n_group, int64_t topk_group, int score_func, bool normalize, float scale,
+                 float *top_v, int32_t *top_id, int64_t begin, int64_t end) {
+  const int64_t group_size = n / n_group;
+  const bool grouped = n_group > 1 && topk_group < n_group;
+  std::vector<float> s(n), key(n), keys(k), group_keys(topk_group);
+  std::vector<int32_t> groups(topk_group);
+  for (int64_t r = begin; r < end; ++r) {
+    router_scores(x + r * n, bias, n, score_func, s.data(), key.data());
+    float *out_v = top_v + r * k;
+    int32_t *out_id = top_id + r * k;
+    int64_t len = 0;
+    if (grouped) {
+      int64_t num_groups = 0;
+      for (int64_t g = 0; g < n_group; ++g) {
+        float best[2] = {-INFINITY, -INFINITY};
+        for (int64_t j = g * group_size; j < (g + 1) * group_size; ++j)
+          if (key[j] > best[1])
+            best[1] = key[j] > best[0] ? best[0] : key[j], best[0] = std::max(best[0], key[j]);
+        insert_topk(group_keys.data(), groups.data(), num_groups, topk_group, group_size > 1 ? best[0] + best[1] : best[0], g);
+      }
+      // Scanning selected groups in ascending order lets ties resolve to lower expert ids, as over the full row.
+      std::sort(groups.begin(), groups.begin() + num_groups);
+      for (int64_t i = 0; i < num_groups; ++i)
+        for (int64_t j = groups[i] * group_size; j < (groups[i] + 1) * group_size; ++j)
+          insert_topk(keys.data(), out_id, len, k, key[j], int32_t(j));
+    } else {
+      for (int64_t j = 0; j < n; ++j)
+        insert_topk(keys.data(), out_id, len, k, key[j], int32_t(j));
+    }
+    float sum = 0.0f;
+    for (int64_t i = 0; i < k; ++i)
+      sum += (out_v[i] = s[out_id[i]]);
+    const float mul = normalize ? scale / (sum + 1e-20f) : scale;
+    for (int64_t i = 0; i < k; ++i)
+      out_v[i] *= mul;
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Fused linear gate: p = softmax(x @ wg^T) and top-k of p in one pass.
+//
+// x: [rows, model_dim], wg: [n, model_dim]. Logits of a block of rows are
+// computed from one float copy of x straight into `probs`, then each row is
+// softmaxed in place and reduced, while still hot in cache, into top_v/top_id:
+// [rows, k], per-expert score sums me: [n] and per-rank selection counts
+// counts: [k, n]. me and counts are accumulated into partials owned by the caller.
+
+constexpr int64_t GATE_ROW_BLOCK = 32;
+
+template <typename T, typename TW>
+void gate_topk(const T *x, const TW *wg, int64_t model_dim, int64_t n, int64_t k, float *probs, float *top_v, int32_t *top_id,
+               float *me, int32_t *counts, int64_t begin, int64_t end) {
+  std::vector<float> xf(GATE_ROW_BLOCK * model_dim), key(n);
+  for (int64_t r0 = begin; r0 < end; r0 += GATE_ROW_BLOCK) {
+    const int64_t rows = std::min(GATE_ROW_BLOCK, end - r0);
+    float *logits = probs + r0 * n;
+    load_rows_as_float(x + r0 * model_dim, model_dim, rows, xf.data());
+    std::fill(logits, logits + rows * n, 0.0f);
+    gemm_nt_block_acc(xf.data(), model_dim, wg, model_dim, logits, n, rows, model_dim, n);
+    for (int64_t r = r0; r < r0 + rows; ++r) {
+      float *p = probs + r * n, *out_v = top_v + r * k;
+      int32_t *out_id = top_id + r * k;
+      router_scores(p, nullptr, n, ROUTER_SOFTMAX, p, key.data());
+      int64_t len = 0;
+      for (int64_t j = 0; j < n; ++j)
+        insert_topk(out_v, out_id, len, k, p[j], int32_t(j)), me[j] += p[j];
+      for (int64_t i = 0; i < k; ++i)
+        ++counts[i * n + out_id[i]];
+    }
+  }
+}
+
+// Rows [begin, end) of grad_logits: [rows, n] through the softmax, from grad_v: [rows, k] of the selected scores
+// and the optional grad_me: [n] of the per-expert score sums.
+inline void gate_topk_backward(const float *probs, const int32_t *top_id, const float *grad_v, const float *grad_me, int64_t n, int64_t k,
+                               float *grad_logits, int64_t begin, int64_t end) {
+  for (int64_t r = begin; r < end; ++r) {
+    const float *p = probs + r * n;
+    float *g = grad_logits + r * n, dot = 0.0f;
+    for (int64_t j = 0; j < n; ++j)
+      g[j] = grad_me ? grad_me[j] : 0.0f;
+    for (int64_t i = 0; i < k; ++i)
+      g[top_id[r * k + i]] += grad_v[r * k + i];
+    for (int64_t j = 0; j < n; ++j)
+      dot += g[j] * p[j];
+    for (int64_t j = 0; j < n; ++j)
+      g[j] = p[j] * (g[j] - dot);
+  }
+}
+
+// Cosine gate: logits[r, j] = scale * <x[r], w[j]> / max(|x[r]|, 1e-12), for rows [begin, end) of x: [rows, d]
+// and w: [n, d] of normalized expert embeddings. Row norms come from the same float copy of x as the GEMM,
+// and are applied with the scale in its epilogue.
+template <typename T>
+void cosine_logits(const T *x, const T *w, int64_t d, int64_t n, float scale, T *logits, int64_t begin, int64_t end) {
+  std::vector<float> xf(GATE_ROW_BLOCK * d), acc(GATE_ROW_BLOCK * n);
+  for (int64_t r0 = begin; r0 < end; r0 += GATE_ROW_BLOCK) {
+    const int64_t rows = std::min(GATE_ROW_BLOCK, end - r0);
+    load_rows_as_float(x + r0 * d, d, rows, xf.data());
+    std::fill(acc.begin(), acc.end(), 0.0f);
+    gemm_nt_block_acc(xf.data(), d, w, d, acc.data(), n, rows, d, n);
+    for (int64_t r = 0; r < rows; ++r) {
+      float sq = 0.0f;
+      for (int64_t k = 0; k < d; ++k)
+        sq += xf[r * d + k] * xf[r * d + k];
+      const float mul = scale / std::max(std::sqrt(sq), 1e-12f);
+      for (int64_t j = 0; j < n; ++j)
+        from_float(logits + (r0 + r) * n + j, acc[r * n + j] * mul);
+    }
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Per-expert statistics of the auxiliary routing losses, accumulated over
+// rows [begin, end) of scores: [rows, n] without [rows, n] temporaries.
+// Callers reduce fixed blocks of LOSS_ROW_BLOCK rows into separate partials
+// and add them up in block order, so that results don't depend on threads.
+
+constexpr int64_t LOSS_ROW_BLOCK = 256;
+
+// me[j] += sum of scores[:, j], ce[j] += number of rows whose top-1 expert is j.
+template <typename T>
+void gshard_loss_stats(const T *scores, const int64_t *top_ids, int64_t ld_ids, int64_t n, float *me, float *ce, int64_t begin, int64_t end) {
+  for (int64_t r = begin; r < end; ++r) {
+    for (int64_t j = 0; j < n; ++j)
+      me[j] += to_float(scores[r * n + j]);
+    ce[top_ids[r * ld_ids]] += 1.0f;
+  }
+}
+
+// imp[j] += sum of scores[:, j], load[j] += sum of P(scores[:, j] + noise > threshold) for noise ~ N(0, sigma).
+template <typename T>
+void load_importance_stats(const T *scores, const float *threshold, int64_t n, float sigma, float *imp, float *load, int64_t begin, int64_t end) {
+  const float scale = 1.0f / (sigma * std::sqrt(2.0f));
+  for (int64_t r = begin; r < end; ++r)
+    for (int64_t j = 0; j < n; ++j) {
+      float s = to_float(scores[r * n + j]);
+      imp[j] += s;
+      load[j] += 0.5f * (1.0f + std::erf((s - threshold[r]) * scale));
+    }
+}
+
+template <typename T>
+void load_importance_backward(const T *scores, const float *threshold, int64_t n, float sigma, const float *grad_imp, const float *grad_load,
+                              T *grad_scores, float *grad_threshold, int64_t begin, int64_t end) {
+  const float scale = 1.0f / (sigma * std::sqrt(2.0f)), norm = 1.0f / (sigma * 2.50662827f);
+  for (int64_t r = begin; r < end; ++r) {
+    float grad_t = 0.0f;
+    for (int64_t j = 0; j < n; ++j) {
+      float d = (to_float(scores[r * n + j]) - threshold[r]) * scale;
+      float g = grad_load[j] * norm * std::exp(-d * d);
+      from_float(grad_scores + r * n + j, grad_imp[j] + g);
+      grad_t -= g;
+    }
+    grad_threshold[r] = grad_t;
+  }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Batch-prioritized locations: tokens are ordered by ascending importance with
+// a stable LSD radix sort of 8-bit digits, whose passes histogram and scatter
+// each contiguous chunk of the current order independently. Locations of all
+// k ranks are then assigned by walking the order once more per chunk, from
+// per-(chunk, rank, expert) counts turned into exclusive offsets.
+
+// Maps a float to an unsigned key of the same ascending order.
+inline uint32_t radix_key(float v) {
+  uint32_t u;
+  memcpy(&u, &v, sizeof(u));
+  return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+inline void radix_histogram(const uint32_t *keys, const int32_t *order, int shift, int64_t *hist, int64_t begin, int64_t end) {
+  for (int64_t i = begin; i < end; ++i)
+    ++hist[(keys[order[i]] >> shift) & 255];
+}
+
+// Scatters order[begin, end) to out by digit, from the exclusive offsets of this chunk.
+inline void radix_scatter(const uint32_t *keys, const int32_t *order, int shift, int64_t *offsets, int32_t *out, int64_t begin, int64_t end) {
+  for (int64_t i = begin; i < end; ++i)
+    out[offsets[(keys[order[i]] >> shift) & 255]++] = order[i];
+}
+
+// counts[k * n + e] += tokens of order[begin, end) whose rank-k expert ids[k * samples + token] is e.
+inline void location_counts(const int32_t *order, const int64_t *ids, int64_t samples, int64_t k, int64_t n, int64_t *counts, int64_t begin, int64_t end) {
+  for (int64_t i = begin; i < end; ++i)
+    for (int64_t r = 0; r < k; ++r)
+      ++counts[r * n + ids[r * samples + order[i]]];
+}
+
+inline void location_assign(const int32_t *order, const int64_t *ids, int64_t samples, int64_t k, int64_t n, int64_t *offsets, int32_t *locations, int64_t begin, int64_t end) {
+  for (int64_t i = begin; i < end; ++i)
+    for (int64_t r = 0; r < k; ++r)
+      locations[r * samples + order[i]] = int32_t(offsets[r * n + ids[r * samples + order[i]]]++);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Expert-choice routing: each expert picks the `capacity` tokens it scores
+// highest. Experts [begin, end) of scores: [samples, n] select into sel:
+// [n, capacity] in descending order of scores, where ties go to lower token ids.
+
+template <typename T>
+void expert_choice_select(const T *scores, int64_t samples, int64_t n, int64_t capacity, int32_t *sel, int64_t begin, int64_t end) {
+  std::vector<float> col(samples);
+  std::vector<int32_t> ids(samples);
+  auto better = [&](int32_t a, int32_t b) { return col[a] > col[b] || (col[a] == col[b] && a < b); };
+  for (int64_t e = begin; e < end; ++e) {
+    for (int64_t t = 0; t < samples; ++t)
+      col[t] = to_float(scores[t * n + e]), ids[t] = int32_t(t);
+    if (capacity < samples)
+      std::nth_element(ids.begin(), ids.begin() + capacity, ids.end(), better);
+    std::sort(ids.begin(), ids.begin() + capacity, better);
+    std::copy(ids.begin(), ids.begin() + capacity, sel + e * capacity);
+  }
+}
+
+// Spreads sel: [n, capacity] over per-token slots: the r-th expert (in expert order) that picked token t
+// sets indices[r, t] = e and locations[r, t] to the position of t in its selection. `fill` holds zeros for all tokens.
+inline void expert_choice_assign(const int32_t *sel, int64_t samples, int64_t n, int64_t capacity, int32_t *fill, int32_t *indices, int32_t *locations) {
+  for (int64_t e = 0; e < n; ++e)
+    for (int64_t i = 0; i < capacity; ++i) {
+      int64_t t = sel[e * capacity + i], slot = fill[t]++;
+      indices[slot * samples + t] = int32_t(e), locations[slot * samples + t] = int32_t(i);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// RMSNorm: y[r] = x[r] * rsqrt(mean(x[r]^2) + eps) * w over n columns, with
+// rows [begin, end) of x at stride ldx. If t is given, the residual x[r] + t[r]
+// is first rounded into h[r], which is then normalized from cache. Squares are
+// accumulated in fp32, and y is rounded once after the weight is applied.
+
+template <typename T>
+inline void rmsnorm_scalar(const T *x, int64_t ldx, const T *t, const T *w, int64_t n, float eps, T *h, T *y, int64_t begin, int64_t end) {
+  for (int64_t r = begin; r < end; ++r) {
+    const T *src = x + r * ldx;
+    if (t) {
+      for (int64_t j = 0; j < n; ++j)
+        from_float(h + r * n + j, to_float(src[j]) + to_float(t[r * n + j]));
+      src = h + r * n;
+    }
+    float sq = 0.0f;
+    for (int64_t j = 0; j < n; ++j)
+      sq += to_float(src[j]) * to_float(src[j]);
+    const float rstd = 1.0f / std::sqrt(sq / float(n) + eps);
+    for (int64_t j = 0; j < n; ++j)
+      from_float(y + r * n + j, to_float(src[j]) * rstd * to_float(w[j]));
+  }
+}
+
+#if TUTEL_CPU_AVX512
+template <typename T>
+TUTEL_TARGET_AVX512 void rmsnorm_avx512(const T *x, int64_t ldx, const T *t, const T *w, int64_t n, float eps, T *h, T *y, int64_t begin, int64_t end) {
+  for (int64_t r = begin; r < end; ++r) {
+    const T *src = x + r * ldx;
+    __m512 vsq = _mm512_setzero_ps();
+    for (int64_t j = 0; j < n; j += 16) {
+      __mmask16 m = tail_mask(n - j);
+      __m512 v = vload(src + j, m);
+      if (t) {
+        vstore(h + r * n + j, _mm512_add_ps(v, vload(t + r * n + j, m)), m);
+        v = vload(h + r * n + j, m);
+      }
+      vsq = _mm512_fmadd_ps(v, v, vsq);
+    }
+    if (t)
+      src = h + r * n;
+    const __m512 vrstd = _mm512_set1_ps(1.0f / std::sqrt(_mm512_reduce_add_ps(vsq) / float(n) + eps));
+    for (int64_t j = 0; j < n; j += 16) {
+      __mmask16 m = tail_mask(n - j);
+      vstore(y + r * n + j, _mm512_mul_ps(_mm512_mul_ps(vload(src + j, m), vrstd), vload(w + j, m)), m);
+    }
+  }
+}
+#endif
+
+template <typename T>
+inline void rmsnorm(const T *x, int64_t ldx, const T *t, const T *w, int64_t n, float eps, T *h, T *y, int64_t begin, int64_t end) {
+#if TUTEL_CPU_AVX512
+  if (has_avx512())
+    return rmsnorm_avx512(x, ldx, t, w, n, eps, h, y, begin, end);
+#endif
+  rmsnorm_scalar(x, ldx, t, w, n, eps, h, y, begin, end);
+}
+
+// Attention input projection epilogue over work items (token, head) of a
+// [tokens, n_heads + 2 * kv_heads, d] qkv tensor: q and k heads are optionally
+// RMS-normalized by q_norm / k_norm, rotated by neox-style rotary embedding
+// with cos / sin rows of width ld_rope at positions[token] (first d / 2 used),
+// then q is written to q_out[token] and k / v to key_cache / val_cache at row
+// slots[token] of [slots, kv_heads, d]. Negative slots skip the cache write.
+
+template <typename T>
+inline void norm_rotary_head_scalar(const T *x, const T *w, const float *c, const float *s, int64_t d, float eps, T *y) {
+  float rstd = 1.0f;
+  if (w) {
+    float sq = 0.0f;
+    for (int64_t j = 0; j < d; ++j)
+      sq += to_float(x[j]) * to_float(x[j]);
+    rstd = 1.0f / std::sqrt(sq / float(d) + eps);
+  }
+  const int64_t half = d / 2;
+  for (int64_t j = 0; j < half; ++j) {
+    float x1 = to_float(x[j]) * rstd, x2 = to_float(x[j + half]) * rstd;
+    if (w)
+      x1 *= to_float(w[j]), x2 *= to_float(w[j + half]);
+    from_float(y + j, x1 * c[j] - x2 * s[j]);
+    from_float(y + j + half, x2 * c[j] + x1 * s[j]);
+  }
+}
+
+#if TUTEL_CPU_AVX512
+template <typename T>
+TUTEL_TARGET_AVX512 void norm_rotary_head_avx512(const T *x, const T *w, const float *c, const float *s, int64_t d, float eps, T *y) {
+  __m512 vrstd = _mm512_set1_ps(1.0f);
+  if (w) {
+    __m512 vsq = _mm512_setzero_ps();
+    for (int64_t j = 0; j < d; j += 16) {
+      __m512 v = vload(x + j, tail_mask(d - j));
+      vsq = _mm512_fmadd_ps(v, v, vsq);
+    }
+    vrstd = _mm512_set1_ps(1.0f / std::sqrt(_mm512_reduce_add_ps(vsq) / float(d) + eps));
+  }
+  const int64_t half = d / 2;
+  for (int64_t j = 0; j < half; j += 16) {
+    __mmask16 m = tail_mask(half - j);
+    __m512 x1 = _mm512_mul_ps(vload(x + j, m), vrstd), x2 = _mm512_mul_ps(vload(x + j + half, m), vrstd);
+    if (w)
+      x1 = _mm512_mul_ps(x1, vload(w + j, m)), x2 = _mm512_mul_ps(x2, vload(w + j + half, m));
+    __m512 vc = vload(c + j, m), vs = vload(s + j, m);
+    vstore(y + j, _mm512_fmsub_ps(x1, vc, _mm512_mul_ps(x2, vs)), m);
+    vstore(y + j + half, _mm512_fmadd_ps(x2, vc, _mm512_mul_ps(x1, vs)), m);
+  }
+}
+#endif
+
+template <typename T>
+inline void norm_rotary_kvcache(const T *qkv, const int64_t *positions, const int64_t *slots, const float *cos, const float *sin, int64_t ld_rope,
+                                const T *q_norm, const T *k_norm, int64_t n_heads, int64_t kv_heads, int64_t d, float eps,
+                                T *q_out, T *key_cache, T *val_cache, int64_t begin, int64_t end) {
+  auto head = norm_rotary_head_scalar<T>;
+#if TUTEL_CPU_AVX512
+  if (has_avx512())
+    head = norm_rotary_head_avx512<T>;
+#endif
+  const int64_t heads = n_heads + 2 * kv_heads;
+  for (int64_t i = begin; i < end; ++i) {
+    const int64_t token = i / heads, h = i % heads, slot = slots[token];
+    const T *x = qkv + i * d;
+    const float *c = cos + positions[token] * ld_rope, *s = sin + positions[token] * ld_rope;
+    if (h < n_heads)
+      head(x, q_norm, c, s, d, eps, q_out + (token * n_heads + h) * d);
+    else if (slot < 0)
+      continue;
+    else if (h < n_heads + kv_heads)
+      head(x, k_norm, c, s, d, eps, key_cache + (slot * kv_heads + h - n_heads) * d);
+    else
+      memcpy(val_cache + (slot * kv_heads + h - n_heads - kv_heads) * d, x, d * sizeof(T));
+  }
+}
+
+} // namespace cpu
@@ -26,6 +26,14 @@
 
 #include <regex>
 #include <vector>
+#include <array>
+
+#include <ATen/Parallel.h>
+#include <torch/library.h>
+#include "cpu_kernels.h"
+#if !defined(_WIN32)
+#include "shm_transport.h"
+#endif
 
 #if defined(__linux__)
 #include <sys/wait.h>
@@ -329,6 +337,14 @@ template<typename dtype> static void invoke_cpu(const std::vector<torch::Tensor>
         }
       }
     }
+  } else if (kernel_type == 3) { //combine_data, accumulating into the output
+    for (int i = 0; i < samples; ++i) {
+      if (locations1_s[i] < capacity && indices1_s[i] >= 0) {
+        for (int j = 0; j < hidden; ++j) {
+          reshaped_input[i * hidden + j] += gates1_s[i] * dispatched_input[(indices1_s[i] * capacity + locations1_s[i]) * (hidden) + j];
+        }
+      }
+    }
   } else { //backward_gate
     for (int i = 0; i < samples; ++i) {
       gates1_s[i] = 0;
@@ -1101,6 +1117,19 @@ torch::Tensor warp_scatter_sample_ids(const torch::Tensor &expert_ids, const tor
 }
 
 
+torch::Tensor warp_gemm_nt_bf16xfp8_block_scal_out_cpu(const torch::Tensor &x, torch::Tensor w, const torch::Tensor &scal, const ::std::optional<torch::Tensor> &w_alt, const ::std::optional<torch::Tensor> &p_out);
+torch::Tensor warp_glu_expert_bf16xf8_block_scal_cpu(const torch::Tensor &x, const torch::Tensor &expert_ids, const torch::Tensor &expert_weight,
+  const torch::Tensor &moe_gate_up_w, const torch::Tensor &moe_gate_up_s, const torch::Tensor &moe_down_w, const torch::Tensor &moe_down_s, const torch::Tensor &out);
+torch::Tensor warp_shared_expert_bf16xf8_cpu(const torch::Tensor &x, const torch::Tensor &moe_gate_up_w, const torch::Tensor &moe_gate_up_s, const torch::Tensor &moe_down_w, const torch::Tensor &moe_down_s);
+std::tuple<torch::Tensor, torch::Tensor> warp_deepseek_sigmoid_top_8_static_v2_cpu(const torch::Tensor &logits_bf16, const torch::Tensor &moe_gate_b_bf16,
+  const ::std::optional<torch::Tensor> &top_v_out_, const ::std::optional<torch::Tensor> &top_k_out_);
+std::tuple<torch::Tensor, torch::Tensor> warp_kimi_sigmoid_top_8_static_v2_cpu(const torch::Tensor &logits_bf16, const torch::Tensor &moe_gate_b_bf16,
+  const ::std::optional<torch::Tensor> &top_v_out_, const ::std::optional<torch::Tensor> &top_k_out_);
+std::tuple<torch::Tensor, torch::Tensor> warp_qwen3_moe_top_8_static_cpu(const torch::Tensor &logits_fp32);
+torch::Tensor warp_rmsnorm_bf16_cpu(const torch::Tensor &x, const torch::Tensor &rms_w, double eps, int64_t id);
+torch::Tensor warp_qwen3_norm_rotary_kvcache2_bf16_cpu(const torch::Tensor &cos_cache, const torch::Tensor &sin_cache, const torch::Tensor &positions,
+  const torch::Tensor &qkv_out, const torch::Tensor &key_cache, const torch::Tensor &val_cache, const torch::Tensor &qk_norm, int64_t n_heads);
+
 torch::Tensor warp_to_bfloat16(const torch::Tensor &w, const torch::Tensor &scal) {
   CHECK_CUDA(w);
   if (w.dtype() == torch::kBFloat16)
@@ -1132,6 +1161,8 @@ torch::Tensor warp_to_bfloat16(const torch::Tensor &w, const torch::Tensor &scal
 }
 
 torch::Tensor warp_gemm_nt_bf16xfp8_block_scal_out(const torch::Tensor &x, torch::Tensor w, const torch::Tensor &scal, const ::std::optional<torch::Tensor> &w_alt, const ::std::optional<torch::Tensor> &p_out) {
+  if (!x.is_cuda())
+    return warp_gemm_nt_bf16xfp8_block_scal_out_cpu(x, w, scal, w_alt, p_out);
   CHECK_CUDA(x);
   CHECK_EQ(x.dim(), 3);
   CHECK_EQ(x.dtype(), torch::kBFloat16);
@@ -1162,6 +1193,8 @@ torch::Tensor warp_gemm_nt_bf16xfp8_block_scal_out(const torch::Tensor &x, torch
 }
 
 torch::Tensor warp_rmsnorm_bf16(const torch::Tensor &x, const torch::Tensor &rms_w, double eps, int64_t id = 0) {
+  if (!x.is_cuda())
+    return warp_rmsnorm_bf16_cpu(x, rms_w, eps, id);
   CHECK_CUDA(x);
   CHECK_EQ(x.dim(), 3);
   CHECK_EQ(x.dtype(), torch::kBFloat16);
@@ -1176,6 +1209,8 @@ std::tuple<torch::Tensor, torch::Tensor> warp_deepseek_sigmoid_top_8_static_v2(
      const torch::Tensor &moe_gate_b_bf16,
      const ::std::optional<torch::Tensor> &top_v_out_,
      const ::std::optional<torch::Tensor> &top_k_out_) {
+  if (!logits_bf16.is_cuda())
+    return warp_deepseek_sigmoid_top_8_static_v2_cpu(logits_bf16, moe_gate_b_bf16, top_v_out_, top_k_out_);
   CHECK_CUDA(logits_bf16);
   CHECK_EQ(logits_bf16.dtype(), torch::kBFloat16);
   CHECK_EQ(moe_gate_b_bf16.dtype(), torch::kBFloat16);
@@ -1194,6 +1229,8 @@ std::tuple<torch::Tensor, torch::Tensor> warp_deepseek_sigmoid_top_8_static_v2(
 
 std::tuple<torch::Tensor, torch::Tensor> warp_qwen3_moe_top_8_static(
      const torch::Tensor &logits_fp32) {
+  if (!logits_fp32.is_cuda())
+    return warp_qwen3_moe_top_8_static_cpu(logits_fp32);
   CHECK_CUDA(logits_fp32);
   CHECK_EQ(logits_fp32.dtype(), torch::kFloat32);
 
@@ -1213,6 +1250,8 @@ std::tuple<torch::Tensor, torch::Tensor> warp_kimi_sigmoid_top_8_static_v2(
      const torch::Tensor &moe_gate_b_bf16,
      const ::std::optional<torch::Tensor> &top_v_out_,
      const ::std::optional<torch::Tensor> &top_k_out_) {
+  if (!logits_bf16.is_cuda())
+    return warp_kimi_sigmoid_top_8_static_v2_cpu(logits_bf16, moe_gate_b_bf16, top_v_out_, top_k_out_);
   CHECK_CUDA(logits_bf16);
   CHECK_EQ(logits_bf16.dtype(), torch::kBFloat16);
   CHECK_EQ(moe_gate_b_bf16.dtype(), torch::kBFloat16);
@@ -1239,6 +1278,8 @@ torch::Tensor warp_qwen3_norm_rotary_kvcache2_bf16(
      const torch::Tensor &qk_norm,
      int64_t n_heads
 ) {
+  if (!qkv_out.is_cuda())
+    return warp_qwen3_norm_rotary_kvcache2_bf16_cpu(cos_cache, sin_cache, positions, qkv_out, key_cache, val_cache, qk_norm, n_heads);
   int64_t local_kv_heads = key_cache.size(-2);
   auto q_out = antares::ops::call("qwen3_norm_rotary_kvcache2_bf16", {cos_cache, sin_cache, positions.flatten(),
     qkv_out.view(torch::kInt32), key_cache.view(torch::kInt32), val_cache.view(torch::kInt32), qk_norm.view(torch::kInt32)}, {n_heads, 1e-6, n_heads + local_kv_heads}).view(torch::kBFloat16);
@@ -1407,6 +1448,9 @@ torch::Tensor warp_shared_expert_bf16xf8(
   const torch::Tensor &moe_down_w,
   const torch::Tensor &moe_down_s
 ) {
+    if (!x.is_cuda())
+      return warp_shared_expert_bf16xf8_cpu(x, moe_gate_up_w, moe_gate_up_s, moe_down_w, moe_down_s);
+
     int model_dim = x.size(-1);
     int samples = x.numel() / model_dim;
 
@@ -1468,6 +1512,9 @@ torch::Tensor warp_glu_expert_bf16xf8_block_scal(
   const torch::Tensor &moe_down_s,
   const torch::Tensor &out) {
 
+  if (!x.is_cuda())
+    return warp_glu_expert_bf16xf8_block_scal_cpu(x, expert_ids, expert_weight, moe_gate_up_w, moe_gate_up_s, moe_down_w, moe_down_s, out);
+
   int model_dim = x.size(-1);
   int samples = x.numel() / model_dim;
 
@@ -1641,6 +1688,8 @@ std::tuple<torch::Tensor, torch::Tensor, torch::Tensor> warp_multi_head_latent_r
 }
 
 torch::Tensor warp_gemm_nt_bf16xfp8_block_scal(const torch::Tensor &x, const torch::Tensor &w, const torch::Tensor &scal, int64_t policy = 0) {
+  if (!x.is_cuda() && scal.dim() == 2)
+    return warp_gemm_nt_bf16xfp8_block_scal_out_cpu(x, w, scal, ::std::nullopt, ::std::nullopt);
   CHECK_CUDA(x);
   CHECK_EQ(x.dim(), 3);
   CHECK_EQ(x.dtype(), torch::kBFloat16);
@@ -1680,9 +1729,1053 @@ torch::Tensor warp_gemm_nt_bf16xfp8_block_scal(const torch::Tensor &x, const tor
 }
 
 #endif
+#endif
+
+template<typename FN> static void dispatch_cpu_floating(at::ScalarType dtype, FN fn) {
+  if (dtype == torch::kFloat32)
+    fn(float());
+  else if (dtype == torch::kBFloat16)
+    fn(cpu::bf16());
+  else if (dtype == torch::kFloat16)
+    fn(cpu::fp16());
+  else
+    AT_ASSERTM(false, "Unsupported data type for CPU kernel: ", dtype);
+}
+
+torch::Tensor warp_rowwise_compress(const torch::Tensor &x, int64_t mode) {
+  CHECK_CPU(x);
+  CHECK_EQ(mode == cpu::ROWWISE_FP8 || mode == cpu::ROWWISE_INT8, true);
+  auto x_ = x.contiguous().view({-1, x.size(-1)});
+  int64_t rows = x_.size(0), cols = x_.size(1);
+  auto out = torch::empty({rows, cpu::rowwise_packed_cols(cols)}, torch::TensorOptions().dtype(torch::kUInt8).device(x.device()));
+  dispatch_cpu_floating(x_.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *src = static_cast<const T*>(x_.data_ptr());
+    uint8_t *dst = out.data_ptr<uint8_t>();
+    at::parallel_for(0, rows, std::max<int64_t>(1, 16384 / std::max<int64_t>(cols, 1)), [&](int64_t begin, int64_t end) {
+      cpu::rowwise_compress(src, cols, dst, mode, begin, end);
+    });
+  });
+  return out;
+}
+
+torch::Tensor warp_rowwise_decompress(const torch::Tensor &packed, const torch::Tensor &out, int64_t mode) {
+  CHECK_CPU(packed);
+  CHECK_CPU(out);
+  CHECK_CONTIGUOUS(packed);
+  CHECK_CONTIGUOUS(out);
+  CHECK_EQ(packed.dtype(), torch::kUInt8);
+  CHECK_EQ(mode == cpu::ROWWISE_FP8 || mode == cpu::ROWWISE_INT8, true);
+  int64_t cols = out.size(-1), rows = out.numel() / std::max<int64_t>(cols, 1);
+  CHECK_EQ(packed.numel(), rows * cpu::rowwise_packed_cols(cols));
+  dispatch_cpu_floating(out.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const uint8_t *src = packed.data_ptr<uint8_t>();
+    T *dst = static_cast<T*>(out.data_ptr());
+    at::parallel_for(0, rows, std::max<int64_t>(1, 16384 / std::max<int64_t>(cols, 1)), [&](int64_t begin, int64_t end) {
+      cpu::rowwise_decompress(src, cols, dst, mode, begin, end);
+    });
+  });
+  return out;
+}
+
+torch::Tensor warp_swiglu_expert(const torch::Tensor &x, const torch::Tensor &w1, const torch::Tensor &w2, const torch::Tensor &w3) {
+  for (auto &t : {x, w1, w2, w3}) {
+    CHECK_CPU(t);
+    CHECK_CONTIGUOUS(t);
+    CHECK_EQ(t.dim(), 3);
+    CHECK_EQ(t.dtype(), x.dtype());
+  }
+  int64_t experts = x.size(0), rows = x.size(1), model_dim = x.size(2), hidden = w1.size(2), out_dim = w3.size(2);
+  CHECK_EQ(w1.size(0), experts);
+  CHECK_EQ(w1.size(1), model_dim);
+  CHECK_EQ(w2.sizes(), w1.sizes());
+  CHECK_EQ(w3.size(0), experts);
+  CHECK_EQ(w3.size(1), hidden);
+
+  auto y = torch::empty({experts, rows, out_dim}, x.options());
+  int64_t blocks = (rows + cpu::SWIGLU_ROW_BLOCK - 1) / cpu::SWIGLU_ROW_BLOCK;
+  dispatch_cpu_floating(x.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *xp = static_cast<const T*>(x.data_ptr()), *w1p = static_cast<const T*>(w1.data_ptr());
+    const T *w2p = static_cast<const T*>(w2.data_ptr()), *w3p = static_cast<const T*>(w3.data_ptr());
+    T *yp = static_cast<T*>(y.data_ptr());
+    at::parallel_for(0, experts * blocks, 1, [&](int64_t begin, int64_t end) {
+      for (int64_t i = begin; i < end; ++i) {
+        int64_t e = i / blocks, r = i % blocks * cpu::SWIGLU_ROW_BLOCK;
+        cpu::swiglu_expert(xp + e * rows * model_dim, w1p + e * model_dim * hidden, w2p + e * model_dim * hidden, w3p + e * hidden * out_dim,
+          yp + e * rows * out_dim, model_dim, hidden, out_dim, r, std::min(rows, r + cpu::SWIGLU_ROW_BLOCK));
+      }
+    });
+  });
+  return y;
+}
+
+std::vector<torch::Tensor> warp_bmm_bias_act(const torch::Tensor &x, const torch::Tensor &w, const ::std::optional<torch::Tensor> &bias, int64_t act, bool w_transposed, bool keep_preact) {
+  for (auto &t : {x, w}) {
+    CHECK_CPU(t);
+    CHECK_CONTIGUOUS(t);
+    CHECK_EQ(t.dim(), 3);
+    CHECK_EQ(t.dtype(), x.dtype());
+  }
+  CHECK_EQ(act >= cpu::ACT_NONE && act <= cpu::ACT_SILU, true);
+  int64_t experts = x.size(0), rows = x.size(1), k = x.size(2), n = w.size(w_transposed ? 1 : 2);
+  CHECK_EQ(w.size(0), experts);
+  CHECK_EQ(w.size(w_transposed ? 2 : 1), k);
+  int64_t bias_stride = 0;
+  if (bias.has_value()) {
+    CHECK_CPU(bias.value());
+    CHECK_CONTIGUOUS(bias.value());
+    CHECK_EQ(bias.value().dtype(), x.dtype());
+    CHECK_EQ(bias.value().numel() == n || bias.value().numel() == experts * n, true);
+    bias_stride = bias.value().numel() == n ? 0 : n;
+  }
+
+  auto y = torch::empty({experts, rows, n}, x.options());
+  auto z = keep_preact ? torch::empty({experts, rows, n}, x.options()) : torch::Tensor();
+  int64_t row_blocks = (rows + cpu::EPILOGUE_ROW_BLOCK - 1) / cpu::EPILOGUE_ROW_BLOCK;
+  int64_t col_blocks = (n + cpu::EPILOGUE_COL_BLOCK - 1) / cpu::EPILOGUE_COL_BLOCK;
+  dispatch_cpu_floating(x.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *xp = static_cast<const T*>(x.data_ptr()), *wp = static_cast<const T*>(w.data_ptr());
+    const T *bp = bias.has_value() ? static_cast<const T*>(bias.value().data_ptr()) : nullptr;
+    T *yp = static_cast<T*>(y.data_ptr()), *zp = keep_preact ? static_cast<T*>(z.data_ptr()) : nullptr;
+    at::parallel_for(0, experts * row_blocks * col_blocks, 1, [&](int64_t begin, int64_t end) {
+      for (int64_t i = begin; i < end; ++i) {
+        int64_t e = i / (row_blocks * col_blocks), r = i / col_blocks % row_blocks * cpu::EPILOGUE_ROW_BLOCK, c = i % col_blocks * cpu::EPILOGUE_COL_BLOCK;
+        cpu::bmm_bias_act(xp + e * rows * k, wp + e * k * n, bp ? bp + e * bias_stride : bp, yp + e * rows * n, zp ? zp + e * rows * n : zp,
+          k, n, w_transposed, int(act), r, std::min(rows, r + cpu::EPILOGUE_ROW_BLOCK), c, std::min(n, c + cpu::EPILOGUE_COL_BLOCK));
+      }
+    });
+  });
+  if (keep_preact)
+    return {y, z};
+  return {y};
+}
+
+torch::Tensor warp_qbmm_bias_act(const torch::Tensor &x, const torch::Tensor &qweight, const torch::Tensor &scales, const ::std::optional<torch::Tensor> &bias, int64_t bits, int64_t act) {
+  for (auto &t : {x, qweight, scales}) {
+    CHECK_CPU(t);
+    CHECK_CONTIGUOUS(t);
+    CHECK_EQ(t.dim(), 3);
+  }
+  CHECK_EQ(bits == 4 || bits == 8, true);
+  CHECK_EQ(qweight.element_size(), 1);
+  CHECK_EQ(scales.dtype(), torch::kFloat32);
+  CHECK_EQ(act >= cpu::ACT_NONE && act <= cpu::ACT_SILU, true);
+  int64_t experts = x.size(0), rows = x.size(1), k = x.size(2), n = qweight.size(1);
+  CHECK_EQ(k * bits % 8, 0);
+  CHECK_EQ(qweight.size(0), experts);
+  CHECK_EQ(qweight.size(2), k * bits / 8);
+  CHECK_EQ(scales.size(0), experts);
+  CHECK_EQ(scales.size(1), n);
+  CHECK_EQ(k % scales.size(2), 0);
+  int64_t group = k / scales.size(2), bias_stride = 0;
+  if (bias.has_value()) {
+    CHECK_CPU(bias.value());
+    CHECK_CONTIGUOUS(bias.value());
+    CHECK_EQ(bias.value().dtype(), x.dtype());
+    CHECK_EQ(bias.value().numel() == n || bias.value().numel() == experts * n, true);
+    bias_stride = bias.value().numel() == n ? 0 : n;
+  }
+
+  auto y = torch::empty({experts, rows, n}, x.options());
+  int64_t row_blocks = (rows + cpu::EPILOGUE_ROW_BLOCK - 1) / cpu::EPILOGUE_ROW_BLOCK;
+  int64_t col_blocks = (n + cpu::EPILOGUE_COL_BLOCK - 1) / cpu::EPILOGUE_COL_BLOCK;
+  dispatch_cpu_floating(x.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *xp = static_cast<const T*>(x.data_ptr());
+    const T *bp = bias.has_value() ? static_cast<const T*>(bias.value().data_ptr()) : nullptr;
+    const uint8_t *qp = static_cast<const uint8_t*>(qweight.data_ptr());
+    const float *sp = scales.data_ptr<float>();
+    T *yp = static_cast<T*>(y.data_ptr());
+    at::parallel_for(0, experts * row_blocks * col_blocks, 1, [&](int64_t begin, int64_t end) {
+      for (int64_t i = begin; i < end; ++i) {
+        int64_t e = i / (row_blocks * col_blocks), r = i / col_blocks % row_blocks * cpu::EPILOGUE_ROW_BLOCK, c = i % col_blocks * cpu::EPILOGUE_COL_BLOCK;
+        cpu::qbmm_bias_act(xp + e * rows * k, qp + e * n * (k * bits / 8), sp + e * n * (k / group), bp ? bp + e * bias_stride : bp, yp + e * rows * n,
+          k, n, group, int(bits), int(act), r, std::min(rows, r + cpu::EPILOGUE_ROW_BLOCK), c, std::min(n, c + cpu::EPILOGUE_COL_BLOCK));
+      }
+    });
+  });
+  return y;
+}
+
+std::vector<torch::Tensor> warp_to_float8_rowwise(const torch::Tensor &x, double fp8_max) {
+  CHECK_CPU(x);
+  CHECK_EQ(x.dim() >= 1, true);
+  auto x_ = x.contiguous();
+  int64_t cols = x_.size(-1), rows = x_.numel() / std::max<int64_t>(cols, 1);
+  auto out = torch::empty(x_.sizes(), torch::TensorOptions().dtype(at::kFloat8_e4m3fn).device(x.device()));
+  auto scale_inv = torch::empty(x_.sizes().slice(0, x_.dim() - 1), torch::TensorOptions().dtype(torch::kFloat32).device(x.device()));
+  dispatch_cpu_floating(x_.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *src = static_cast<const T*>(x_.data_ptr());
+    uint8_t *dst = static_cast<uint8_t*>(out.data_ptr());
+    float *sp = scale_inv.data_ptr<float>();
+    at::parallel_for(0, rows, std::max<int64_t>(1, 16384 / std::max<int64_t>(cols, 1)), [&](int64_t begin, int64_t end) {
+      cpu::to_float8_rowwise(src, cols, float(fp8_max), dst, sp, begin, end);
+    });
+  });
+  return {out, scale_inv};
+}
+
+std::vector<torch::Tensor> warp_to_float8_blockwise(const torch::Tensor &w, int64_t block_size) {
+  CHECK_CPU(w);
+  CHECK_EQ(w.dim() == 2 || w.dim() == 3, true);
+  CHECK_EQ(block_size > 0, true);
+  auto w_ = w.dim() == 2 ? w.contiguous().unsqueeze(0) : w.contiguous();
+  int64_t batch = w_.size(0), rows = w_.size(1), cols = w_.size(2);
+  int64_t row_blocks = (rows + block_size - 1) / block_size, col_blocks = (cols + block_size - 1) / block_size;
+  auto out = torch::empty(w_.sizes(), torch::TensorOptions().dtype(at::kFloat8_e4m3fn).device(w.device()));
+  auto scales = torch::empty({batch, row_blocks, col_blocks}, torch::TensorOptions().dtype(torch::kFloat32).device(w.device()));
+  dispatch_cpu_floating(w_.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *src = static_cast<const T*>(w_.data_ptr());
+    uint8_t *dst = static_cast<uint8_t*>(out.data_ptr());
+    float *sp = scales.data_ptr<float>();
+    at::parallel_for(0, batch * row_blocks * col_blocks, 1, [&](int64_t begin, int64_t end) {
+      for (int64_t i = begin; i < end; ++i) {
+        int64_t b = i / (row_blocks * col_blocks), t = i % (row_blocks * col_blocks);
+        cpu::to_float8_blockwise(src + b * rows * cols, rows, cols, block_size, dst + b * rows * cols, sp + b * row_blocks * col_blocks, t, t + 1);
+      }
+    });
+  });
+  if (w.dim() == 2)
+    return {out.squeeze(0), scales.squeeze(0)};
+  return {out, scales};
+}
+
+std::vector<torch::Tensor> warp_to_float4_groupwise(const torch::Tensor &w) {
+  CHECK_CPU(w);
+  CHECK_EQ(w.dim() >= 1, true);
+  CHECK_EQ(w.size(-1) % cpu::FP4_GROUP, 0);
+  auto w_ = w.contiguous();
+  int64_t groups = w_.numel() / cpu::FP4_GROUP;
+  auto out_shape = w_.sizes().vec();
+  out_shape.back() /= 2;
+  auto out = torch::empty(out_shape, torch::TensorOptions().dtype(torch::kUInt8).device(w.device()));
+  out_shape.back() /= cpu::FP4_GROUP / 2;
+  auto scales = torch::empty(out_shape, torch::TensorOptions().dtype(at::kFloat8_e4m3fn).device(w.device()));
+  float scale_max = 0.0f;
+  dispatch_cpu_floating(w_.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *src = static_cast<const T*>(w_.data_ptr());
+    scale_max = at::parallel_reduce(0, groups, 256, 0.0f, [&](int64_t begin, int64_t end, float partial) {
+      for (int64_t g = begin; g < end; ++g)
+        partial = std::max(partial, cpu::fp4_group_scale(src + g * cpu::FP4_GROUP));
+      return partial;
+    }, [](float a, float b) { return std::max(a, b); });
+    float scale_o = scale_max / 448.0f;
+    at::parallel_for(0, groups, 256, [&](int64_t begin, int64_t end) {
+      cpu::to_float4_groupwise(src, scale_o, out.data_ptr<uint8_t>(), static_cast<uint8_t*>(scales.data_ptr()), begin, end);
+    });
+  });
+  return {out, scales, torch::full({}, scale_max / 448.0f, torch::TensorOptions().dtype(torch::kFloat32).device(w.device()))};
+}
+
+torch::Tensor warp_from_float4_groupwise(const torch::Tensor &w, const torch::Tensor &scale, const ::std::optional<torch::Tensor> &scale_o, at::ScalarType dtype) {
+  CHECK_CPU(w);
+  CHECK_CPU(scale);
+  CHECK_CONTIGUOUS(w);
+  CHECK_CONTIGUOUS(scale);
+  CHECK_EQ(w.dtype(), torch::kUInt8);
+  CHECK_EQ(scale.element_size(), 1);
+  CHECK_EQ(w.dim(), scale.dim());
+  for (int i = 0; i < w.dim() - 1; ++i)
+    CHECK_EQ(w.size(i), scale.size(i));
+  int64_t cols = w.size(-1) * 2, rows = w.numel() * 2 / std::max<int64_t>(cols, 1);
+  CHECK_EQ(cols % scale.size(-1), 0);
+  int64_t group = cols / scale.size(-1), rows_per_scale = 1;
+  auto out_shape = w.sizes().vec();
+  out_shape.back() = cols;
+  auto out = torch::empty(out_shape, torch::TensorOptions().dtype(scale_o.has_value() ? dtype : torch::kBFloat16).device(w.device()));
+  torch::Tensor so;
+  if (scale_o.has_value()) {
+    CHECK_EQ(w.dim() >= 2, true);
+    so = scale_o.value().to(torch::kFloat32).contiguous();
+    int64_t inner = w.size(-2), prefix = rows / std::max<int64_t>(inner, 1);
+    CHECK_EQ(so.numel() % std::max<int64_t>(prefix, 1), 0);
+    CHECK_EQ(inner % (so.numel() / std::max<int64_t>(prefix, 1)), 0);
+    rows_per_scale = inner / (so.numel() / std::max<int64_t>(prefix, 1));
+  }
+  dispatch_cpu_floating(out.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const float *sp = so.defined() ? so.data_ptr<float>() : nullptr;
+    T *dst = static_cast<T*>(out.data_ptr());
+    at::parallel_for(0, rows, std::max<int64_t>(1, 16384 / std::max<int64_t>(cols, 1)), [&](int64_t begin, int64_t end) {
+      cpu::from_float4_groupwise(w.data_ptr<uint8_t>(), static_cast<const uint8_t*>(scale.data_ptr()), sp, rows_per_scale, cols, group, dst, begin, end);
+    });
+  });
+  return out;
+}
+
+torch::Tensor warp_marlin_pack_fp4(const torch::Tensor &w, int64_t layout, const ::std::optional<torch::Tensor> &out) {
+  CHECK_CPU(w);
+  CHECK_CONTIGUOUS(w);
+  CHECK_EQ(w.dtype(), torch::kUInt8);
+  CHECK_EQ(w.dim() >= 3, true);
+  CHECK_EQ(layout == cpu::MARLIN_FP4 || layout == cpu::MARLIN_NVFP4, true);
+  int64_t experts = w.size(0), n = w.size(1), k = w.numel() / std::max<int64_t>(experts * n, 1) * 2;
+  CHECK_EQ(n % 64, 0);
+  CHECK_EQ(k % 16, 0);
+  auto y = out.has_value() ? out.value() : torch::empty({experts, k / 16, n * 2}, torch::TensorOptions().dtype(torch::kInt32).device(w.device()));
+  CHECK_CPU(y);
+  CHECK_CONTIGUOUS(y);
+  CHECK_EQ(y.dtype(), torch::kInt32);
+  CHECK_EQ(y.numel(), experts * k / 16 * n * 2);
+  const uint8_t *src = w.data_ptr<uint8_t>();
+  uint32_t *dst = reinterpret_cast<uint32_t*>(y.data_ptr<int32_t>());
+  at::parallel_for(0, experts * (k / 16), 8, [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; ) {
+      int64_t e = i / (k / 16), kt = i % (k / 16), kt_end = std::min(k / 16, kt + end - i);
+      cpu::marlin_pack_fp4(src + e * n * k / 2, n, k, cpu::marlin_layout(layout), dst + e * k / 16 * n * 2, kt, kt_end);
+      i += kt_end - kt;
+    }
+  });
+  return y;
+}
+
+torch::Tensor warp_marlin_unpack_fp4(const torch::Tensor &y, int64_t layout, const ::std::optional<torch::Tensor> &out) {
+  CHECK_CPU(y);
+  CHECK_CONTIGUOUS(y);
+  CHECK_EQ(y.dtype(), torch::kInt32);
+  CHECK_EQ(y.dim(), 3);
+  CHECK_EQ(layout == cpu::MARLIN_FP4 || layout == cpu::MARLIN_NVFP4, true);
+  int64_t experts = y.size(0), k = y.size(1) * 16, n = y.size(2) / 2;
+  CHECK_EQ(n % 64, 0);
+  auto w = out.has_value() ? out.value() : torch::empty({experts, n, k / 2}, torch::TensorOptions().dtype(torch::kUInt8).device(y.device()));
+  CHECK_CPU(w);
+  CHECK_CONTIGUOUS(w);
+  CHECK_EQ(w.dtype(), torch::kUInt8);
+  CHECK_EQ(w.numel(), experts * n * k / 2);
+  const uint32_t *src = reinterpret_cast<const uint32_t*>(y.data_ptr<int32_t>());
+  uint8_t *dst = w.data_ptr<uint8_t>();
+  at::parallel_for(0, experts * (k / 16), 8, [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; ) {
+      int64_t e = i / (k / 16), kt = i % (k / 16), kt_end = std::min(k / 16, kt + end - i);
+      cpu::marlin_unpack_fp4(src + e * k / 16 * n * 2, n, k, cpu::marlin_layout(layout), dst + e * n * k / 2, kt, kt_end);
+      i += kt_end - kt;
+    }
+  });
+  return w;
+}
+
+std::tuple<torch::Tensor, torch::Tensor> warp_moe_scaled_topk(
+     const torch::Tensor &logits,
+     const ::std::optional<torch::Tensor> &bias,
+     int64_t top_k,
+     int64_t n_group,
+     int64_t topk_group,
+     int64_t score_func,
+     double routed_scale,
+     bool normalize,
+     const ::std::optional<torch::Tensor> &top_v_out_,
+     const ::std::optional<torch::Tensor> &top_k_out_) {
+  CHECK_CPU(logits);
+  CHECK_EQ(score_func == cpu::ROUTER_SOFTMAX || score_func == cpu::ROUTER_SIGMOID || score_func == cpu::ROUTER_NONE, true);
+  auto logits_ = logits.contiguous();
+  int64_t n_experts = logits_.size(-1), samples = logits_.numel() / std::max<int64_t>(n_experts, 1);
+  CHECK_EQ(n_group > 0 && n_experts % n_group == 0, true);
+  CHECK_EQ(topk_group > 0 && topk_group <= n_group, true);
+  AT_ASSERTM(top_k > 0 && top_k <= n_experts / n_group * topk_group, "Expect top_k within the experts of selected groups, but get top_k = ", top_k);
+  torch::Tensor bias_;
+  if (bias.has_value()) {
+    bias_ = bias.value().to(torch::kFloat32).contiguous();
+    CHECK_EQ(bias_.numel(), n_experts);
+  }
+
+  auto top_v_out = top_v_out_.has_value() ? top_v_out_.value().view({samples, -1}) : torch::empty({samples, top_k}, torch::TensorOptions().dtype(torch::kFloat32).device(logits.device()));
+  auto top_k_out = top_k_out_.has_value() ? top_k_out_.value().view({samples, -1}) : torch::empty({samples, top_k}, torch::TensorOptions().dtype(torch::kInt32).device(logits.device()));
+  AT_ASSERTM(top_v_out.dtype() == torch::kFloat32 && top_k_out.dtype() == torch::kInt32, "Output tensor space should be float32 for top_scores and int32 for top_ids.");
+  CHECK_EQ(top_v_out.size(1), top_k);
+  CHECK_EQ(top_k_out.size(1), top_k);
+  CHECK_CONTIGUOUS(top_v_out);
+  CHECK_CONTIGUOUS(top_k_out);
+
+  dispatch_cpu_floating(logits_.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *src = static_cast<const T*>(logits_.data_ptr());
+    const float *bp = bias.has_value() ? bias_.data_ptr<float>() : nullptr;
+    float *vp = top_v_out.data_ptr<float>();
+    int32_t *kp = top_k_out.data_ptr<int32_t>();
+    at::parallel_for(0, samples, std::max<int64_t>(1, 4096 / std::max<int64_t>(n_experts, 1)), [&](int64_t begin, int64_t end) {
+      cpu::scaled_topk(src, bp, n_experts, top_k, n_group, topk_group, int(score_func), normalize, float(routed_scale), vp, kp, begin, end);
+    });
+  });
+  return {top_v_out, top_k_out};
+}
+
+// CPU counterparts of the fused GPU routers, whose k follows the given output space (8 by default).
+static int64_t router_top_k(const torch::Tensor &logits, const ::std::optional<torch::Tensor> &top_v_out) {
+  return top_v_out.has_value() ? top_v_out.value().numel() / std::max<int64_t>(logits.numel() / logits.size(-1), 1) : 8;
+}
+
+std::tuple<torch::Tensor, torch::Tensor> warp_deepseek_sigmoid_top_8_static_v2_cpu(const torch::Tensor &logits_bf16, const torch::Tensor &moe_gate_b_bf16,
+     const ::std::optional<torch::Tensor> &top_v_out_, const ::std::optional<torch::Tensor> &top_k_out_) {
+  return warp_moe_scaled_topk(logits_bf16, moe_gate_b_bf16, router_top_k(logits_bf16, top_v_out_), 8, 4, cpu::ROUTER_SIGMOID, 2.5, true, top_v_out_, top_k_out_);
+}
+
+std::tuple<torch::Tensor, torch::Tensor> warp_kimi_sigmoid_top_8_static_v2_cpu(const torch::Tensor &logits_bf16, const torch::Tensor &moe_gate_b_bf16,
+     const ::std::optional<torch::Tensor> &top_v_out_, const ::std::optional<torch::Tensor> &top_k_out_) {
+  return warp_moe_scaled_topk(logits_bf16, moe_gate_b_bf16, router_top_k(logits_bf16, top_v_out_), 1, 1, cpu::ROUTER_SIGMOID, 2.827, true, top_v_out_, top_k_out_);
+}
+
+// Same as the GPU version, it selects from softmax scores computed by the caller.
+std::tuple<torch::Tensor, torch::Tensor> warp_qwen3_moe_top_8_static_cpu(const torch::Tensor &logits_fp32) {
+  return warp_moe_scaled_topk(logits_fp32, ::std::nullopt, 8, 1, 1, cpu::ROUTER_NONE, 1.0, true, ::std::nullopt, ::std::nullopt);
+}
+
+// Runs fn(partial, begin, end) over fixed blocks of rows, each into its own partial of `width` floats,
+// and sums partials in block order, so that the result doesn't depend on the number of threads.
+template <typename F>
+static torch::Tensor reduce_row_blocks(int64_t samples, int64_t width, const F &fn) {
+  int64_t blocks = (samples + cpu::LOSS_ROW_BLOCK - 1) / cpu::LOSS_ROW_BLOCK;
+  auto parts = torch::zeros({blocks, width}, torch::TensorOptions().dtype(torch::kFloat32));
+  float *pp = parts.data_ptr<float>();
+  at::parallel_for(0, blocks, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t b = begin; b < end; ++b)
+      fn(pp + b * width, b * cpu::LOSS_ROW_BLOCK, std::min(samples, (b + 1) * cpu::LOSS_ROW_BLOCK));
+  });
+  std::vector<double> acc(width, 0.0);
+  for (int64_t b = 0; b < blocks; ++b)
+    for (int64_t i = 0; i < width; ++i)
+      acc[i] += pp[b * width + i];
+  auto out = torch::empty({width}, torch::TensorOptions().dtype(torch::kFloat32));
+  for (int64_t i = 0; i < width; ++i)
+    out.data_ptr<float>()[i] = float(acc[i]);
+  return out;
+}
 
+// Fused LinearTopKGate routing: returns (probs: [S, E], top_v: [S, k], top_id: [S, k], me: [E], counts: [k, E]).
+std::tuple<torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor, torch::Tensor> warp_moe_gate_topk(
+     const torch::Tensor &x,
+     const torch::Tensor &wg,
+     int64_t top_k) {
+  CHECK_CPU(x);
+  CHECK_CPU(wg);
+  CHECK_CONTIGUOUS(wg);
+  CHECK_EQ(x.dtype(), wg.dtype());
+  CHECK_EQ(wg.dim(), 2);
+  auto x_ = x.contiguous();
+  int64_t n_experts = wg.size(0), model_dim = wg.size(1), samples = x_.numel() / std::max<int64_t>(model_dim, 1);
+  CHECK_EQ(x_.size(-1), model_dim);
+  AT_ASSERTM(top_k > 0 && top_k <= n_experts, "Expect top_k within the number of experts, but get top_k = ", top_k);
+
+  auto fp32 = torch::TensorOptions().dtype(torch::kFloat32).device(x.device()), i32 = torch::TensorOptions().dtype(torch::kInt32).device(x.device());
+  auto probs = torch::empty({samples, n_experts}, fp32), top_v = torch::empty({samples, top_k}, fp32), top_id = torch::empty({samples, top_k}, i32);
+  // me is reduced from fixed row blocks in order, while integer counts are summed from per-thread partials.
+  auto counts = torch::zeros({at::get_num_threads(), top_k, n_experts}, i32);
+  torch::Tensor me;
+
+  dispatch_cpu_floating(x_.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *xp = static_cast<const T*>(x_.data_ptr()), *wp = static_cast<const T*>(wg.data_ptr());
+    me = reduce_row_blocks(samples, n_experts, [&](float *part, int64_t begin, int64_t end) {
+      cpu::gate_topk(xp, wp, model_dim, n_experts, top_k, probs.data_ptr<float>(), top_v.data_ptr<float>(), top_id.data_ptr<int32_t>(),
+        part, counts.data_ptr<int32_t>() + at::get_thread_num() * top_k * n_experts, begin, end);
+    });
+  });
+  return {probs, top_v, top_id, me, counts.sum(0, false, torch::kInt32)};
+}
+
+// Gradient of the logits x @ wg^T of warp_moe_gate_topk(), from the gradients of top_v and me.
+torch::Tensor warp_moe_gate_topk_backward(
+     const torch::Tensor &probs,
+     const torch::Tensor &top_id,
+     const torch::Tensor &grad_top_v,
+     const ::std::optional<torch::Tensor> &grad_me) {
+  CHECK_CPU(probs);
+  CHECK_CONTIGUOUS(probs);
+  CHECK_CONTIGUOUS(top_id);
+  CHECK_EQ(probs.dtype(), torch::kFloat32);
+  CHECK_EQ(top_id.dtype(), torch::kInt32);
+  int64_t samples = probs.size(0), n_experts = probs.size(1), top_k = top_id.size(1);
+  CHECK_EQ(top_id.size(0), samples);
+  auto grad_v = grad_top_v.to(torch::kFloat32).contiguous();
+  CHECK_EQ(grad_v.numel(), samples * top_k);
+  torch::Tensor grad_me_;
+  if (grad_me.has_value()) {
+    grad_me_ = grad_me.value().to(torch::kFloat32).contiguous();
+    CHECK_EQ(grad_me_.numel(), n_experts);
+  }
+  auto grad_logits = torch::empty_like(probs);
+  at::parallel_for(0, samples, std::max<int64_t>(1, 4096 / std::max<int64_t>(n_experts, 1)), [&](int64_t begin, int64_t end) {
+    cpu::gate_topk_backward(probs.data_ptr<float>(), top_id.data_ptr<int32_t>(), grad_v.data_ptr<float>(),
+      grad_me.has_value() ? grad_me_.data_ptr<float>() : nullptr, n_experts, top_k, grad_logits.data_ptr<float>(), begin, end);
+  });
+  return grad_logits;
+}
+
+torch::Tensor warp_cosine_logits(const torch::Tensor &x, const torch::Tensor &w, double scale) {
+  CHECK_CPU(x);
+  CHECK_CPU(w);
+  CHECK_CONTIGUOUS(w);
+  CHECK_EQ(x.dtype(), w.dtype());
+  CHECK_EQ(w.dim(), 2);
+  auto x_ = x.contiguous();
+  int64_t n_experts = w.size(0), dim = w.size(1), samples = x_.numel() / std::max<int64_t>(dim, 1);
+  CHECK_EQ(x_.size(-1), dim);
+  auto sizes = x_.sizes().vec();
+  sizes.back() = n_experts;
+  auto logits = torch::empty(sizes, x_.options());
+  dispatch_cpu_floating(x_.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    at::parallel_for(0, samples, cpu::GATE_ROW_BLOCK, [&](int64_t begin, int64_t end) {
+      cpu::cosine_logits(static_cast<const T*>(x_.data_ptr()), static_cast<const T*>(w.data_ptr()), dim, n_experts, float(scale), static_cast<T*>(logits.data_ptr()), begin, end);
+    });
+  });
+  return logits;
+}
+
+// Returns [2, E] of per-expert score sums and top-1 counts for losses.gshard_loss().
+torch::Tensor warp_moe_gshard_loss_stats(const torch::Tensor &scores, const torch::Tensor &top_ids) {
+  CHECK_CPU(scores);
+  CHECK_CONTIGUOUS(scores);
+  CHECK_EQ(scores.dim(), 2);
+  CHECK_EQ(top_ids.dtype(), torch::kInt64);
+  CHECK_EQ(top_ids.stride(-1), 1);
+  int64_t samples = scores.size(0), n_experts = scores.size(1);
+  CHECK_EQ(top_ids.size(0), samples);
+  const int64_t *ids = top_ids.data_ptr<int64_t>();
+  torch::Tensor stats;
+  dispatch_cpu_floating(scores.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *sp = static_cast<const T*>(scores.data_ptr());
+    stats = reduce_row_blocks(samples, 2 * n_experts, [&](float *part, int64_t begin, int64_t end) {
+      cpu::gshard_loss_stats(sp, ids, top_ids.stride(0), n_experts, part, part + n_experts, begin, end);
+    });
+  });
+  return stats.view({2, n_experts});
+}
+
+// Returns [2, E] of per-expert importance and load for losses.load_importance_loss(), with threshold: [S] and noise of std sigma.
+torch::Tensor warp_moe_load_importance_stats(const torch::Tensor &scores, const torch::Tensor &threshold, double sigma) {
+  CHECK_CPU(scores);
+  CHECK_CONTIGUOUS(scores);
+  CHECK_CONTIGUOUS(threshold);
+  CHECK_EQ(scores.dim(), 2);
+  CHECK_EQ(threshold.dtype(), torch::kFloat32);
+  AT_ASSERTM(sigma > 0, "Expect gate noise > 0 for the load loss, but get sigma = ", sigma);
+  int64_t samples = scores.size(0), n_experts = scores.size(1);
+  CHECK_EQ(threshold.numel(), samples);
+  torch::Tensor stats;
+  dispatch_cpu_floating(scores.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *sp = static_cast<const T*>(scores.data_ptr());
+    stats = reduce_row_blocks(samples, 2 * n_experts, [&](float *part, int64_t begin, int64_t end) {
+      cpu::load_importance_stats(sp, threshold.data_ptr<float>(), n_experts, float(sigma), part, part + n_experts, begin, end);
+    });
+  });
+  return stats.view({2, n_experts});
+}
+
+std::tuple<torch::Tensor, torch::Tensor> warp_moe_load_importance_backward(const torch::Tensor &scores, const torch::Tensor &threshold, double sigma, const torch::Tensor &grad_stats) {
+  CHECK_CPU(scores);
+  CHECK_CONTIGUOUS(scores);
+  CHECK_CONTIGUOUS(threshold);
+  CHECK_EQ(threshold.dtype(), torch::kFloat32);
+  int64_t samples = scores.size(0), n_experts = scores.size(1);
+  auto grad_ = grad_stats.to(torch::kFloat32).contiguous();
+  CHECK_EQ(grad_.numel(), 2 * n_experts);
+  auto grad_scores = torch::empty_like(scores), grad_threshold = torch::empty({samples}, threshold.options());
+  dispatch_cpu_floating(scores.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    at::parallel_for(0, samples, std::max<int64_t>(1, 4096 / std::max<int64_t>(n_experts, 1)), [&](int64_t begin, int64_t end) {
+      cpu::load_importance_backward(static_cast<const T*>(scores.data_ptr()), threshold.data_ptr<float>(), n_experts, float(sigma),
+        grad_.data_ptr<float>(), grad_.data_ptr<float>() + n_experts, static_cast<T*>(grad_scores.data_ptr()), grad_threshold.data_ptr<float>(), begin, end);
+    });
+  });
+  return {grad_scores, grad_threshold};
+}
+
+// Returns locations [k, S] of each token among the tokens of the same expert in ascending importance, where ranks
+// are placed one after another, and dispatch counts [E] over all ranks, for batch-prioritized routing.
+std::tuple<torch::Tensor, torch::Tensor> warp_moe_sorted_locations(const torch::Tensor &importance, const torch::Tensor &indices, int64_t num_experts) {
+  CHECK_CPU(importance);
+  CHECK_CONTIGUOUS(importance);
+  CHECK_CONTIGUOUS(indices);
+  CHECK_EQ(importance.dtype(), torch::kFloat32);
+  CHECK_EQ(indices.dtype(), torch::kInt64);
+  CHECK_EQ(indices.dim(), 2);
+  int64_t samples = importance.numel(), top_k = indices.size(0);
+  CHECK_EQ(indices.size(1), samples);
+  AT_ASSERTM(samples < (1LL << 31), "Expect fewer than 2^31 tokens for sorted locations, but get ", samples);
+  const int64_t *ids = indices.data_ptr<int64_t>();
+  for (int64_t i = 0; i < indices.numel(); ++i)
+    AT_ASSERTM(ids[i] >= 0 && ids[i] < num_experts, "Expert index out of range: ", ids[i]);
+
+  // The sort is stable, so ties keep token order and results don't depend on chunking.
+  const int64_t chunk = std::max<int64_t>(4096, (samples + at::get_num_threads() - 1) / at::get_num_threads());
+  const int64_t chunks = std::max<int64_t>(1, (samples + chunk - 1) / chunk);
+  auto range = [&](int64_t c) { return std::make_pair(c * chunk, std::min(samples, (c + 1) * chunk)); };
+
+  std::vector<uint32_t> keys(samples);
+  std::vector<int32_t> order(samples), buffer(samples);
+  const float *imp = importance.data_ptr<float>();
+  at::parallel_for(0, samples, 4096, [&](int64_t begin, int64_t end) {
+    for (int64_t i = begin; i < end; ++i)
+      keys[i] = cpu::radix_key(imp[i]), order[i] = int32_t(i);
+  });
+
+  std::vector<int64_t> hist(chunks * 256);
+  for (int shift = 0; shift < 32; shift += 8) {
+    std::fill(hist.begin(), hist.end(), 0);
+    at::parallel_for(0, chunks, 1, [&](int64_t begin, int64_t end) {
+      for (int64_t c = begin; c < end; ++c)
+        cpu::radix_histogram(keys.data(), order.data(), shift, hist.data() + c * 256, range(c).first, range(c).second);
+    });
+    int64_t offset = 0;
+    bool single_digit = false;
+    for (int64_t d = 0; d < 256; ++d) {
+      int64_t total = 0;
+      for (int64_t c = 0; c < chunks; ++c) {
+        int64_t count = hist[c * 256 + d];
+        hist[c * 256 + d] = offset + total, total += count;
+      }
+      single_digit |= (total == samples);
+      offset += total;
+    }
+    // All keys share this digit, so the pass would leave the order unchanged.
+    if (single_digit)
+      continue;
+    at::parallel_for(0, chunks, 1, [&](int64_t begin, int64_t end) {
+      for (int64_t c = begin; c < end; ++c)
+        cpu::radix_scatter(keys.data(), order.data(), shift, hist.data() + c * 256, buffer.data(), range(c).first, range(c).second);
+    });
+    order.swap(buffer);
+  }
+
+  std::vector<int64_t> counts(chunks * top_k * num_experts, 0);
+  at::parallel_for(0, chunks, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t c = begin; c < end; ++c)
+      cpu::location_counts(order.data(), ids, samples, top_k, num_experts, counts.data() + c * top_k * num_experts, range(c).first, range(c).second);
+  });
+  auto dispatch_count = torch::empty({num_experts}, torch::TensorOptions().dtype(torch::kInt64));
+  for (int64_t e = 0; e < num_experts; ++e) {
+    int64_t offset = 0;
+    for (int64_t r = 0; r < top_k; ++r)
+      for (int64_t c = 0; c < chunks; ++c) {
+        int64_t count = counts[(c * top_k + r) * num_experts + e];
+        counts[(c * top_k + r) * num_experts + e] = offset, offset += count;
+      }
+    dispatch_count.data_ptr<int64_t>()[e] = offset;
+  }
+  auto locations = torch::empty({top_k, samples}, torch::TensorOptions().dtype(torch::kInt32));
+  at::parallel_for(0, chunks, 1, [&](int64_t begin, int64_t end) {
+    for (int64_t c = begin; c < end; ++c)
+      cpu::location_assign(order.data(), ids, samples, top_k, num_experts, counts.data() + c * top_k * num_experts, locations.data_ptr<int32_t>(), range(c).first, range(c).second);
+  });
+  return {locations, dispatch_count};
+}
+
+// Returns expert-choice slots (indices: [K, S], locations: [K, S]) where each expert picks its `capacity` best tokens,
+// K is the most experts picking one token, and slots left unused hold index -1.
+std::tuple<torch::Tensor, torch::Tensor> warp_moe_expert_choice(const torch::Tensor &scores, int64_t capacity) {
+  CHECK_CPU(scores);
+  CHECK_CONTIGUOUS(scores);
+  CHECK_EQ(scores.dim(), 2);
+  int64_t samples = scores.size(0), n_experts = scores.size(1);
+  AT_ASSERTM(capacity > 0 && capacity <= samples, "Expect 0 < capacity <= tokens for expert choice, but get capacity = ", capacity);
+  std::vector<int32_t> sel(n_experts * capacity), fill(samples, 0);
+  dispatch_cpu_floating(scores.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    at::parallel_for(0, n_experts, 1, [&](int64_t begin, int64_t end) {
+      cpu::expert_choice_select(static_cast<const T*>(scores.data_ptr()), samples, n_experts, capacity, sel.data(), begin, end);
+    });
+  });
+  for (auto t : sel)
+    ++fill[t];
+  int64_t slots = std::max<int64_t>(1, *std::max_element(fill.begin(), fill.end()));
+  auto indices = torch::full({slots, samples}, -1, torch::TensorOptions().dtype(torch::kInt32));
+  auto locations = torch::zeros({slots, samples}, torch::TensorOptions().dtype(torch::kInt32));
+  std::fill(fill.begin(), fill.end(), 0);
+  cpu::expert_choice_assign(sel.data(), samples, n_experts, capacity, fill.data(), indices.data_ptr<int32_t>(), locations.data_ptr<int32_t>());
+  return {indices, locations};
+}
+
+// Normalizes columns [id, id + rms_w.size(0)) of each row of x, as the GPU version does.
+torch::Tensor warp_rmsnorm_bf16_cpu(const torch::Tensor &x, const torch::Tensor &rms_w, double eps, int64_t id) {
+  CHECK_CPU(x);
+  CHECK_CONTIGUOUS(x);
+  CHECK_CONTIGUOUS(rms_w);
+  CHECK_EQ(x.dtype(), rms_w.dtype());
+  int64_t n = rms_w.numel(), ldx = x.size(-1), rows = x.numel() / std::max<int64_t>(ldx, 1);
+  CHECK_EQ(id >= 0 && id + n <= ldx, true);
+  auto sizes = x.sizes().vec();
+  sizes.back() = n;
+  auto out = torch::empty(sizes, x.options());
+  dispatch_cpu_floating(x.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    at::parallel_for(0, rows, std::max<int64_t>(1, 16384 / std::max<int64_t>(n, 1)), [&](int64_t begin, int64_t end) {
+      cpu::rmsnorm(static_cast<const T*>(x.data_ptr()) + id, ldx, (const T*)nullptr, static_cast<const T*>(rms_w.data_ptr()), n, float(eps),
+        (T*)nullptr, static_cast<T*>(out.data_ptr()), begin, end);
+    });
+  });
+  return out;
+}
+
+// Returns (h, rmsnorm(h) * rms_w) for the residual h = x + t, in one pass per row.
+std::tuple<torch::Tensor, torch::Tensor> warp_add_rmsnorm(const torch::Tensor &x, const torch::Tensor &t, const torch::Tensor &rms_w, double eps) {
+  CHECK_CPU(x);
+  CHECK_CONTIGUOUS(x);
+  CHECK_CONTIGUOUS(t);
+  CHECK_CONTIGUOUS(rms_w);
+  CHECK_EQ(x.dtype(), t.dtype());
+  CHECK_EQ(x.dtype(), rms_w.dtype());
+  CHECK_EQ(x.numel(), t.numel());
+  int64_t n = rms_w.numel(), rows = x.numel() / std::max<int64_t>(n, 1);
+  CHECK_EQ(x.size(-1), n);
+  auto h = torch::empty_like(x), y = torch::empty_like(x);
+  dispatch_cpu_floating(x.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    at::parallel_for(0, rows, std::max<int64_t>(1, 16384 / std::max<int64_t>(n, 1)), [&](int64_t begin, int64_t end) {
+      cpu::rmsnorm(static_cast<const T*>(x.data_ptr()), n, static_cast<const T*>(t.data_ptr()), static_cast<const T*>(rms_w.data_ptr()), n, float(eps),
+        static_cast<T*>(h.data_ptr()), static_cast<T*>(y.data_ptr()), begin, end);
+    });
+  });
+  return {h, y};
+}
+
+// Returns q [.., n_heads, D] of qkv_out [.., (n_heads + 2 * kv_heads) * D] after q/k norm and rotary embedding,
+// and writes k/v of token i into row slots[i] of the caches [num_slots, kv_heads, D], see cpu::norm_rotary_kvcache().
+torch::Tensor warp_norm_rotary_kvcache(
+     const torch::Tensor &qkv_out,
+     const torch::Tensor &positions,
+     const torch::Tensor &slots,
+     const torch::Tensor &cos_cache,
+     const torch::Tensor &sin_cache,
+     const torch::Tensor &key_cache,
+     const torch::Tensor &val_cache,
+     const ::std::optional<torch::Tensor> &q_norm,
+     const ::std::optional<torch::Tensor> &k_norm,
+     int64_t n_heads,
+     double eps) {
+  CHECK_CPU(qkv_out);
+  CHECK_CONTIGUOUS(qkv_out);
+  CHECK_CONTIGUOUS(key_cache);
+  CHECK_CONTIGUOUS(val_cache);
+  CHECK_CONTIGUOUS(cos_cache);
+  CHECK_CONTIGUOUS(sin_cache);
+  CHECK_EQ(key_cache.dtype(), qkv_out.dtype());
+  CHECK_EQ(val_cache.dtype(), qkv_out.dtype());
+  CHECK_EQ(key_cache.sizes(), val_cache.sizes());
+  CHECK_EQ(cos_cache.dtype(), torch::kFloat32);
+  CHECK_EQ(cos_cache.sizes(), sin_cache.sizes());
+  CHECK_EQ(positions.dtype(), torch::kInt64);
+  CHECK_EQ(slots.dtype(), torch::kInt64);
+
+  int64_t kv_heads = key_cache.size(-2), d = key_cache.size(-1), num_slots = key_cache.numel() / (kv_heads * d);
+  int64_t heads = n_heads + 2 * kv_heads, tokens = qkv_out.numel() / (heads * d);
+  CHECK_EQ(qkv_out.size(-1), heads * d);
+  CHECK_EQ(d % 2, 0);
+  CHECK_EQ(cos_cache.size(-1) * 2 >= d, true);
+  for (auto &norm : {q_norm, k_norm})
+    if (norm.has_value()) {
+      CHECK_CONTIGUOUS(norm.value());
+      CHECK_EQ(norm.value().dtype(), qkv_out.dtype());
+      CHECK_EQ(norm.value().numel(), d);
+    }
+  auto positions_ = positions.contiguous(), slots_ = slots.contiguous();
+  CHECK_EQ(positions_.numel(), tokens);
+  CHECK_EQ(slots_.numel(), tokens);
+  const int64_t *pos = positions_.data_ptr<int64_t>(), *slot = slots_.data_ptr<int64_t>();
+  for (int64_t i = 0; i < tokens; ++i) {
+    AT_ASSERTM(pos[i] >= 0 && pos[i] < cos_cache.size(0), "Position is out of the range of the rotary cache.");
+    AT_ASSERTM(slot[i] < num_slots, "Slot is out of the range of the kv cache.");
+  }
+
+  auto sizes = qkv_out.sizes().vec();
+  sizes.back() = n_heads;
+  sizes.push_back(d);
+  auto q_out = torch::empty(sizes, qkv_out.options());
+  dispatch_cpu_floating(qkv_out.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    auto norm_ptr = [](const ::std::optional<torch::Tensor> &norm) { return norm.has_value() ? static_cast<const T*>(norm.value().data_ptr()) : (const T*)nullptr; };
+    at::parallel_for(0, tokens * heads, std::max<int64_t>(1, 4096 / d), [&](int64_t begin, int64_t end) {
+      cpu::norm_rotary_kvcache(static_cast<const T*>(qkv_out.data_ptr()), pos, slot, cos_cache.data_ptr<float>(), sin_cache.data_ptr<float>(), cos_cache.size(-1),
+        norm_ptr(q_norm), norm_ptr(k_norm), n_heads, kv_heads, d, float(eps),
+        static_cast<T*>(q_out.data_ptr()), static_cast<T*>(key_cache.data_ptr()), static_cast<T*>(val_cache.data_ptr()), begin, end);
+    });
+  });
+  return q_out;
+}
+
+// Caches are [batch, max_seq, kv_heads, D] written at the token positions, and qk_norm holds the q and k norm weights.
+torch::Tensor warp_qwen3_norm_rotary_kvcache2_bf16_cpu(
+     const torch::Tensor &cos_cache,
+     const torch::Tensor &sin_cache,
+     const torch::Tensor &positions,
+     const torch::Tensor &qkv_out,
+     const torch::Tensor &key_cache,
+     const torch::Tensor &val_cache,
+     const torch::Tensor &qk_norm,
+     int64_t n_heads) {
+  CHECK_EQ(key_cache.dim(), 4);
+  CHECK_EQ(qk_norm.numel(), 2 * key_cache.size(-1));
+  CHECK_EQ(positions.dtype(), torch::kInt64);
+  int64_t batch = key_cache.size(0), max_seq = key_cache.size(1);
+  CHECK_EQ(positions.numel() % batch, 0);
+  // Slots of a sequence must stay in its own rows of the cache, whose length may be shorter than the rotary cache
+  auto positions_ = positions.contiguous();
+  const int64_t *pos = positions_.data_ptr<int64_t>();
+  for (int64_t i = 0; i < positions_.numel(); ++i)
+    AT_ASSERTM(pos[i] >= 0 && pos[i] < max_seq, "Position is out of the range of the kv cache sequence.");
+  auto slots = positions.reshape({batch, -1}) + torch::arange(batch, positions.options()).mul_(max_seq).view({batch, 1});
+  auto norms = qk_norm.contiguous().view({2, -1});
+  return warp_norm_rotary_kvcache(qkv_out, positions, slots, cos_cache, sin_cache, key_cache, val_cache, norms[0], norms[1], n_heads, 1e-6);
+}
+
+static void check_fp8_block_scales(const torch::Tensor &w, const torch::Tensor &scal) {
+  CHECK_CPU(w);
+  CHECK_CPU(scal);
+  CHECK_CONTIGUOUS(w);
+  CHECK_CONTIGUOUS(scal);
+  CHECK_EQ(w.element_size(), 1);
+  CHECK_EQ(scal.dtype(), torch::kFloat32);
+  CHECK_EQ(scal.dim(), w.dim());
+  CHECK_EQ(scal.size(-2), (w.size(-2) + cpu::FP8_BLOCK - 1) / cpu::FP8_BLOCK);
+  CHECK_EQ(scal.size(-1), (w.size(-1) + cpu::FP8_BLOCK - 1) / cpu::FP8_BLOCK);
+}
+
+torch::Tensor warp_gemm_nt_bf16xfp8_block_scal_out_cpu(const torch::Tensor &x, torch::Tensor w, const torch::Tensor &scal, const ::std::optional<torch::Tensor> &w_alt, const ::std::optional<torch::Tensor> &p_out) {
+  CHECK_CPU(x);
+  CHECK_EQ(x.dim(), 3);
+  CHECK_EQ(w.dim(), 2);
+
+  int64_t samples = x.size(0) * x.size(1), k = x.size(2);
+  if (samples > 1 && w_alt.has_value())
+    w = w_alt.value();
+  CHECK_EQ(w.size(1), k);
+  int64_t n = w.size(0);
+
+  auto out = p_out.has_value() ? p_out.value().view({samples, n}) : torch::empty({samples, n}, x.options());
+  CHECK_EQ(out.dtype(), x.dtype());
+  if (w.element_size() != 1) {
+    torch::matmul_out(out, x.view({samples, k}), w.t());
+    return out.view({x.size(0), x.size(1), n});
+  }
+
+  auto x_ = x.contiguous();
+  auto scal_ = scal.to(torch::kFloat32).contiguous();
+  check_fp8_block_scales(w, scal_);
+  CHECK_CONTIGUOUS(out);
+  int64_t row_blocks = (samples + cpu::EPILOGUE_ROW_BLOCK - 1) / cpu::EPILOGUE_ROW_BLOCK;
+  int64_t col_blocks = (n + cpu::EPILOGUE_COL_BLOCK - 1) / cpu::EPILOGUE_COL_BLOCK;
+  dispatch_cpu_floating(x_.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *xp = static_cast<const T*>(x_.data_ptr());
+    const uint8_t *wp = static_cast<const uint8_t*>(w.data_ptr());
+    T *yp = static_cast<T*>(out.data_ptr());
+    at::parallel_for(0, row_blocks * col_blocks, 1, [&](int64_t begin, int64_t end) {
+      for (int64_t i = begin; i < end; ++i) {
+        int64_t r = i / col_blocks * cpu::EPILOGUE_ROW_BLOCK, c = i % col_blocks * cpu::EPILOGUE_COL_BLOCK;
+        cpu::fp8_gather_gemm_nt(xp + r * k, k, (const int64_t*)nullptr, (const int64_t*)nullptr, std::min(samples - r, cpu::EPILOGUE_ROW_BLOCK),
+          wp, scal_.data_ptr<float>(), k, c, std::min(n, c + cpu::EPILOGUE_COL_BLOCK), yp + r * n, n);
+      }
+    });
+  });
+  return out.view({x.size(0), x.size(1), n});
+}
+
+torch::Tensor warp_gemm_nt_bf16xfp8_block_scal_cpu(const torch::Tensor &x, const torch::Tensor &w, const torch::Tensor &scal, int64_t policy = 0) {
+  return warp_gemm_nt_bf16xfp8_block_scal_out_cpu(x, w, scal, ::std::nullopt, ::std::nullopt);
+}
+
+// out = sum_k expert_weight[:, k] * down(silu(gate(x)) * up(x)) using experts of expert_ids[:, k],
+// where gate/up are the two halves of moe_gate_up_w: [E, 2 * I, M] and moe_down_w: [E, N, I] are 128x128 block-scaled fp8.
+torch::Tensor warp_glu_expert_bf16xf8_block_scal_cpu(
+  const torch::Tensor &x,
+  const torch::Tensor &expert_ids,
+  const torch::Tensor &expert_weight,
+  const torch::Tensor &moe_gate_up_w,
+  const torch::Tensor &moe_gate_up_s,
+  const torch::Tensor &moe_down_w,
+  const torch::Tensor &moe_down_s,
+  const torch::Tensor &out) {
+
+  CHECK_CPU(x);
+  CHECK_EQ(x.dim(), 3);
+  CHECK_EQ(expert_ids.dim(), 2);
+  CHECK_EQ(expert_weight.sizes(), expert_ids.sizes());
+  AT_ASSERTM(moe_down_s.dim() == 3, "CPU kernel only supports 128x128 block-scaled fp8 experts.");
+  check_fp8_block_scales(moe_gate_up_w, moe_gate_up_s);
+  check_fp8_block_scales(moe_down_w, moe_down_s);
+
+  int64_t model_dim = x.size(-1), samples = x.numel() / model_dim, top_k = expert_ids.size(1);
+  int64_t experts = moe_gate_up_w.size(0), inter2 = moe_gate_up_w.size(1), inter = inter2 / 2, out_dim = moe_down_w.size(1);
+  CHECK_EQ(expert_ids.size(0), samples);
+  CHECK_EQ(moe_gate_up_w.size(2), model_dim);
+  CHECK_EQ(moe_down_w.size(0), experts);
+  CHECK_EQ(moe_down_w.size(2), inter);
+  CHECK_CPU(out);
+  CHECK_CONTIGUOUS(out);
+  CHECK_EQ(out.dtype(), x.dtype());
+  CHECK_EQ(out.numel(), samples * out_dim);
+
+  // Group (sample, slot) entries by expert, so that each expert weight is streamed once per block of rows.
+  auto ids = expert_ids.to(torch::kInt64).contiguous();
+  auto weights = expert_weight.to(torch::kFloat32).contiguous();
+  const int64_t *idp = ids.data_ptr<int64_t>();
+  std::vector<int64_t> offsets(experts + 1, 0);
+  for (int64_t i = 0; i < samples * top_k; ++i)
+    if (idp[i] >= 0 && idp[i] < experts)
+      offsets[idp[i] + 1]++;
+  for (int64_t e = 0; e < experts; ++e)
+    offsets[e + 1] += offsets[e];
+  std::vector<int64_t> entries(offsets[experts]), tokens(offsets[experts]), fill(offsets.begin(), offsets.end() - 1);
+  for (int64_t i = 0; i < samples * top_k; ++i)
+    if (idp[i] >= 0 && idp[i] < experts)
+      entries[fill[idp[i]]++] = i;
+  for (size_t i = 0; i < entries.size(); ++i)
+    tokens[i] = entries[i] / top_k;
+  std::vector<std::array<int64_t, 3>> blocks;
+  for (int64_t e = 0; e < experts; ++e)
+    for (int64_t b = offsets[e]; b < offsets[e + 1]; b += cpu::EPILOGUE_ROW_BLOCK)
+      blocks.push_back({e, b, std::min(offsets[e + 1], b + cpu::EPILOGUE_ROW_BLOCK)});
+
+  auto x_ = x.contiguous();
+  auto hidden = torch::empty({samples * top_k, inter2}, x.options().dtype(torch::kFloat32));
+  auto partial = torch::zeros({samples * top_k, out_dim}, x.options().dtype(torch::kFloat32));
+  float *hp = hidden.data_ptr<float>(), *pp = partial.data_ptr<float>();
+  const uint8_t *up_w = static_cast<const uint8_t*>(moe_gate_up_w.data_ptr()), *down_w = static_cast<const uint8_t*>(moe_down_w.data_ptr());
+  const float *up_s = moe_gate_up_s.data_ptr<float>(), *down_s = moe_down_s.data_ptr<float>();
+  int64_t up_col_blocks = (inter2 + cpu::EPILOGUE_COL_BLOCK - 1) / cpu::EPILOGUE_COL_BLOCK;
+  int64_t down_col_blocks = (out_dim + cpu::EPILOGUE_COL_BLOCK - 1) / cpu::EPILOGUE_COL_BLOCK;
+
+  dispatch_cpu_floating(x_.scalar_type(), [&](auto tag) {
+    using T = decltype(tag);
+    const T *xp = static_cast<const T*>(x_.data_ptr());
+    T *yp = static_cast<T*>(out.data_ptr());
+    at::parallel_for(0, blocks.size() * up_col_blocks, 1, [&](int64_t begin, int64_t end) {
+      for (int64_t i = begin; i < end; ++i) {
+        const auto &b = blocks[i / up_col_blocks];
+        int64_t c = i % up_col_blocks * cpu::EPILOGUE_COL_BLOCK;
+        cpu::fp8_gather_gemm_nt(xp, model_dim, tokens.data() + b[1], entries.data() + b[1], b[2] - b[1],
+          up_w + b[0] * moe_gate_up_w.stride(0), up_s + b[0] * moe_gate_up_s.stride(0), model_dim, c, std::min(inter2, c + cpu::EPILOGUE_COL_BLOCK), hp, inter2);
+      }
+    });
+    at::parallel_for(0, entries.size(), 16, [&](int64_t begin, int64_t end) {
+      for (int64_t i = begin; i < end; ++i) {
+        float *h = hp + entries[i] * inter2;
+        for (int64_t j = 0; j < inter; ++j)
+          h[j] = cpu::apply_activation(h[j], cpu::ACT_SILU) * h[inter + j];
+      }
+    });
+    at::parallel_for(0, blocks.size() * down_col_blocks, 1, [&](int64_t begin, int64_t end) {
+      for (int64_t i = begin; i < end; ++i) {
+        const auto &b = blocks[i / down_col_blocks];
+        int64_t c = i % down_col_blocks * cpu::EPILOGUE_COL_BLOCK;
+        cpu::fp8_gather_gemm_nt(hp, inter2, entries.data() + b[1], entries.data() + b[1], b[2] - b[1],
+          down_w + b[0] * moe_down_w.stride(0), down_s + b[0] * moe_down_s.stride(0), inter, c, std::min(out_dim, c + cpu::EPILOGUE_COL_BLOCK), pp, out_dim);
+      }
+    });
+    const float *wp = weights.data_ptr<float>();
+    at::parallel_for(0, samples, 1, [&](int64_t begin, int64_t end) {
+      std::vector<float> acc(out_dim);
+      for (int64_t s = begin; s < end; ++s) {
+        std::fill(acc.begin(), acc.end(), 0.0f);
+        for (int64_t k = 0; k < top_k; ++k)
+          for (int64_t j = 0; j < out_dim; ++j)
+            acc[j] += wp[s * top_k + k] * pp[(s * top_k + k) * out_dim + j];
+        cpu::store_rows_from_float(acc.data(), out_dim, 1, yp + s * out_dim);
+      }
+    });
+  });
+  return out.view({x.size(0), x.size(1), out_dim});
+}
+
+torch::Tensor warp_shared_expert_bf16xf8_cpu(const torch::Tensor &x, const torch::Tensor &moe_gate_up_w, const torch::Tensor &moe_gate_up_s, const torch::Tensor &moe_down_w, const torch::Tensor &moe_down_s) {
+  int64_t samples = x.numel() / x.size(-1);
+  auto ids = torch::zeros({samples, 1}, torch::TensorOptions().dtype(torch::kInt64));
+  auto weights = torch::ones({samples, 1}, torch::TensorOptions().dtype(torch::kFloat32));
+  auto out = torch::empty({x.size(0), x.size(1), moe_down_w.size(1)}, x.options());
+  return warp_glu_expert_bf16xf8_block_scal_cpu(x, ids, weights, moe_gate_up_w, moe_gate_up_s, moe_down_w, moe_down_s, out);
+}
+
+#if !defined(_WIN32)
+static std::vector<std::unique_ptr<shm::Transport>> shm_transports;
+
+static shm::Transport *get_shm_transport(int64_t handle) {
+  AT_ASSERTM(handle >= 0 && handle < (int64_t)shm_transports.size(), "Invalid shared-memory transport handle: ", handle);
+  return shm_transports[handle].get();
+}
+
+int64_t warp_shm_a2a_create(const std::string &prefix, int64_t local_rank, int64_t local_size, int64_t capacity) {
+  shm_transports.emplace_back(new shm::Transport(prefix, local_rank, local_size, capacity));
+  return shm_transports.size() - 1;
+}
+
+void warp_shm_a2a_connect(int64_t handle) {
+  get_shm_transport(handle)->connect();
+}
+
+void warp_shm_a2a_unlink(int64_t handle) {
+  get_shm_transport(handle)->unlink();
+}
+
+void warp_shm_a2a_exchange(int64_t handle, const torch::Tensor &input, const torch::Tensor &in_offsets, const torch::Tensor &in_sizes,
+                           const torch::Tensor &output, const torch::Tensor &out_offsets, const torch::Tensor &out_sizes, double timeout_sec) {
+  auto *transport = get_shm_transport(handle);
+  for (auto &t : {input, in_offsets, in_sizes, output, out_offsets, out_sizes}) {
+    CHECK_CPU(t);
+    CHECK_CONTIGUOUS(t);
+  }
+  for (auto &t : {in_offsets, in_sizes, out_offsets, out_sizes}) {
+    CHECK_EQ(t.dtype(), torch::kInt64);
+    CHECK_EQ(t.numel(), transport->size());
+  }
+  // Offsets and sizes are in bytes, and are validated against buffer lengths before any byte is moved.
+  int64_t in_bytes = input.numel() * input.element_size(), out_bytes = output.numel() * output.element_size();
+  for (int i = 0; i < in_sizes.numel(); ++i) {
+    CHECK_EQ(in_offsets.data_ptr<int64_t>()[i] + in_sizes.data_ptr<int64_t>()[i] <= in_bytes, true);
+    CHECK_EQ(out_offsets.data_ptr<int64_t>()[i] + out_sizes.data_ptr<int64_t>()[i] <= out_bytes, true);
+  }
+  transport->exchange((const uint8_t*)input.data_ptr(), in_offsets.data_ptr<int64_t>(), in_sizes.data_ptr<int64_t>(),
+    (uint8_t*)output.data_ptr(), out_offsets.data_ptr<int64_t>(), out_sizes.data_ptr<int64_t>(), timeout_sec);
+}
+#endif
 
 TORCH_LIBRARY(tutel_ops, m) {
+  m.def("rowwise_compress", warp_rowwise_compress);
+  m.def("rowwise_decompress", warp_rowwise_decompress);
+  m.def("swiglu_expert", warp_swiglu_expert);
+  m.def("bmm_bias_act", warp_bmm_bias_act);
+  m.def("qbmm_bias_act", warp_qbmm_bias_act);
+  m.def("to_float8_rowwise", warp_to_float8_rowwise);
+  m.def("to_float8_blockwise", warp_to_float8_blockwise);
+  m.def("to_float4_groupwise", warp_to_float4_groupwise);
+  m.def("from_float4_groupwise", warp_from_float4_groupwise);
+  m.def("marlin_pack_fp4", warp_marlin_pack_fp4);
+  m.def("marlin_unpack_fp4", warp_marlin_unpack_fp4);
+  m.def("moe_scaled_topk", warp_moe_scaled_topk);
+  m.def("moe_gate_topk", warp_moe_gate_topk);
+  m.def("moe_gate_topk_backward", warp_moe_gate_topk_backward);
+  m.def("cosine_logits", warp_cosine_logits);
+  m.def("moe_gshard_loss_stats", warp_moe_gshard_loss_stats);
+  m.def("moe_load_importance_stats", warp_moe_load_importance_stats);
+  m.def("moe_load_importance_backward", warp_moe_load_importance_backward);
+  m.def("moe_sorted_locations", warp_moe_sorted_locations);
+  m.def("moe_expert_choice", warp_moe_expert_choice);
+  m.def("add_rmsnorm", warp_add_rmsnorm);
+  m.def("norm_rotary_kvcache", warp_norm_rotary_kvcache);
+#if !defined(USE_NCCL)
+  m.def("gemm_nt_bf16xfp8_block_scal_out", warp_gemm_nt_bf16xfp8_block_scal_out_cpu);
+  m.def("gemm_nt_bf16xfp8_block_scal", warp_gemm_nt_bf16xfp8_block_scal_cpu);
+  m.def("glu_expert_bf16xf8_block_scal", warp_glu_expert_bf16xf8_block_scal_cpu);
+  m.def("qwen3_moe_scaled_topk", warp_qwen3_moe_top_8_static_cpu);
+  m.def("kimi_moe_sigmoid_scaled_topk", warp_kimi_sigmoid_top_8_static_v2_cpu);
+  m.def("deepseek_moe_sigmoid_scaled_topk", warp_deepseek_sigmoid_top_8_static_v2_cpu);
+  m.def("rmsnorm_bf16", warp_rmsnorm_bf16_cpu);
+  m.def("qwen3_norm_rotary_kvcache2_bf16", warp_qwen3_norm_rotary_kvcache2_bf16_cpu);
+#endif
+#if !defined(_WIN32)
+  m.def("shm_a2a_create", warp_shm_a2a_create);
+  m.def("shm_a2a_connect", warp_shm_a2a_connect);
+  m.def("shm_a2a_unlink", warp_shm_a2a_unlink);
+  m.def("shm_a2a_exchange", warp_shm_a2a_exchange);
+#endif
+
+#if defined(USE_GPU)
   m.def("cumsum", warp_cumsum);
   m.def("sparse_bmm_infer", warp_sparse_bmm_infer);
 
@@ -1721,5 +2814,5 @@ TORCH_LIBRARY(tutel_ops, m) {
   m.def("glu_expert_bf16xf8_block_scal_16x16_fnuz", specialized::warp_glu_expert_bf16xf8_block_scal_16x16_fnuz);
   m.def("gemm_nt_bf16xfp8_block_scal", specialized::warp_gemm_nt_bf16xfp8_block_scal);
 #endif
-}
 #endif
+}
@@ -0,0 +1,190 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT license.
+
+// Intra-node all-to-all over POSIX shared memory, independent of torch.
+//
+// Each local rank owns one segment holding an inbound ring per local peer: ring (owner, src)
+// is written by `src` and read by `owner` only, so every ring is single-producer/single-consumer.
+// `head` and `tail` are monotonic byte counters acting as sequence numbers: the producer
+// publishes data with a release store of `head`, the consumer frees space with a release store of `tail`.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace shm {
+
+struct RingHeader {
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared-memory rings require lock-free 64-bit atomics.");
+
+class Transport {
+ public:
+  Transport(const std::string &prefix, int local_rank, int local_size, int64_t capacity)
+      : prefix(prefix), local_rank(local_rank), local_size(local_size),
+        capacity((capacity + 63) / 64 * 64), segments(local_size, nullptr) {
+    if (local_rank < 0 || local_rank >= local_size || capacity <= 0)
+      throw std::runtime_error("Invalid shared-memory transport configuration.");
+    int fd = shm_open(name(local_rank).c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+      throw std::runtime_error("Failed to create shared memory `" + name(local_rank) + "`: " + strerror(errno));
+    if (ftruncate(fd, segment_bytes()) != 0) {
+      close(fd);
+      throw std::runtime_error("Failed to resize shared memory `" + name(local_rank) + "`: " + strerror(errno));
+    }
+    segments[local_rank] = map(fd);
+    linked = true;
+  }
+
+  ~Transport() {
+    for (auto *seg : segments)
+      if (seg != nullptr)
+        munmap(seg, segment_bytes());
+    unlink();
+  }
+
+  int size() const {
+    return local_size;
+  }
+
+  // Requires all local ranks to have finished construction.
+  void connect() {
+    for (int peer = 0; peer < local_size; ++peer) {
+      if (segments[peer] != nullptr)
+        continue;
+      int fd = shm_open(name(peer).c_str(), O_RDWR, 0600);
+      if (fd < 0)
+        throw std::runtime_error("Failed to open shared memory `" + name(peer) + "`: " + strerror(errno));
+      segments[peer] = map(fd);
+    }
+  }
+
+  // Requires all local ranks to have finished connect(), after which names are no longer needed.
+  void unlink() {
+    if (linked)
+      shm_unlink(name(local_rank).c_str());
+    linked = false;
+  }
+
+  // Send in_sizes[p] bytes at input + in_offsets[p] to each local peer p, and receive out_sizes[p] bytes
+  // from each local peer p into output + out_offsets[p]. Peers progress round-robin so that bounded rings never deadlock.
+  void exchange(const uint8_t *input, const int64_t *in_offsets, const int64_t *in_sizes,
+                uint8_t *output, const int64_t *out_offsets, const int64_t *out_sizes, double timeout_sec) {
+    constexpr int64_t max_chunk = 1 << 20;
+    if (in_sizes[local_rank] != out_sizes[local_rank])
+      throw std::runtime_error("Mismatched self-exchange sizes in shared-memory all_to_all.");
+    memcpy(output + out_offsets[local_rank], input + in_offsets[local_rank], in_sizes[local_rank]);
+
+    std::vector<int64_t> sent(local_size, 0), recvd(local_size, 0);
+    int64_t remaining = 0;
+    for (int peer = 0; peer < local_size; ++peer)
+      if (peer != local_rank)
+        remaining += in_sizes[peer] + out_sizes[peer];
+
+    auto last_progress = std::chrono::steady_clock::now();
+    for (int64_t spins = 0; remaining > 0; ) {
+      bool progressed = false;
+      for (int k = 1; k < local_size; ++k) {
+        int peer = (local_rank + k) % local_size;
+        if (sent[peer] < in_sizes[peer]) {
+          RingHeader *r = ring(peer, local_rank);
+          uint64_t head = r->head.load(std::memory_order_relaxed), tail = r->tail.load(std::memory_order_acquire);
+          int64_t len = std::min<int64_t>({capacity - int64_t(head - tail), in_sizes[peer] - sent[peer], max_chunk});
+          if (len > 0) {
+            copy_in(ring_data(r), head, input + in_offsets[peer] + sent[peer], len);
+            r->head.store(head + len, std::memory_order_release);
+            sent[peer] += len, remaining -= len, progressed = true;
+          }
+        }
+        if (recvd[peer] < out_sizes[peer]) {
+          RingHeader *r = ring(local_rank, peer);
+          uint64_t head = r->head.load(std::memory_order_acquire), tail = r->tail.load(std::memory_order_relaxed);
+          int64_t len = std::min<int64_t>({int64_t(head - tail), out_sizes[peer] - recvd[peer], max_chunk});
+          if (len > 0) {
+            copy_out(ring_data(r), tail, output + out_offsets[peer] + recvd[peer], len);
+            r->tail.store(tail + len, std::memory_order_release);
+            recvd[peer] += len, remaining -= len, progressed = true;
+          }
+        }
+      }
+      if (progressed) {
+        spins = 0;
+        continue;
+      }
+      if (++spins % 1024 == 0) {
+        std::this_thread::yield();
+        auto now = std::chrono::steady_clock::now();
+        if (spins == 1024)
+          last_progress = now;
+        else if (std::chrono::duration<double>(now - last_progress).count() > timeout_sec)
+          throw std::runtime_error("Shared-memory all_to_all timed out, peers may have issued mismatched exchanges.");
+      }
+    }
+  }
+
+ private:
+  std::string name(int rank) const {
+    return prefix + "_" + std::to_string(rank);
+  }
+
+  size_t ring_bytes() const {
+    return sizeof(RingHeader) + capacity;
+  }
+
+  size_t segment_bytes() const {
+    return ring_bytes() * local_size;
+  }
+
+  uint8_t *map(int fd) {
+    void *ptr = mmap(nullptr, segment_bytes(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+      throw std::runtime_error(std::string("Failed to map shared memory: ") + strerror(errno));
+    return static_cast<uint8_t*>(ptr);
+  }
+
+  RingHeader *ring(int owner, int src) const {
+    return reinterpret_cast<RingHeader*>(segments[owner] + ring_bytes() * src);
+  }
+
+  static uint8_t *ring_data(RingHeader *r) {
+    return reinterpret_cast<uint8_t*>(r + 1);
+  }
+
+  void copy_in(uint8_t *data, uint64_t pos, const uint8_t *src, int64_t len) const {
+    int64_t offset = pos % capacity, first = std::min(len, capacity - offset);
+    memcpy(data + offset, src, first);
+    memcpy(data, src + first, len - first);
+  }
+
+  void copy_out(const uint8_t *data, uint64_t pos, uint8_t *dst, int64_t len) const {
+    int64_t offset = pos % capacity, first = std::min(len, capacity - offset);
+    memcpy(dst, data + offset, first);
+    memcpy(dst + first, data, len - first);
+  }
+
+  std::string prefix;
+  int local_rank, local_size;
+  int64_t capacity;
+  std::vector<uint8_t*> segments;
+  bool linked = false;
+};
+
+} // namespace shm
@@ -25,19 +25,29 @@ parser.add_argument('--num_local_experts', type=int, default=2)
 parser.add_argument('--dtype', type=str, default='float32')
 parser.add_argument('--fp32_gate', default=True, action='store_true')
 parser.add_argument('--top', type=int, default=2)
+parser.add_argument('--gate_type', type=str, default='top')  # 'top', 'cosine_top' or 'expert_choice'
 parser.add_argument('--l_aux_wt', type=float, default=0.0)
 parser.add_argument('--a2a_ffn_overlap_degree', type=int, default=1)
 parser.add_argument('--allreduce_degree', type=int, default=1)
+parser.add_argument('--grad_bucket_mb', type=float, default=0)  # > 0 to all-reduce shared grads in async buckets
 parser.add_argument('--num_steps', type=int, default=100)
 parser.add_argument('--parallel_type', type=str, default='adaptive:1')
 parser.add_argument('--checkpoint_path', type=str, default='')
 parser.add_argument('--device', type=str, default='cuda' if torch.cuda.is_available() else 'cpu')
 parser.add_argument('--use_2dh', default=False, action='store_true')
+parser.add_argument('--a2a_compression', type=str, default='')  # '', 'fp8' or 'int8'
+parser.add_argument('--recompute', type=str, default='')  # '', 'expert_hidden' or 'full'
 parser.add_argument('--eval', default=False, action='store_true')
 parser.add_argument('--capacity_factor', type=float, default=1.0)  # 0.0 for dMoE (dropless-MoE), negative for no-padded capacity.
 parser.add_argument('--megablocks_size', type=int, default=0)
 parser.add_argument('--use_tensorcore', default=False, action='store_true')
 parser.add_argument('--expert_type', type=str, default='ffn')
+parser.add_argument('--activation_fn', type=str, default='relu')
+parser.add_argument('--quant_bits', type=int, default=8)  # for --expert_type ffn_q
+parser.add_argument('--quant_group_size', type=int, default=128)  # for --expert_type ffn_q
+parser.add_argument('--replicate_hot_experts', type=int, default=0)  # > 0 to replicate this many hot experts on under-loaded devices
+parser.add_argument('--shared_expert_hidden', type=int, default=0)  # > 0 to add an always-on shared ffn expert of this hidden size
+parser.add_argument('--expert_path', type=str, default='')  # for --expert_type ffn_mmap, a fresh temporary file by default
 
 args = parser.parse_args()
 
@@ -69,19 +79,36 @@ else:
     raise Exception('Unrecognized data type specified: %s' % args.dtype)
 
 
+activation_fn = {'relu': F.relu, 'gelu': F.gelu, 'silu': F.silu}[args.activation_fn]
+experts = {'type': args.expert_type, 'num_experts_per_device': num_local_experts, 'hidden_size_per_expert': hidden_size, 'activation_fn': activation_fn}
+if args.expert_type == 'ffn_q':
+    experts.update({'bits': args.quant_bits, 'group_size': args.quant_group_size})
+if args.expert_type == 'ffn_mmap':
+    if not args.expert_path:
+        import atexit, shutil, tempfile
+        expert_dir = tempfile.mkdtemp()
+        atexit.register(shutil.rmtree, expert_dir, ignore_errors=True)
+        args.expert_path = os.path.join(expert_dir, 'experts_{rank}')
+    experts.update({'path': args.expert_path, 'initialize': True})
+
+
 class ExampleModel(torch.nn.Module):
     def __init__(self):
         super().__init__()
 
         self._moe_layer = tutel_moe.moe_layer(
-            gate_type = {'type': 'top', 'k': top_value, 'fp32_gate': args.fp32_gate, 'capacity_factor': args.capacity_factor},
-            experts = {'type': args.expert_type, 'num_experts_per_device': num_local_experts, 'hidden_size_per_expert': hidden_size, 'activation_fn': lambda x: F.relu(x)},
+            gate_type = {'type': args.gate_type, 'k': top_value, 'fp32_gate': args.fp32_gate, 'capacity_factor': args.capacity_factor},
+            experts = experts,
             model_dim = model_dim,
             scan_expert_func = lambda name, param: setattr(param, 'skip_allreduce', True),
             seeds = (1, dist_rank + 1, 1),
             a2a_ffn_overlap_degree = a2a_ffn_overlap_degree,
             parallel_type = args.parallel_type,
             use_2dh=args.use_2dh,
+            a2a_compression=args.a2a_compression,
+            recompute=args.recompute,
+            replicate_hot_experts=args.replicate_hot_experts,
+            shared_experts={'type': 'ffn', 'hidden_size_per_expert': args.shared_expert_hidden, 'activation_fn': activation_fn} if args.shared_expert_hidden > 0 else None,
         )
 
         # Summary of different parameter types: gate, local_experts
@@ -123,6 +150,11 @@ if args.allreduce_degree == -1:
 else:
     params_for_all_reduce = [p for p in model.parameters() if not hasattr(p, 'skip_allreduce') and getattr(p, 'requires_grad', False)]
 
+grad_synchronizer = None
+if args.grad_bucket_mb > 0 and params_for_all_reduce:
+    grad_synchronizer = net.GradientSynchronizer(model.parameters(), bucket_size_mb=args.grad_bucket_mb)
+    params_for_all_reduce = []
+
 for i in range(num_steps):
     t_start = system.record_time()
 
@@ -133,6 +165,8 @@ for i in range(num_steps):
         if args.l_aux_wt:
             loss += args.l_aux_wt * model._moe_layer.l_aux
         loss.backward()
+        if grad_synchronizer is not None:
+            grad_synchronizer.synchronize()
         if dist_world_size > 1:
             for p in params_for_all_reduce:
                 p.grad /= dist_world_size
@@ -3,8 +3,11 @@
 
 import torch
 from .. import net
+from ..impls import expert_ops
 
 class FusedExpertsNetwork(torch.nn.Module):
+    handles_recompute = True
+
     def __init__(self, model_dim, hidden_size_per_expert, num_experts_per_device, sharded_count, activation_fn=None, activation_fn_with_self=None, output_dim=None, has_fc1_bias=True, has_fc2_bias=True):
         super().__init__()
         self.skip_expert = (int(torch.os.environ.get('SKIP_EXPERT', '0')) != 0)
@@ -20,7 +23,7 @@ class FusedExpertsNetwork(torch.nn.Module):
             assert activation_fn is None, "Option `activation_fn_with_self` has been specified, please keep exactly one of them."
             activation_fn = lambda x: activation_fn_with_self(x, self)
         if activation_fn is None:
-            activation_fn = lambda x: F.relu(x)
+            activation_fn = torch.nn.functional.relu
         self.activation_fn = activation_fn
 
         self.batched_fc1_w = torch.nn.Parameter(torch.empty(num_experts_per_device, self.hidden_size, model_dim))
@@ -54,6 +57,64 @@ class FusedExpertsNetwork(torch.nn.Module):
             self.batched_fc1_bias is not None, self.batched_fc2_bias is not None
         )
 
+    def _get_zero_group(self, ctx):
+        if ctx.adaptive_degree == 0:
+            return ctx.group
+        group_size = ctx.sharded_count // ctx.adaptive_degree
+        if group_size > 1:
+            return net.create_groups_from_world(group_count=-group_size, parent_group=ctx.group).model_group
+        return None
+
+    def _gather_params(self, ctx):
+        """
+          Returns (fc1_w, fetch_fc1_bias, fetch_fc2) for sharded params: fc1_w is gathered first, while the gathers of
+          the other params are started in background and only waited for when fetch_fc1_bias() and fetch_fc2() are called.
+        """
+        fc1_w, fc1_bias, fc2_w, fc2_bias = self.batched_fc1_w, self.batched_fc1_bias, self.batched_fc2_w, self.batched_fc2_bias
+        fc1_bias = fc1_bias.unsqueeze(1) if fc1_bias is not None else None
+        fc2_bias = fc2_bias.unsqueeze(1) if fc2_bias is not None else None
+
+        if ctx.adaptive_degree == 0:
+            num_experts = ctx.num_global_experts
+            fc1_w = net.zero_gather(fc1_w, group=ctx.group).view(num_experts, -1, fc1_w.size(2))
+            net.zero_gather_prefetch([self.batched_fc1_bias, self.batched_fc2_w, self.batched_fc2_bias], group=ctx.group)
+            gather = lambda x, *shape: net.zero_gather(x, group=ctx.group).view(*shape) if x is not None else None
+            return fc1_w, lambda: gather(self.batched_fc1_bias, num_experts, 1, -1), \
+                lambda: (gather(self.batched_fc2_w, num_experts, -1, fc2_w.size(2)), self._trim_fc2_bias(gather(self.batched_fc2_bias, num_experts, 1, -1)))
+
+        if ctx.sharded_count <= 1:
+            return fc1_w, lambda: fc1_bias, lambda: (fc2_w, self._trim_fc2_bias(fc2_bias))
+
+        mesh_size = net.get_world_size(ctx.group)
+        if mesh_size > 1 and mesh_size < net.get_world_size():
+            ctx.adaptive_degree = ctx.sharded_count
+        ffn_zero_group = self._get_zero_group(ctx) if ctx.sharded_count // ctx.adaptive_degree > 1 else None
+        if ffn_zero_group is not None:
+            fc1_w = net.zero_gather(fc1_w, group=ffn_zero_group).view(1, -1, ctx.model_dim)
+            net.zero_gather_prefetch([self.batched_fc1_bias, self.batched_fc2_w], group=ffn_zero_group)
+
+        def fetch_fc1_bias():
+            if ffn_zero_group is None or self.batched_fc1_bias is None:
+                return fc1_bias
+            return net.zero_gather(self.batched_fc1_bias, group=ffn_zero_group).view(1, 1, -1)
+
+        def fetch_fc2():
+            w = fc2_w if ffn_zero_group is None else net.zero_gather(fc2_w, group=ffn_zero_group).view(1, -1, self.output_dim)
+            if self.batched_fc2_bias is None:
+                return w, None
+            bias = net.zero_gather(self.batched_fc2_bias, group=net.create_groups_from_world(group_count=ctx.num_global_experts, parent_group=ctx.group).model_group)
+            bias = bias.view(1, 1, -1)
+            if ctx.adaptive_degree > 1:
+                bias = torch.mul(bias, 1.0 / ctx.adaptive_degree)
+            return w, self._trim_fc2_bias(bias)
+
+        return fc1_w, fetch_fc1_bias, fetch_fc2
+
+    def _trim_fc2_bias(self, bias):
+        if bias is not None and bias.size(-1) != self.output_dim:
+            bias = bias[:, :, :self.output_dim]
+        return bias
+
     def forward(self, x, ctx):
         if self.skip_expert:
             return x
@@ -80,45 +141,41 @@ class FusedExpertsNetwork(torch.nn.Module):
                 y = torch.add(y, batched_fc2_bias)
             return y
 
-        if ctx.adaptive_degree == 0:
-            batched_fc1_w = net.zero_gather(batched_fc1_w, group=ctx.group).view(ctx.num_global_experts, -1, batched_fc1_w.size(2))
-            batched_fc2_w = net.zero_gather(batched_fc2_w, group=ctx.group).view(ctx.num_global_experts, -1, batched_fc2_w.size(2))
-            if self.batched_fc1_bias is not None:
-                batched_fc1_bias = net.zero_gather(batched_fc1_bias, group=ctx.group).view(ctx.num_global_experts, 1, -1)
-            if self.batched_fc2_bias is not None:
-                batched_fc2_bias = net.zero_gather(batched_fc2_bias, group=ctx.group).view(ctx.num_global_experts, 1, -1)
-        else:
-            if ctx.sharded_count > 1:
-                mesh_size = net.get_world_size(ctx.group)
-                if mesh_size > 1 and mesh_size < net.get_world_size():
-                    ctx.adaptive_degree = ctx.sharded_count
-                group_size = ctx.sharded_count // ctx.adaptive_degree
-
-                if group_size > 1:
-                    ffn_zero_group = net.create_groups_from_world(group_count=-group_size, parent_group=ctx.group).model_group
-                    batched_fc1_w = net.zero_gather(batched_fc1_w, group=ffn_zero_group).view(1, -1, ctx.model_dim)
-                    batched_fc2_w = net.zero_gather(batched_fc2_w, group=ffn_zero_group).view(1, -1, self.output_dim)
-                    if self.batched_fc1_bias is not None:
-                        batched_fc1_bias = net.zero_gather(batched_fc1_bias, group=ffn_zero_group).view(1, 1, -1)
-
-                if self.batched_fc2_bias is not None:
-                    batched_fc2_bias = net.zero_gather(batched_fc2_bias, group=net.create_groups_from_world(group_count=ctx.num_global_experts, parent_group=ctx.group).model_group)
-                    batched_fc2_bias = batched_fc2_bias.view(1, 1, -1)
-
-                    if ctx.adaptive_degree > 1:
-                        batched_fc2_bias = torch.mul(batched_fc2_bias, 1.0 / ctx.adaptive_degree)
-
-        if self.batched_fc2_bias is not None and batched_fc2_bias.size(-1) != self.output_dim:
-            batched_fc2_bias = batched_fc2_bias[:, :, :self.output_dim]
+        batched_fc1_w, fetch_fc1_bias, fetch_fc2 = self._gather_params(ctx)
+        recompute = expert_ops.get_recompute(ctx)
+
+        activation = expert_ops.get_activation_name(self.activation_fn)
+        if expert_ops.TUTEL_FUSED_EXPERTS and activation is not None and not x.is_cuda and x.dim() == 3 and batched_fc1_w.size(0) == x.size(0):
+            fused_fn = lambda *args: expert_ops.fused_expert_ffn(*args, activation)
+            args = (x, batched_fc1_w, fetch_fc1_bias(), *fetch_fc2())
+            return expert_ops.checkpoint(fused_fn, *args) if recompute else fused_fn(*args)
+
+        def hidden_fn(x, fc1_w, fc1_bias):
+            y = torch.matmul(x, fc1_w.permute(0, 2, 1))
+            if fc1_bias is not None:
+                y = torch.add(y, fc1_bias)
+            return self.activation_fn(y)
+
+        def output_fn(y, fc2_w, fc2_bias):
+            y = torch.matmul(y, fc2_w)
+            if fc2_bias is not None:
+                y = torch.add(y, fc2_bias)
+            return y
 
-        y = torch.matmul(x, batched_fc1_w.permute(0, 2, 1))
-        if self.batched_fc1_bias is not None:
-            y = torch.add(y, batched_fc1_bias)
-        y = self.activation_fn(y)
-        y = torch.matmul(y, batched_fc2_w)
-        if self.batched_fc2_bias is not None:
-            y = torch.add(y, batched_fc2_bias)
-        return y
+        # Recomputation starts from the expert input and gathered params, so that no communication is replayed in backward
+        if recompute == 'full':
+            args = (x, batched_fc1_w, fetch_fc1_bias(), *fetch_fc2())
+            return expert_ops.checkpoint(lambda x, *params: output_fn(hidden_fn(x, *params[:2]), *params[2:]), *args)
+        if recompute == 'expert_hidden':
+            y = expert_ops.checkpoint(hidden_fn, x, batched_fc1_w, fetch_fc1_bias())
+        else:
+            # Gathers of the remaining params are only waited for once the compute before them is issued
+            y = torch.matmul(x, batched_fc1_w.permute(0, 2, 1))
+            batched_fc1_bias = fetch_fc1_bias()
+            if batched_fc1_bias is not None:
+                y = torch.add(y, batched_fc1_bias)
+            y = self.activation_fn(y)
+        return output_fn(y, *fetch_fc2())
 
 
 ExpertModule = FusedExpertsNetwork 
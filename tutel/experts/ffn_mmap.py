@@ -0,0 +1,91 @@
+# Copyright (c) Microsoft Corporation.
+# Licensed under the MIT license.
+
+import os
+import torch
+from ..impls import expert_ops
+from ..impls.communicate import get_world_rank
+from ..impls.expert_store import ExpertStore, save_expert_store
+from .ffn import FusedExpertsNetwork
+
+class MappedExpertsNetwork(torch.nn.Module):
+    """
+      Inference-only FusedExpertsNetwork serving expert weights from a memory-mapped file, so that the resident set
+      scales with the experts routing selects rather than the total, as far as routing exchanges per-expert counts
+      (capacity_factor <= 0). `path` may contain `{rank}`; a missing file is only created from a freshly initialized
+      `ffn` with `initialize=True`, and dense checkpoints of type `ffn` are written into it at load time.
+    """
+    def __init__(self, model_dim, hidden_size_per_expert, num_experts_per_device, sharded_count, activation_fn=None, output_dim=None, has_fc1_bias=True, has_fc2_bias=True, path=None, max_resident_experts=0, initialize=False):
+        super().__init__()
+        assert path, "Mapped experts require `path` of the expert weight file."
+        assert sharded_count == 1, "Mapped experts don't support sharding an expert across devices."
+        self.skip_expert = (int(torch.os.environ.get('SKIP_EXPERT', '0')) != 0)
+        self.activation_fn = activation_fn if activation_fn is not None else torch.nn.functional.relu
+        self.model_dim, self.hidden_size, self.output_dim = model_dim, hidden_size_per_expert, output_dim or model_dim
+        self.path, self.max_resident_experts = path.format(rank=get_world_rank()), max_resident_experts
+        if not os.path.exists(self.path + '.json'):
+            assert initialize, f"Expert store `{self.path}` is not found, set `initialize=True` to create it from freshly initialized weights."
+            dense = FusedExpertsNetwork(model_dim, hidden_size_per_expert, num_experts_per_device, sharded_count, activation_fn=activation_fn, output_dim=output_dim, has_fc1_bias=has_fc1_bias, has_fc2_bias=has_fc2_bias)
+            self.load_dense(dense.batched_fc1_w, dense.batched_fc1_bias, dense.batched_fc2_w, dense.batched_fc2_bias)
+        else:
+            self.store = ExpertStore(self.path, max_resident_experts)
+        assert self.store.num_experts == num_experts_per_device, f"Expert store `{self.path}` holds {self.store.num_experts} experts, while {num_experts_per_device} is expected."
+
+    def load_dense(self, fc1_w, fc1_bias, fc2_w, fc2_bias):
+        """Writes dense weights in the layout of FusedExpertsNetwork into the expert file: fc1_w: [E, H, M], fc2_w: [E, H, N]."""
+        num_experts = fc1_w.size(0) if fc1_w.dim() == 3 else fc1_w.numel() // (self.hidden_size * self.model_dim)
+        save_expert_store(self.path, {
+            'fc1_w': fc1_w.view(num_experts, self.hidden_size, self.model_dim),
+            'fc2_w': fc2_w.view(num_experts, self.hidden_size, self.output_dim),
+            'fc1_bias': fc1_bias.view(num_experts, -1) if fc1_bias is not None else None,
+            'fc2_bias': fc2_bias.view(num_experts, -1) if fc2_bias is not None else None,
+        })
+        self.store = ExpertStore(self.path, self.max_resident_experts)
+
+    def _load_from_state_dict(self, state_dict, prefix, *args, **kwargs):
+        names = [prefix + x for x in ('batched_fc1_w', 'batched_fc1_bias', 'batched_fc2_w', 'batched_fc2_bias')]
+        if names[0] in state_dict:
+            with torch.no_grad():
+                self.load_dense(*[state_dict.pop(x, None) for x in names])
+            return
+        return super()._load_from_state_dict(state_dict, prefix, *args, **kwargs)
+
+    def forward(self, x, ctx):
+        if self.skip_expert:
+            return x
+        # Tokens received by each local expert come with the capacity exchange of dropless routing, otherwise all experts are served
+        global_counts = getattr(ctx.dispatch_count, 'global_counts', None)
+        if global_counts is not None:
+            rank = get_world_rank(ctx.group)
+            counts = global_counts.view(global_counts.size(0), -1)[:, rank * x.size(0):(rank + 1) * x.size(0)].sum(dim=0)
+            active = (counts > 0).nonzero().view(-1).tolist()
+        else:
+            active = list(range(x.size(0)))
+        self.store.touch(active)
+
+        activation = expert_ops.get_activation_name(self.activation_fn)
+        y = torch.zeros([x.size(0), x.size(1), self.output_dim], dtype=x.dtype, device=x.device)
+        for e in active:
+            w = self.store.get(e)
+            fc1_w, fc2_w = w['fc1_w'].unsqueeze(0), w['fc2_w'].unsqueeze(0)
+            fc1_bias = w['fc1_bias'].view(1, 1, -1) if 'fc1_bias' in w else None
+            fc2_bias = w['fc2_bias'].view(1, 1, -1) if 'fc2_bias' in w else None
+            xe = x[e:e + 1].to(fc1_w.dtype)
+            if activation is not None:
+                ye = expert_ops.fused_expert_ffn(xe, fc1_w, fc1_bias, fc2_w, fc2_bias, activation)
+            else:
+                ye = torch.matmul(xe, fc1_w.permute(0, 2, 1))
+                if fc1_bias is not None:
+                    ye = torch.add(ye, fc1_bias)
+                ye = torch.matmul(self.activation_fn(ye), fc2_w)
+                if fc2_bias is not None:
+                    ye = torch.add(ye, fc2_bias)
+            y[e:e + 1] = ye.to(y.dtype)
+        return y
+
+    def extra_repr(self):
+        return 'model_dim=%d, hidden_size=%d, output_dim=%d, num_experts_per_device=%d, path=%s, max_resident_experts=%d.' % (
+            self.model_dim, self.hidden_size, self.output_dim, self.store.num_experts, self.path, self.store.max_resident_experts)
+
+
+ExpertModule = MappedExpertsNetwork
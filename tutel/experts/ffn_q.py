@@ -0,0 +1,60 @@
+# Copyright (c) Microsoft Corporation.
+# Licensed under the MIT license.
+
+import torch
+from ..impls import expert_ops
+from .ffn import FusedExpertsNetwork
+
+class QuantizedExpertsNetwork(torch.nn.Module):
+    """
+      Inference-only FusedExpertsNetwork with weight-only int8/int4 quantization.
+      Dense checkpoints of type `ffn` are quantized at load time.
+    """
+    def __init__(self, model_dim, hidden_size_per_expert, num_experts_per_device, sharded_count, activation_fn=None, output_dim=None, has_fc1_bias=True, has_fc2_bias=True, bits=8, group_size=128):
+        super().__init__()
+        assert bits in (4, 8), "Quantized experts only support bits = 4 or 8, while %s is given." % bits
+        assert sharded_count == 1, "Quantized experts don't support sharding an expert across devices."
+        dense = FusedExpertsNetwork(model_dim, hidden_size_per_expert, num_experts_per_device, sharded_count, activation_fn=activation_fn, output_dim=output_dim, has_fc1_bias=has_fc1_bias, has_fc2_bias=has_fc2_bias)
+        self.skip_expert = dense.skip_expert
+        self.activation_fn = dense.activation_fn
+        self.model_dim, self.hidden_size, self.output_dim = model_dim, hidden_size_per_expert, dense.output_dim
+        self.bits, self.group_size = bits, group_size
+
+        for name in ('fc1_qweight', 'fc1_scale', 'fc2_qweight', 'fc2_scale', 'fc1_bias', 'fc2_bias'):
+            self.register_buffer(name, None)
+        with torch.no_grad():
+            self.load_dense(dense.batched_fc1_w, dense.batched_fc1_bias, dense.batched_fc2_w, dense.batched_fc2_bias)
+
+    def load_dense(self, fc1_w, fc1_bias, fc2_w, fc2_bias):
+        """Quantizes dense weights in the layout of FusedExpertsNetwork: fc1_w: [E, H, M], fc2_w: [E, H, N]."""
+        num_experts = fc1_w.size(0) if fc1_w.dim() == 3 else fc1_w.numel() // (self.hidden_size * self.model_dim)
+        fc1_w = fc1_w.detach().view(num_experts, self.hidden_size, self.model_dim)
+        fc2_w = fc2_w.detach().view(num_experts, self.hidden_size, self.output_dim).transpose(1, 2)
+        self.fc1_qweight, self.fc1_scale = expert_ops.quantize_groupwise(fc1_w, self.bits, self.group_size)
+        self.fc2_qweight, self.fc2_scale = expert_ops.quantize_groupwise(fc2_w, self.bits, self.group_size)
+        self.fc1_bias = fc1_bias.detach().view(num_experts, -1).clone() if fc1_bias is not None else None
+        self.fc2_bias = fc2_bias.detach().view(num_experts, -1).clone() if fc2_bias is not None else None
+
+    def _load_from_state_dict(self, state_dict, prefix, *args, **kwargs):
+        names = [prefix + x for x in ('batched_fc1_w', 'batched_fc1_bias', 'batched_fc2_w', 'batched_fc2_bias')]
+        if names[0] in state_dict:
+            with torch.no_grad():
+                self.load_dense(*[state_dict.pop(x, None) for x in names])
+            return
+        return super()._load_from_state_dict(state_dict, prefix, *args, **kwargs)
+
+    def forward(self, x, ctx):
+        if self.skip_expert:
+            return x
+        activation = expert_ops.get_activation_name(self.activation_fn)
+        y = expert_ops.qbmm_bias_act(x, self.fc1_qweight, self.fc1_scale, self.fc1_bias, activation or 'none', self.bits)
+        if activation is None:
+            y = self.activation_fn(y)
+        return expert_ops.qbmm_bias_act(y, self.fc2_qweight, self.fc2_scale, self.fc2_bias, 'none', self.bits)
+
+    def extra_repr(self):
+        return 'model_dim=%d, hidden_size=%d, output_dim=%d, num_experts_per_device=%d, bits=%d, group_size=%d.' % (
+            self.model_dim, self.hidden_size, self.output_dim, self.fc1_qweight.size(0), self.bits, self.group_size)
+
+
+ExpertModule = QuantizedExpertsNetwork
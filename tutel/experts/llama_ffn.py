@@ -3,16 +3,21 @@
 
 import torch
 from .. import net
+from ..impls import expert_ops
 
 class LlamaFFNNetwork(torch.nn.Module):
+    handles_recompute = True
 
     def _create_sharded_param(self, *full_shape, **kwargs):
         full_shape = torch.Size(full_shape)
         sharded_shape = (full_shape.numel() + self.sharded_count - 1) // self.sharded_count
         return torch.nn.Parameter(torch.empty(sharded_shape, **kwargs)), full_shape
 
+    def _get_sharded_group(self, parent_group):
+        return net.create_groups_from_world(group_count=-self.sharded_count, parent_group=parent_group).model_group
+
     def _get_gathered_param(self, param, full_shape, parent_group):
-        sharded_group = net.create_groups_from_world(group_count=-self.sharded_count, parent_group=parent_group).model_group
+        sharded_group = self._get_sharded_group(parent_group)
         return net.zero_gather(param, group=sharded_group).view(-1).narrow(0, 0, full_shape.numel()).view(full_shape)
 
     def __init__(self, model_dim, hidden_size_per_expert, num_experts_per_device, sharded_count, activation_fn=torch.nn.functional.silu):
@@ -31,15 +36,28 @@ class LlamaFFNNetwork(torch.nn.Module):
           self.W_fc3.normal_(0, 0.01)
 
     def forward(self, x, ctx):
+        # W_fc1 is gathered first, and the gathers of W_fc2 and W_fc3 run in background until they are needed
         W_fc1_full = self._get_gathered_param(self.W_fc1, self.W_fc1_full_shape, ctx.group)
-        W_fc2_full = self._get_gathered_param(self.W_fc2, self.W_fc2_full_shape, ctx.group)
-        W_fc3_full = self._get_gathered_param(self.W_fc3, self.W_fc3_full_shape, ctx.group)
-
-        y1 = torch.matmul(x, W_fc1_full)
-        y2 = torch.matmul(x, W_fc2_full)
-        y = self.activation_fn(y1) * y2
-        y = torch.matmul(y, W_fc3_full)
-        return y
+        if self.sharded_count > 1:
+            net.zero_gather_prefetch([self.W_fc2, self.W_fc3], group=self._get_sharded_group(ctx.group))
+        fetch_fc2 = lambda: self._get_gathered_param(self.W_fc2, self.W_fc2_full_shape, ctx.group)
+        fetch_fc3 = lambda: self._get_gathered_param(self.W_fc3, self.W_fc3_full_shape, ctx.group)
+
+        # Fused SwiGLU saves inputs only and recomputes the hidden layer in backward regardless of `recompute`
+        if self.activation_fn is torch.nn.functional.silu and expert_ops.TUTEL_FUSED_EXPERTS and not x.is_cuda and x.dim() == 3:
+            return expert_ops.swiglu_expert(x, W_fc1_full, fetch_fc2(), fetch_fc3())
+
+        hidden_fn = lambda x, W_fc1, W_fc2: self.activation_fn(torch.matmul(x, W_fc1)) * torch.matmul(x, W_fc2)
+        recompute = expert_ops.get_recompute(ctx)
+        # Recomputation starts from the expert input and gathered params, so that no communication is replayed in backward
+        if recompute == 'full':
+            return expert_ops.checkpoint(lambda x, W_fc1, W_fc2, W_fc3: torch.matmul(hidden_fn(x, W_fc1, W_fc2), W_fc3), x, W_fc1_full, fetch_fc2(), fetch_fc3())
+        if recompute == 'expert_hidden':
+            y = expert_ops.checkpoint(hidden_fn, x, W_fc1_full, fetch_fc2())
+        else:
+            y1 = self.activation_fn(torch.matmul(x, W_fc1_full))
+            y = y1 * torch.matmul(x, fetch_fc2())
+        return torch.matmul(y, fetch_fc3())
 
     def extra_repr(self):
         return '..'
@@ -4,6 +4,8 @@
 import torch
 import torch.nn.functional as F
 
+from ..impls.expert_ops import has_native_op
+
 class CosineTopKGate(torch.nn.Module):
     def __init__(self, model_dim, num_global_experts, k=1, fp32_gate=False, proj_dim=256, init_t=0.5, **options):
         super(CosineTopKGate, self).__init__()
@@ -14,6 +16,7 @@ class CosineTopKGate(torch.nn.Module):
         self.sim_matrix = torch.nn.Parameter(torch.randn(size=(proj_dim, num_global_experts)), requires_grad=True)
         self.clamp_max = torch.log(torch.tensor(1. / 0.01)).item()
         torch.nn.init.normal_(self.sim_matrix, 0, 0.01)
+        self.sim_cache = None
 
         for opt in options:
             if opt not in ('capacity_factor', 'gate_noise'):
@@ -27,11 +30,20 @@ class CosineTopKGate(torch.nn.Module):
         else:
             cosine_projector = self.cosine_projector
             sim_matrix = self.sim_matrix
+        logit_scale = torch.clamp(self.temperature, max=self.clamp_max).exp()
+        if not torch.is_grad_enabled() and has_native_op('cosine_logits', x):
+            return torch.ops.tutel_ops.cosine_logits(cosine_projector(x), self.normalized_sim_matrix(sim_matrix), float(logit_scale))
         logits = torch.matmul(F.normalize(cosine_projector(x), dim=1),
                               F.normalize(sim_matrix, dim=0))
-        logit_scale = torch.clamp(self.temperature, max=self.clamp_max).exp()
         logits = logits * logit_scale
         return logits
 
+    def normalized_sim_matrix(self, sim_matrix):
+        # Expert embeddings as unit rows [E, proj_dim], kept until sim_matrix is updated or replaced.
+        key = (self.sim_matrix.data_ptr(), self.sim_matrix._version, sim_matrix.dtype)
+        if self.sim_cache is None or self.sim_cache[0] != key:
+            self.sim_cache = (key, F.normalize(sim_matrix, dim=0).t().contiguous())
+        return self.sim_cache[1]
+
 
 Gate = CosineTopKGate
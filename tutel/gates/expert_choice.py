@@ -0,0 +1,14 @@
+# Copyright (c) Microsoft Corporation.
+# Licensed under the MIT license.
+
+from .top import LinearTopKGate
+
+class ExpertChoiceGate(LinearTopKGate):
+    """
+      Linear gate whose experts choose tokens: each expert takes the top_k * capacity_factor * S / E tokens
+      it scores highest, instead of each token taking its top-k experts, so that loads are balanced by construction.
+    """
+    expert_choice = True
+
+
+Gate = ExpertChoiceGate
@@ -59,15 +59,66 @@ def create_standalone_group():
     except:
         return None
 
+class DistributedProperties:
+    pass
+
+def get_group_from_ranks(ranks):
+    """
+      Return the process group of global `ranks` from registry. The first request of each distinct rank set
+      creates it via dist.new_group(), which must be reached by all ranks in the same order.
+    """
+    ranks = tuple(sorted(ranks))
+    group = TUTEL_SUBGROUP_CACHE.get(ranks, None)
+    if group is None:
+        if len(ranks) == dist.get_world_size():
+            group = dist.group.WORLD
+        else:
+            group = dist.new_group(ranks=list(ranks), timeout=datetime.timedelta(seconds=TUTEL_GLOBAL_TIMEOUT_SEC))
+        TUTEL_SUBGROUP_CACHE[ranks] = group
+    return group
+
+def create_nested_groups(group_count, parent_group):
+    parent_ranks = dist.get_process_group_ranks(parent_group)
+    parent_size, world_size = len(parent_ranks), dist.get_world_size()
+
+    if group_count < 0:
+        group_count = parent_size // -group_count
+    assert group_count > 0 and parent_size % group_count == 0, f"Expected to evenly divide parent group of {parent_size} devices into {group_count} groups."
+    model_size = parent_size // group_count
+
+    # Every rank splits every parent group in the same order, so that dist.new_group() calls are matched world-wide.
+    all_parent_ranks = [None] * world_size
+    dist.all_gather_object(all_parent_ranks, parent_ranks)
+    for ranks in sorted(set(tuple(x) for x in all_parent_ranks)):
+        for gr in range(group_count):
+            get_group_from_ranks(ranks[gr * model_size:(gr + 1) * model_size])
+        for gr in range(model_size):
+            get_group_from_ranks(ranks[gr::model_size])
+
+    world = create_groups_from_world(group_count=1)
+    parent_rank = parent_ranks.index(world.global_rank)
+
+    result = DistributedProperties()
+    result.__dict__.update(world.__dict__)
+    result.group_count = group_count
+    result.data_rank = parent_rank // model_size
+    result.model_size = model_size
+    result.model_rank = parent_rank % model_size
+    result.model_group = get_group_from_ranks(parent_ranks[result.data_rank * model_size:(result.data_rank + 1) * model_size])
+    result.data_group = get_group_from_ranks(parent_ranks[result.model_rank::model_size])
+    return result
+
 def create_groups_from_world(group_count, include_init=None, parent_group=None):
-    parent_size, world_size = get_world_size(parent_group), get_world_size()
+    cache_key = group_count if parent_group is None else (group_count, parent_group)
+    if include_init is None and cache_key in TUTEL_GROUPING_CACHE:
+        return TUTEL_GROUPING_CACHE[cache_key]
 
-    class DistributedProperties:
-        pass
+    parent_size, world_size = get_world_size(parent_group), get_world_size()
 
     if parent_size > 1 and parent_size < world_size:
         assert include_init is None, 'Torch distributed environment had been initialized.'
-        raise Exception('Splitting nesting groups from a subgroup is yet not allowed, please report an issue for this requirement.')
+        TUTEL_GROUPING_CACHE[cache_key] = create_nested_groups(group_count, parent_group)
+        return TUTEL_GROUPING_CACHE[cache_key]
 
     backend = TUTEL_GROUPING_CACHE.get('', include_init)
     if include_init:
@@ -75,6 +126,7 @@ def create_groups_from_world(group_count, include_init=None, parent_group=None):
         TUTEL_GROUPING_CACHE[''] = backend
 
     if group_count in TUTEL_GROUPING_CACHE:
+        TUTEL_GROUPING_CACHE[cache_key] = TUTEL_GROUPING_CACHE[group_count]
         return TUTEL_GROUPING_CACHE[group_count]
 
     try:
@@ -117,7 +169,7 @@ def create_groups_from_world(group_count, include_init=None, parent_group=None):
             groups, inner_ranks = [], []
             for gr in range(dist_group_size):
                 group_ranks = [x for x in range(gr * dist_world_size, (gr + 1) * dist_world_size)]
-                groups += [dist.new_group(ranks=group_ranks, timeout=datetime.timedelta(seconds=TUTEL_GLOBAL_TIMEOUT_SEC))]
+                groups += [get_group_from_ranks(group_ranks)]
                 inner_ranks += [group_ranks]
             model_group = groups[dist_group_rank]
 
@@ -125,7 +177,7 @@ def create_groups_from_world(group_count, include_init=None, parent_group=None):
             groups, outer_ranks = [], []
             for gr in range(dist_world_size):
                 group_ranks = [x for x in range(gr, dist_world_size * dist_group_size, dist_world_size)]
-                groups += [dist.new_group(ranks=group_ranks, timeout=datetime.timedelta(seconds=TUTEL_GLOBAL_TIMEOUT_SEC))]
+                groups += [get_group_from_ranks(group_ranks)]
                 outer_ranks += [group_ranks]
             data_group = groups[dist_world_rank]
     else:
@@ -171,6 +223,7 @@ def create_groups_from_world(group_count, include_init=None, parent_group=None):
             pass
 
     TUTEL_GROUPING_CACHE[original_group_count] = result
+    TUTEL_GROUPING_CACHE[cache_key] = result
     return result
 
 
@@ -192,17 +245,141 @@ def simple_all_reduce(input, group=None, op=torch.distributed.ReduceOp.SUM, inpl
     dist.all_reduce(output, op=op, group=group)
     return output
 
-def simple_all_to_all(input, group=None, background=False):
+TUTEL_SHM_A2A = int(os.environ.get('TUTEL_SHM_A2A', 0)) > 0
+TUTEL_SHM_RING_BYTES = int(os.environ.get('TUTEL_SHM_RING_BYTES', 1 << 22))
+TUTEL_SHM_TRANSPORTS = {}
+
+class ShmTransport:
+    """
+      All_to_all of CPU tensors that exchanges with same-host peers through shared-memory rings,
+      and with remote peers through torch.distributed (e.g. gloo). Shared-memory exchanges run in order
+      on a progress thread, so that background exchanges overlap with compute of the calling thread.
+    """
+    def __init__(self, group=None):
+        import socket, uuid
+        from concurrent.futures import ThreadPoolExecutor
+        self.group = group
+        self.progress = ThreadPoolExecutor(max_workers=1)
+        world_size, world_rank = get_world_size(group), get_world_rank(group)
+        hosts = [None] * world_size
+        dist.all_gather_object(hosts, (socket.gethostname(), uuid.uuid4().hex[:16]), group=group)
+        self.local_ranks = [i for i in range(world_size) if hosts[i][0] == hosts[world_rank][0]]
+        self.remote_ranks = [i for i in range(world_size) if hosts[i][0] != hosts[world_rank][0]]
+
+        shm_prefix = '/tutel_a2a_%s' % hosts[self.local_ranks[0]][1]
+        self.handle = torch.ops.tutel_ops.shm_a2a_create(shm_prefix, self.local_ranks.index(world_rank), len(self.local_ranks), TUTEL_SHM_RING_BYTES)
+        barrier(group)
+        torch.ops.tutel_ops.shm_a2a_connect(self.handle)
+        barrier(group)
+        torch.ops.tutel_ops.shm_a2a_unlink(self.handle)
+
+    def all_to_all_single(self, output, input, output_split_sizes=None, input_split_sizes=None, background=False):
+        """Returns the wait function of the exchange if `background`, otherwise waits for it."""
+        world_size = get_world_size(self.group)
+        input_split_sizes = input_split_sizes or [input.size(0) // world_size] * world_size
+        output_split_sizes = output_split_sizes or [output.size(0) // world_size] * world_size
+        in_offsets, out_offsets = [0], [0]
+        for i in range(world_size):
+            in_offsets.append(in_offsets[-1] + input_split_sizes[i])
+            out_offsets.append(out_offsets[-1] + output_split_sizes[i])
+
+        future_op = None
+        if self.remote_ranks:
+            remote_input = torch.cat([input.narrow(0, in_offsets[i], input_split_sizes[i]) for i in self.remote_ranks])
+            remote_output = torch.empty([sum(output_split_sizes[i] for i in self.remote_ranks)] + list(output.shape[1:]), dtype=output.dtype)
+            future_op = dist.all_to_all_single(remote_output, remote_input,
+                [output_split_sizes[i] if i in self.remote_ranks else 0 for i in range(world_size)],
+                [input_split_sizes[i] if i in self.remote_ranks else 0 for i in range(world_size)], group=self.group, async_op=True)
+
+        in_row_bytes = input.element_size() * (input.numel() // max(input.size(0), 1))
+        out_row_bytes = output.element_size() * (output.numel() // max(output.size(0), 1))
+        bytes_of = lambda rows, row_bytes: torch.tensor([rows[i] * row_bytes for i in self.local_ranks], dtype=torch.int64)
+        # The exchange op releases the GIL, and the single progress thread keeps exchanges matched in issue order across ranks.
+        shm_op = self.progress.submit(torch.ops.tutel_ops.shm_a2a_exchange, self.handle,
+            input.view(-1), bytes_of(in_offsets, in_row_bytes), bytes_of(input_split_sizes, in_row_bytes),
+            output.view(-1), bytes_of(out_offsets, out_row_bytes), bytes_of(output_split_sizes, out_row_bytes), float(TUTEL_GLOBAL_TIMEOUT_SEC))
+
+        def f_wait(*args):
+            shm_op.result()
+            if future_op is not None:
+                future_op.wait()
+                for i, data in zip(self.remote_ranks, remote_output.split([output_split_sizes[i] for i in self.remote_ranks])):
+                    output.narrow(0, out_offsets[i], output_split_sizes[i]).copy_(data)
+
+        if background:
+            return f_wait
+        f_wait()
+
+def get_shm_transport(group=None):
+    if not TUTEL_SHM_A2A or not hasattr(torch.ops.tutel_ops, 'shm_a2a_exchange'):
+        return None
+    if group not in TUTEL_SHM_TRANSPORTS:
+        TUTEL_SHM_TRANSPORTS[group] = ShmTransport(group)
+    return TUTEL_SHM_TRANSPORTS[group]
+
+def all_to_all_single_async(output, input, group=None, output_split_sizes=None, input_split_sizes=None, background=False):
+    """Returns the wait function of dist.all_to_all_single(), or of the shared-memory exchange if it goes through shared memory."""
+    transport = get_shm_transport(group) if not input.is_cuda else None
+    if transport is not None:
+        f_wait = transport.all_to_all_single(output, input, output_split_sizes, input_split_sizes, background=background)
+        return f_wait if background else (lambda *args: None)
+    future_op = dist.all_to_all_single(output, input, output_split_sizes, input_split_sizes, group=group, async_op=background)
+    return future_op.wait if background else (lambda *args: None)
+
+A2A_COMPRESSION_MODES = {'fp8': 1, 'int8': 2}
+
+def rowwise_compress(input, compression):
+    """Quantize each row (last dim) of input into `[payload bytes | float32 scale]`, so that one exchange carries both."""
+    mode = A2A_COMPRESSION_MODES[compression]
+    input = input.contiguous().view(-1, input.size(-1))
+    if not input.is_cuda and hasattr(torch.ops.tutel_ops, 'rowwise_compress'):
+        return torch.ops.tutel_ops.rowwise_compress(input, mode)
+    if compression == 'fp8':
+        from ..ops import to_float8_rowwise
+        payload = to_float8_rowwise(input)
+        scale_inv, payload = payload.scale_inv, payload.view(torch.uint8)
+    else:
+        amax = input.abs().amax(dim=-1, keepdim=True).float().clamp(min=1e-12)
+        scale = 127.0 / amax
+        payload = (input * scale).round().clamp(min=-127, max=127).to(torch.int8).view(torch.uint8)
+        scale_inv = scale.reciprocal().squeeze(-1)
+    return torch.cat([payload, scale_inv.float().view(-1, 1).view(torch.uint8)], dim=1)
+
+def rowwise_decompress(packed, output, compression):
+    mode = A2A_COMPRESSION_MODES[compression]
+    if not output.is_cuda and hasattr(torch.ops.tutel_ops, 'rowwise_decompress'):
+        return torch.ops.tutel_ops.rowwise_decompress(packed, output, mode)
+    packed = packed.view(-1, output.size(-1) + 4)
+    payload, scale_inv = packed[:, :-4], packed[:, -4:].contiguous().view(torch.float32)
+    payload = payload.view(torch.float8_e4m3fn if compression == 'fp8' else torch.int8)
+    output.view(-1, output.size(-1)).copy_(payload.float() * scale_inv)
+    return output
+
+def simple_all_to_all(input, group=None, background=False, compression=None):
     world_size = get_world_size(group)
     input = input.contiguous()
     if world_size == 1 or TUTEL_SKIP_A2A:
         return input if not background else (input, lambda *args: None)
     simple_all_to_all._use_builtins = True
+    if compression:
+        assert input.dim() >= 2 and input.size(0) % world_size == 0, "Compressed all_to_all expects dim-0 to be evenly split by world size, but get shape %s." % (list(input.shape),)
+        packed = rowwise_compress(input, compression)
+        output, packed_output = torch.empty_like(input), torch.empty_like(packed)
+        f_exchange = all_to_all_single_async(packed_output, packed, group=group, background=True)
+
+        def f_wait(*args):
+            f_exchange()
+            rowwise_decompress(packed_output, output, compression)
+
+        if background:
+            return output, f_wait
+        f_wait()
+        return output
+
     output = torch.empty_like(input)
+    f_wait = all_to_all_single_async(output, input, group=group, background=background)
     if background:
-        future_op = dist.all_to_all_single(output, input, group=group, async_op=True)
-        return output, future_op.wait
-    dist.all_to_all_single(output, input, group=group)
+        return output, f_wait
     return output
 
 def simple_split(input, group=None):
@@ -213,28 +390,102 @@ def simple_split(input, group=None):
     input = input.contiguous()
     return input.chunk(chunks=world_size, dim=0)[get_world_rank(group)]
 
-def simple_reduce_scatter(input, group=None, op=torch.distributed.ReduceOp.SUM):
+def simple_reduce_scatter(input, group=None, op=torch.distributed.ReduceOp.SUM, background=False):
     world_size = get_world_size(group)
     if world_size == 1:
-        return input
+        return input if not background else (input, lambda *args: None)
     input = input.contiguous()
     assert input.size(0) % world_size == 0, "Cannot evenly divide dim length %s into %s slices" % (input.size(0), world_size)
     if not input.is_cuda:
-      return simple_split(simple_all_reduce(input, group, op=op), group=group)
+      if not background:
+        return simple_split(simple_all_reduce(input, group, op=op), group=group)
+      reduced = torch.clone(input, memory_format=torch.contiguous_format)
+      future_op = dist.all_reduce(reduced, op=op, group=group, async_op=True)
+      return simple_split(reduced, group=group), future_op.wait
     chunks = list(input.chunk(chunks=world_size, dim=0))
     output = torch.empty_like(chunks[0])
-    dist.reduce_scatter(output=output, input_list=chunks, group=group, op=op)
+    future_op = dist.reduce_scatter(output=output, input_list=chunks, group=group, op=op, async_op=background)
+    if background:
+        return output, future_op.wait
     return output
 
-def simple_all_gather(input, group=None):
+def simple_all_gather(input, group=None, background=False):
     world_size = get_world_size(group)
     if world_size == 1:
-        return input
+        return input if not background else (input, lambda *args: None)
     input = input.contiguous()
     output = torch.empty([world_size, input.numel()], device=input.device, dtype=input.dtype)
     tensor_list = list(torch.chunk(output, chunks=world_size, dim=0))
-    dist.all_gather(tensor_list=tensor_list, tensor=input.view(1, -1), group=group)
-    return output.view([-1,] + list(input.shape[1:]))
+    future_op = dist.all_gather(tensor_list=tensor_list, tensor=input.view(1, -1), group=group, async_op=background)
+    output = output.view([-1,] + list(input.shape[1:]))
+    if background:
+        return output, future_op.wait
+    return output
+
+TUTEL_PREFETCH_POOL_SIZE = int(os.environ.get('TUTEL_PREFETCH_POOL_SIZE', 8))
+TUTEL_ZERO_ASYNC_GRAD = int(os.environ.get('TUTEL_ZERO_ASYNC_GRAD', 0)) > 0
+
+class ZeroGatherPrefetcher:
+    """
+      Keeps asynchronous all_gathers of sharded params in flight until zero_gather() consumes them.
+      At most `pool_size` gathered buffers are held at a time: prefetching beyond that evicts the oldest one.
+    """
+    def __init__(self, pool_size):
+        self.pool_size = pool_size
+        self.inflight = dict()
+
+    @staticmethod
+    def _key(input, group):
+        return (input.data_ptr(), input.numel(), input.dtype, id(group))
+
+    def prefetch(self, input, group=None):
+        if self.pool_size <= 0 or get_world_size(group) == 1:
+            return
+        key = self._key(input, group)
+        if key in self.inflight:
+            return
+        while len(self.inflight) >= self.pool_size:
+            _, _, f_wait = self.inflight.pop(next(iter(self.inflight)))
+            f_wait()
+        output, f_wait = simple_all_gather(input.detach(), group, background=True)
+        self.inflight[key] = (input._version, output, f_wait)
+
+    def fetch(self, input, group=None):
+        if not self.inflight:
+            return None
+        item = self.inflight.pop(self._key(input, group), None)
+        if item is None:
+            return None
+        version, output, f_wait = item
+        f_wait()
+        # Param has been updated in-place (e.g. by optimizer) since prefetching, so the gathered copy is stale.
+        return output if version == input._version else None
+
+    def synchronize(self):
+        for _, _, f_wait in self.inflight.values():
+            f_wait()
+        self.inflight.clear()
+
+TUTEL_ZERO_PREFETCHER = ZeroGatherPrefetcher(TUTEL_PREFETCH_POOL_SIZE)
+TUTEL_PENDING_GRAD_SCATTERS = []
+
+def zero_gather_prefetch(inputs, group=None):
+    """Start gathering sharded `inputs` (a tensor or a list of tensors) in background for later zero_gather() calls on the same group."""
+    for input in (inputs if isinstance(inputs, (tuple, list)) else [inputs]):
+        if input is not None:
+            TUTEL_ZERO_PREFETCHER.prefetch(input, group)
+
+def zero_gather_synchronize_grads():
+    """Wait for background reduce_scatters of sharded param grads, and accumulate them into `param.grad`."""
+    pending = list(TUTEL_PENDING_GRAD_SCATTERS)
+    TUTEL_PENDING_GRAD_SCATTERS.clear()
+    for param, output, f_wait in pending:
+        f_wait()
+        grad = output.view_as(param)
+        if param.grad is None:
+            param.grad = grad
+        else:
+            param.grad.add_(grad)
 
 def batch_all_to_all_v(datas, partition_sizes, group=None):
     assert group is None, "batched_all_to_all_v() with non-default group is not implemented in this version."
@@ -249,6 +500,13 @@ def batch_all_to_all_v(datas, partition_sizes, group=None):
     if world_size == 1:
         return list(datas), in_sizes
     out_sizes = simple_all_to_all(in_sizes, group=group)
+    if not datas[0].is_cuda and (not torch.cuda.is_available() or get_shm_transport(group) is not None):
+        datas = [data.contiguous().view(-1) for data in datas]
+        outputs = [torch.empty([int(out_sizes.sum())], dtype=data.dtype, device=data.device) for data in datas]
+        in_splits, out_splits = in_sizes.tolist(), out_sizes.tolist()
+        for data, output in zip(datas, outputs):
+            all_to_all_single_async(output, data, group=group, output_split_sizes=out_splits, input_split_sizes=in_splits)
+        return outputs, out_sizes
     datas = [data.contiguous().view(-1).cuda() for data in datas]
     outputs = [torch.empty([out_sizes.sum()], dtype=data.dtype, device=data.device) for data in datas]
     tutel_custom_kernel.batch_all_to_all_v(datas, outputs, in_sizes, out_sizes)
@@ -458,12 +716,17 @@ class PrimAllToAll(torch.autograd.Function):
         return PrimAllToAll.apply(input, group)
 
     @staticmethod
-    def transform(input, input_dim, output_dim, group=None, background=False, use_2dh=False):
+    def transform(input, input_dim, output_dim, group=None, background=False, use_2dh=False, compression=None):
         """
           [HY] X LY Z -> [HX] HY LX LY Z
+
+          compression: None, 'fp8' or 'int8' to exchange row-wise quantized payloads in forward,
+                       while gradients are passed through (straight-through) in full precision.
         """
+        assert compression in (None, '', 'fp8', 'int8'), "Unrecognized all_to_all compression type: %s" % compression
         if use_2dh:
             assert background == False, "Background mode for AllToAll 2DH is not implemented."
+            assert not compression, "Compression mode for AllToAll 2DH is not implemented."
             return PrimAllToAll2D.apply(input, input_dim, output_dim)
 
         if background:
@@ -474,7 +737,7 @@ class PrimAllToAll(torch.autograd.Function):
             if input_dim == 0:
                 reshaped_input = input.view(list(input.shape[:output_dim]) + [world_size, -1] + list(input.shape[output_dim + 1:]))
                 reshaped_input = reshaped_input.permute([output_dim] + list(range(output_dim)) + list(range(output_dim + 1, reshaped_input.dim())))
-                output, f_wait = simple_all_to_all(reshaped_input, group, background=True)
+                output, f_wait = simple_all_to_all(reshaped_input, group, background=True, compression=compression)
 
                 def f_async():
                     f_wait()
@@ -485,7 +748,7 @@ class PrimAllToAll(torch.autograd.Function):
                 return f_async
             elif output_dim == 0:
                 reshaped_input = input
-                output, f_wait = simple_all_to_all(reshaped_input, group, background=True)
+                output, f_wait = simple_all_to_all(reshaped_input, group, background=True, compression=compression)
 
                 def f_async():
                     f_wait()
@@ -507,12 +770,12 @@ class PrimAllToAll(torch.autograd.Function):
             return input
 
         if input_dim == 0:
-            return all_to_all(input, input_dim, output_dim, group=group, background=True)()
+            return all_to_all(input, input_dim, output_dim, group=group, background=True, compression=compression)()
         elif output_dim == 0:
-            return all_to_all(input, input_dim, output_dim, group=group, background=True)()
+            return all_to_all(input, input_dim, output_dim, group=group, background=True, compression=compression)()
         else:
             reshaped_input = swap_axis(input, 0, output_dim)
-            reshaped_input = PrimAllToAll.transform(reshaped_input, input_dim, 0, group)
+            reshaped_input = PrimAllToAll.transform(reshaped_input, input_dim, 0, group, compression=compression)
             reshaped_input = swap_axis(reshaped_input, 0, output_dim).contiguous()
         return reshaped_input
 
@@ -559,21 +822,29 @@ class PrimReducescatter(torch.autograd.Function):
 
 class PrimAllgather(torch.autograd.Function):
     @staticmethod
-    def forward(ctx, input, fused=False, group=None):
+    def forward(ctx, input, fused=False, group=None, prefetched=None):
         ctx.group = group
         ctx.fused = fused
-        return simple_all_gather(input, group)
+        # Grads of leaf params can be reduce-scattered in background and accumulated at the end of backward.
+        ctx.async_param = input if fused and TUTEL_ZERO_ASYNC_GRAD and ctx.needs_input_grad[0] and input.is_leaf else None
+        return prefetched if prefetched is not None else simple_all_gather(input, group)
 
     @staticmethod
     def backward(ctx, doutput):
+        if ctx.async_param is not None:
+            if not TUTEL_PENDING_GRAD_SCATTERS:
+                torch.autograd.Variable._execution_engine.queue_callback(zero_gather_synchronize_grads)
+            output, f_wait = simple_reduce_scatter(doutput, ctx.group, background=True)
+            TUTEL_PENDING_GRAD_SCATTERS.append((ctx.async_param, output, f_wait))
+            return (None, None, None, None)
         if ctx.fused:
-            return (simple_reduce_scatter(doutput, ctx.group), None, None)
-        return (simple_split(doutput, ctx.group), None, None)
+            return (simple_reduce_scatter(doutput, ctx.group), None, None, None)
+        return (simple_split(doutput, ctx.group), None, None, None)
 
     @staticmethod
     def transform(input, dim, fused=False, group=None):
         input = swap_axis(input, 0, dim)
-        input = PrimAllgather.apply(input, fused, group)
+        input = PrimAllgather.apply(input, fused, group, None)
         input = swap_axis(input, 0, dim)
         return input
 
@@ -585,7 +856,8 @@ class PrimAllgather(torch.autograd.Function):
         numel = 1
         for x in full_shape:
             numel *= int(x)
-        input = PrimAllgather.apply(input, True, group)
+        prefetched = TUTEL_ZERO_PREFETCHER.fetch(input, group)
+        input = PrimAllgather.apply(input, True, group, prefetched)
         return input.view(-1)[:numel].view(full_shape)
 
     @staticmethod
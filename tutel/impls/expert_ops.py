@@ -0,0 +1,163 @@
+# Copyright (c) Microsoft Corporation.
+# Licensed under the MIT license.
+
+import os
+import torch
+import torch.utils.checkpoint
+from torch import Tensor
+
+TUTEL_FUSED_EXPERTS = int(os.environ.get('TUTEL_FUSED_EXPERTS', 1)) > 0
+
+def has_native_op(name, x, force=False):
+    return (TUTEL_FUSED_EXPERTS or force) and not x.is_cuda and hasattr(torch.ops.tutel_ops, name)
+
+def get_recompute(ctx):
+    """Returns the `recompute` type of the layer context experts run in, or None if autograd isn't recording."""
+    return getattr(ctx, 'recompute', None) if torch.is_grad_enabled() else None
+
+def checkpoint(fn, *args):
+    return torch.utils.checkpoint.checkpoint(fn, *args, use_reentrant=False)
+
+
+class SwiGLUExpert(torch.autograd.Function):
+    """
+      y = (silu(x @ w1) * (x @ w2)) @ w3 for batched experts, with x: [E, C, M], w1/w2: [E, M, H], w3: [E, H, N].
+      Only inputs are saved for backward, where gate/up projections are recomputed,
+      so that no [E, C, H] intermediate is kept alive between forward and backward.
+    """
+    @staticmethod
+    def forward(ctx, x: Tensor, w1: Tensor, w2: Tensor, w3: Tensor):
+        ctx.save_for_backward(x, w1, w2, w3)
+        if has_native_op('swiglu_expert', x):
+            return torch.ops.tutel_ops.swiglu_expert(x.contiguous(), w1.contiguous(), w2.contiguous(), w3.contiguous())
+        return torch.matmul(torch.nn.functional.silu(torch.matmul(x, w1)) * torch.matmul(x, w2), w3)
+
+    @staticmethod
+    def backward(ctx, dy: Tensor):
+        x, w1, w2, w3 = ctx.saved_tensors
+        g, u = torch.matmul(x, w1), torch.matmul(x, w2)
+        sig_g = torch.sigmoid(g)
+        silu_g = g * sig_g
+        da = torch.matmul(dy, w3.transpose(1, 2))
+        dw3 = torch.matmul((silu_g * u).transpose(1, 2), dy)
+        dg = da * u * (sig_g * (1 + g * (1 - sig_g)))
+        du = da * silu_g
+        dx = torch.matmul(dg, w1.transpose(1, 2)) + torch.matmul(du, w2.transpose(1, 2))
+        dw1 = torch.matmul(x.transpose(1, 2), dg)
+        dw2 = torch.matmul(x.transpose(1, 2), du)
+        return dx, dw1, dw2, dw3
+
+
+def swiglu_expert(x, w1, w2, w3):
+    return SwiGLUExpert.apply(x, w1, w2, w3)
+
+
+ACTIVATION_IDS = {'none': 0, 'relu': 1, 'gelu': 2, 'silu': 3}
+_NATIVE_ACTIVATIONS = {
+    torch.relu: 'relu', torch.nn.functional.relu: 'relu',
+    torch.nn.functional.gelu: 'gelu',
+    torch.nn.functional.silu: 'silu',
+}
+_TORCH_ACTIVATIONS = {
+    'none': lambda x: x,
+    'relu': torch.nn.functional.relu,
+    'gelu': torch.nn.functional.gelu,
+    'silu': torch.nn.functional.silu,
+}
+
+def get_activation_name(activation_fn):
+    """Returns the name of an activation the fused epilogue can evaluate natively, or None."""
+    try:
+        return _NATIVE_ACTIVATIONS.get(activation_fn, None)
+    except TypeError:
+        return None
+
+def bmm_bias_act(x, w, bias, activation, w_transposed, keep_preact=False):
+    """
+      act(x @ w + bias) for batched experts, where w is [E, K, N] or [E, N, K] if `w_transposed`.
+      Returns (y, z) where z is the pre-activation if `keep_preact`, otherwise None.
+    """
+    if has_native_op('bmm_bias_act', x) and w.dim() == 3 and w.size(0) == x.size(0) and (bias is None or bias.size(0) in (1, x.size(0))):
+        out = torch.ops.tutel_ops.bmm_bias_act(x.contiguous(), w.contiguous(), None if bias is None else bias.contiguous(), ACTIVATION_IDS[activation], w_transposed, keep_preact)
+        return out[0], (out[1] if keep_preact else None)
+    z = torch.matmul(x, w.transpose(1, 2) if w_transposed else w)
+    if bias is not None:
+        z = torch.add(z, bias)
+    return _TORCH_ACTIVATIONS[activation](z), (z if keep_preact else None)
+
+def _reduce_bias_grad(dz, bias):
+    if bias is None:
+        return None
+    db = dz.sum(dim=1, keepdim=True)
+    if bias.size(0) != db.size(0):
+        db = db.sum(dim=0, keepdim=True)
+    return db.view(bias.shape)
+
+
+class FusedExpertFFN(torch.autograd.Function):
+    """
+      y = act(x @ w1^T + b1) @ w2 + b2 for batched experts, with x: [E, C, M], w1: [E, H, M], w2: [E, H, N].
+      Bias and activation are applied in the epilogue of each projection, and only the pre-activation
+      of the hidden layer is saved: the activation itself is recomputed in backward.
+    """
+    @staticmethod
+    def forward(ctx, x: Tensor, w1: Tensor, b1: Tensor, w2: Tensor, b2: Tensor, activation: str):
+        a, z = bmm_bias_act(x, w1, b1, activation, True, keep_preact=True)
+        y, _ = bmm_bias_act(a, w2, b2, 'none', False)
+        ctx.activation = activation
+        ctx.save_for_backward(x, w1, b1, w2, b2, z)
+        return y
+
+    @staticmethod
+    def backward(ctx, dy: Tensor):
+        x, w1, b1, w2, b2, z = ctx.saved_tensors
+        with torch.enable_grad():
+            z = z.detach().requires_grad_(True)
+            a = _TORCH_ACTIVATIONS[ctx.activation](z)
+        dw2 = torch.matmul(a.detach().transpose(1, 2), dy)
+        da = torch.matmul(dy, w2.transpose(1, 2))
+        dz, = torch.autograd.grad(a, z, da)
+        dx = torch.matmul(dz, w1)
+        dw1 = torch.matmul(dz.transpose(1, 2), x)
+        return dx, dw1, _reduce_bias_grad(dz, b1), dw2, _reduce_bias_grad(dy, b2), None
+
+
+def fused_expert_ffn(x, w1, b1, w2, b2, activation):
+    if torch.is_grad_enabled() and any(t is not None and t.requires_grad for t in (x, w1, b1, w2, b2)):
+        return FusedExpertFFN.apply(x, w1, b1, w2, b2, activation)
+    a, _ = bmm_bias_act(x, w1, b1, activation, True)
+    return bmm_bias_act(a, w2, b2, 'none', False)[0]
+
+
+def quantize_groupwise(w, bits, group_size):
+    """
+      Symmetric weight-only quantization along the last dim of w, with one float scale per `group_size` values.
+      Returns int8 values for bits == 8, or uint8 with two int4 values per byte (lower nibble first) for bits == 4.
+    """
+    assert bits in (4, 8), "Unsupported quantization bits: %s" % bits
+    k = w.size(-1)
+    group_size = group_size if group_size > 0 else k
+    assert k % group_size == 0 and (bits == 8 or group_size % 2 == 0), f"Dim size {k} can't be divided into quantization groups of {group_size}."
+    q_max = 2 ** (bits - 1) - 1
+    w = w.float().reshape(*w.shape[:-1], k // group_size, group_size)
+    scale = w.abs().amax(dim=-1, keepdim=True).clamp(min=1e-12) / q_max
+    q = torch.round(w / scale).clamp(-q_max - 1, q_max).to(torch.int8).flatten(-2)
+    if bits == 4:
+        q = ((q[..., 0::2] & 15) | (q[..., 1::2] << 4)).view(torch.uint8)
+    return q.contiguous(), scale.squeeze(-1).contiguous()
+
+def dequantize_groupwise(q, scale, bits, dtype=torch.float32):
+    q = q.view(torch.int8)
+    if bits == 4:
+        low = q & 15
+        q = torch.stack([low - ((low & 8) << 1), q >> 4], dim=-1).flatten(-2)
+    return (q.view(*scale.shape, -1).float() * scale.float().unsqueeze(-1)).flatten(-2).to(dtype)
+
+def qbmm_bias_act(x, qweight, scale, bias, activation, bits):
+    """act(x @ w^T + bias) for batched experts, with w: [E, N, K] stored by quantize_groupwise()."""
+    if has_native_op('qbmm_bias_act', x):
+        return torch.ops.tutel_ops.qbmm_bias_act(x.contiguous(), qweight, scale.float().contiguous(), None if bias is None else bias.to(x.dtype).contiguous(), bits, ACTIVATION_IDS[activation])
+    y = torch.matmul(x, dequantize_groupwise(qweight, scale, bits, x.dtype).transpose(1, 2))
+    if bias is not None:
+        y = torch.add(y, bias.to(x.dtype).unsqueeze(1))
+    return _TORCH_ACTIVATIONS[activation](y)
@@ -0,0 +1,89 @@
+# Copyright (c) Microsoft Corporation.
+# Licensed under the MIT license.
+
+import json
+import mmap
+import os
+from collections import OrderedDict
+
+import torch
+
+
+def _align(size, alignment):
+    return (size + alignment - 1) // alignment * alignment
+
+def save_expert_store(path, tensors):
+    """
+      Writes per-expert tensors {name: [E, ..]} into a flat file holding one page-aligned region per expert,
+      with the region layout described in `path + '.json'`. Both files are replaced atomically.
+    """
+    tensors = {k: v.detach() for k, v in tensors.items() if v is not None}
+    num_experts = next(iter(tensors.values())).size(0)
+    entries, offset = [], 0
+    for name, t in tensors.items():
+        assert t.size(0) == num_experts, f"Tensor `{name}` has {t.size(0)} experts, while {num_experts} is expected."
+        entries.append({'name': name, 'shape': list(t.shape[1:]), 'dtype': str(t.dtype).split('.')[-1], 'offset': offset})
+        offset = _align(offset + t[0].numel() * t.element_size(), 64)
+    region_bytes = _align(max(offset, 1), mmap.PAGESIZE)
+
+    with open(path + '.tmp', 'wb+') as fp:
+        fp.truncate(region_bytes * num_experts)
+        with mmap.mmap(fp.fileno(), region_bytes * num_experts) as mapping:
+            buffer = torch.frombuffer(mapping, dtype=torch.uint8)
+            for entry, t in zip(entries, tensors.values()):
+                for e in range(num_experts):
+                    src = t[e].contiguous().cpu().view(-1).view(torch.uint8)
+                    buffer.narrow(0, e * region_bytes + entry['offset'], src.numel()).copy_(src)
+            del buffer
+    with open(path + '.json.tmp', 'w') as fp:
+        json.dump({'num_experts': num_experts, 'region_bytes': region_bytes, 'tensors': entries}, fp)
+    os.replace(path + '.tmp', path)
+    os.replace(path + '.json.tmp', path + '.json')
+
+
+class ExpertStore:
+    """
+      Expert weights memory-mapped from a file written by `save_expert_store()`: an expert is only paged in once
+      its tensors are touched. `touch()` tracks routed experts in an LRU of `max_resident_experts`, hinting the kernel
+      to read ahead newly routed experts and to drop the pages of evicted ones.
+    """
+    def __init__(self, path, max_resident_experts=0):
+        with open(path + '.json') as fp:
+            meta = json.load(fp)
+        self.num_experts, self.region_bytes = meta['num_experts'], meta['region_bytes']
+        self.entries = [(x['name'], x['shape'], getattr(torch, x['dtype']), x['offset']) for x in meta['tensors']]
+        with open(path, 'rb') as fp:
+            # Private mapping: pages stay clean and file-backed unless written to, and writes never reach the file.
+            self.mapping = mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_COPY)
+        assert len(self.mapping) == self.num_experts * self.region_bytes, f"Expert store `{path}` doesn't match its layout description."
+        self._advise('MADV_RANDOM', 0, len(self.mapping))
+        self.buffer = torch.frombuffer(self.mapping, dtype=torch.uint8)
+        self.max_resident_experts = max_resident_experts if max_resident_experts > 0 else self.num_experts
+        self.resident = OrderedDict()
+
+    def _advise(self, advice, start, length):
+        advice = getattr(mmap, advice, None)
+        if advice is not None and hasattr(self.mapping, 'madvise'):
+            self.mapping.madvise(advice, start, length)
+
+    def get(self, expert_id):
+        """Returns {name: tensor} viewing the region of an expert, without reading it."""
+        region = self.buffer.narrow(0, expert_id * self.region_bytes, self.region_bytes)
+        out = {}
+        for name, shape, dtype, offset in self.entries:
+            numel = 1
+            for x in shape:
+                numel *= x
+            out[name] = region.narrow(0, offset, numel * dtype.itemsize).view(dtype).view(shape)
+        return out
+
+    def touch(self, expert_ids):
+        for e in expert_ids:
+            if e in self.resident:
+                self.resident.move_to_end(e)
+                continue
+            self.resident[e] = True
+            self._advise('MADV_WILLNEED', e * self.region_bytes, self.region_bytes)
+        while len(self.resident) > self.max_resident_experts:
+            e, _ = self.resident.popitem(last=False)
+            self._advise('MADV_DONTNEED', e * self.region_bytes, self.region_bytes)
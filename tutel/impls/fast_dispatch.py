@@ -10,7 +10,8 @@ from torch import Tensor
 from .jit_compiler import IS_HIP_EXTENSION
 from ..jit_kernels import sparse as jit_kernel
 from ..jit_kernels.gating import fast_cumsum_sub_one
-from .communicate import get_world_rank, simple_all_reduce
+from .communicate import get_world_rank, simple_all_reduce, simple_all_gather
+from .expert_ops import has_native_op
 from . import losses
 
 class GatingEncoder(torch.autograd.Function):
@@ -49,7 +50,7 @@ class GatingEncoder(torch.autograd.Function):
 
 class GatingDecoder(torch.autograd.Function):
     @staticmethod
-    def forward(ctx: Any, config: Any, expert_output: Tensor, *gates_):
+    def forward(ctx: Any, config: Any, expert_output: Tensor, residual: Optional[Tensor], *gates_):
         ctx.config = config
         if gates_:
           ctx.gates_h2 = [x.view(-1, 1).repeat(1, 2) if x.dtype == torch.float16 else x for x in gates_]
@@ -57,6 +58,14 @@ class GatingDecoder(torch.autograd.Function):
           ctx.gates_h2 = [ctx.config.ones_helper] * len(ctx.config.indices_)
 
         ctx.save_for_backward(expert_output)
+        ctx.has_residual = residual is not None
+
+        if residual is not None:
+          # Combine expert outputs on top of residual in place, without allocating a separate output
+          for g, i, l in zip(ctx.gates_h2, ctx.config.indices_, ctx.config.locations_):
+            config.func_combine(g, i, l, residual, expert_output, extra=[ctx.config.indices_[0].size(0), ctx.config.aligned_dim, ctx.config.capacity])
+          ctx.mark_dirty(residual)
+          return residual
 
         last_result = None
         for g, i, l in zip(ctx.gates_h2, ctx.config.indices_, ctx.config.locations_):
@@ -79,7 +88,7 @@ class GatingDecoder(torch.autograd.Function):
             grad_gates1_s = torch.empty([ctx.config.sample_size,], dtype=combined_output.dtype, device=combined_output.device)
             ctx.config.func_bwd_gate(grad_gates1_s, i, l, combined_output, expert_output, extra=[ctx.config.indices_[0].size(0), ctx.config.aligned_dim, ctx.config.capacity])
             grad_gates.append(grad_gates1_s)
-        return (None, grad_expert_output, *grad_gates)
+        return (None, grad_expert_output, combined_output if ctx.has_residual else None, *grad_gates)
 
 
 class TutelMoeFastDispatcher:
@@ -111,9 +120,10 @@ class TutelMoeFastDispatcher:
                 self.func_fwd = jit_kernel.create_forward(self.dtype, indices_[0].is_cuda)
                 self.func_bwd_data = jit_kernel.create_backward_data(self.dtype, indices_[0].is_cuda)
                 self.func_bwd_gate = jit_kernel.create_backward_gate(self.dtype, indices_[0].is_cuda)
-                TutelMoeFastDispatcher.kernel_pool[self.is_cuda] = self.func_fwd, self.func_bwd_data, self.func_bwd_gate
+                self.func_combine = jit_kernel.create_combine_data(self.dtype, indices_[0].is_cuda)
+                TutelMoeFastDispatcher.kernel_pool[self.is_cuda] = self.func_fwd, self.func_bwd_data, self.func_bwd_gate, self.func_combine
             else:
-                self.func_fwd, self.func_bwd_data, self.func_bwd_gate = TutelMoeFastDispatcher.kernel_pool[self.is_cuda]
+                self.func_fwd, self.func_bwd_data, self.func_bwd_gate, self.func_combine = TutelMoeFastDispatcher.kernel_pool[self.is_cuda]
 
         if TutelMoeFastDispatcher.ones_helper is None or TutelMoeFastDispatcher.ones_helper.size(0) < self.sample_size:
             TutelMoeFastDispatcher.ones_helper = torch.ones([self.sample_size, 2], dtype=self.dtype, device=self.indices_[0].device)
@@ -127,55 +137,164 @@ class TutelMoeFastDispatcher:
         else:
             return GatingEncoder.apply(self, data.to(self.dtype), *self.gates_).to(self.original_dtype)
 
-    def decode(self, data):
+    def decode(self, data, residual=None):
+        if residual is not None:
+            assert residual.numel() == self.sample_size * self.model_dim, "Residual of decode is expected to hold [%d, %d] elements." % (self.sample_size, self.model_dim)
+            residual = residual.to(self.dtype).contiguous()
         if self.is_postscore:
-            return GatingDecoder.apply(self, data.to(self.dtype), *self.gates_).to(self.original_dtype)
+            return GatingDecoder.apply(self, data.to(self.dtype), residual, *self.gates_).to(self.original_dtype)
         else:
-            return GatingDecoder.apply(self, data.to(self.dtype)).to(self.original_dtype)
+            return GatingDecoder.apply(self, data.to(self.dtype), residual).to(self.original_dtype)
 
 fast_dispatcher = TutelMoeFastDispatcher
 
-def compute_sorted_location(x, importance_scores):
-    sorted_x = x[importance_scores.argsort(dim=0)]
+def compute_sorted_location(x, importance_scores, stable=False):
+    sorted_x = x[importance_scores.argsort(dim=0, stable=stable)]
     sorted_cumsum = fast_cumsum_sub_one(sorted_x) * sorted_x
-    return sorted_cumsum[importance_scores.argsort(dim=0).argsort(dim=0)]
+    return sorted_cumsum[importance_scores.argsort(dim=0, stable=stable).argsort(dim=0, stable=stable)]
+
+class FusedGateTopK(torch.autograd.Function):
+    """
+      scores = softmax(x @ wg^T) with their top-k, per-expert score sums and per-rank selection counts from one CPU kernel.
+      Backward goes through the softmax from the saved scores, so that only logits gradients are materialized.
+    """
+    @staticmethod
+    def forward(ctx, x: Tensor, wg: Tensor, top_k: int):
+        scores, top_v, top_ids, me, counts = torch.ops.tutel_ops.moe_gate_topk(x, wg.contiguous(), top_k)
+        ctx.save_for_backward(x, wg, scores, top_ids)
+        ctx.mark_non_differentiable(scores, top_ids, counts)
+        return scores, top_v, top_ids, me, counts
+
+    @staticmethod
+    def backward(ctx, _, grad_top_v: Tensor, __, grad_me: Tensor, ___):
+        x, wg, scores, top_ids = ctx.saved_tensors
+        grad_logits = torch.ops.tutel_ops.moe_gate_topk_backward(scores, top_ids, grad_top_v, grad_me)
+        grad_x = torch.matmul(grad_logits, wg.float()).to(x.dtype)
+        grad_wg = torch.matmul(grad_logits.t(), x.float()).to(wg.dtype)
+        return grad_x, grad_wg, None
+
+def fused_gate_topk(x, wg, top_k):
+    """
+      Routes x: [S, M] by a bias-free linear gate wg: [E, M] without separate passes over [S, E] for softmax, top-k,
+      one-hot masks and the gshard loss. Returns (scores, routed) to be passed as extract_critical(scores, .., routed=routed).
+    """
+    scores, top_v, top_ids, me, counts = FusedGateTopK.apply(x.to(wg.dtype), wg, min(top_k, wg.size(0)))
+    num_samples, num_global_experts = int(scores.size(0)), int(scores.size(1))
+    # Same as losses.gshard_loss(): sum(me * ce) / S with ce = top-1 counts * E / S.
+    l_loss = torch.sum(me * counts[0]) * (num_global_experts / (num_samples * num_samples))
+    return scores, (top_ids.long(), top_v, l_loss)
+
+def extract_expert_choice_critical(scores, top_k, capacity_factor=1.0, alignment=1, group=None, inequivalent_tokens=False, deterministic=False):
+    """
+      Expert-choice routing: each expert takes the top_k * capacity_factor * S / E tokens it scores highest, so that
+      no expert is ever over capacity. A token picked by several experts occupies as many slots of indices_s,
+      locations_s and gates_s, where slots unused by a token hold index -1.
+    """
+    assert capacity_factor > 0, "Expert-choice routing requires a positive capacity_factor, but get %s." % capacity_factor
+    num_global_experts, local_samples = int(scores.size(1)), int(scores.size(0))
+    if inequivalent_tokens:
+        num_samples = torch.tensor(local_samples, device=scores.device)
+        num_samples = int(simple_all_reduce(num_samples, group=group, op=torch.distributed.ReduceOp.MAX))
+    else:
+        num_samples = local_samples
 
-def extract_critical(scores, top_k, loss_fn=losses.gshard_loss, capacity_factor=1.0, batch_prioritized_routing=False, normalize_gate=True, alignment=1, group=None, inequivalent_tokens=False):
-    num_global_experts = int(scores.size(1))
+    samples_per_expert = (num_samples + num_global_experts - 1) // num_global_experts
+    capacity = top_k * int(capacity_factor * samples_per_expert)
+    remainder = capacity % alignment
+    if remainder > 0:
+        capacity = capacity + alignment - remainder
+    picks = min(capacity, local_samples)
+
+    if has_native_op('moe_expert_choice', scores, force=deterministic):
+        indices, locations = torch.ops.tutel_ops.moe_expert_choice(scores.detach().contiguous(), picks)
+    else:
+        if deterministic:
+            selected = torch.sort(scores.detach(), dim=0, descending=True, stable=True).indices[:picks].t().reshape(-1)
+        else:
+            selected = torch.topk(scores.detach(), picks, dim=0).indices.t().reshape(-1)
+        experts = torch.arange(num_global_experts, dtype=torch.int32, device=scores.device).repeat_interleave(picks)
+        positions = torch.arange(picks, dtype=torch.int32, device=scores.device).repeat(num_global_experts)
+        counts = torch.bincount(selected, minlength=local_samples)
+        order = torch.argsort(selected, stable=True)
+        slots = torch.empty_like(selected)
+        slots[order] = torch.arange(selected.numel(), device=scores.device) - (torch.cumsum(counts, dim=0) - counts)[selected[order]]
+        indices = torch.full([max(int(counts.max()), 1), local_samples], -1, dtype=torch.int32, device=scores.device)
+        locations = torch.zeros_like(indices)
+        indices[slots, selected], locations[slots, selected] = experts, positions
+
+    gates = scores.gather(1, indices.t().clamp(min=0).long()).t() * (indices >= 0)
+
+    if get_world_rank(group) == 0:
+        logging.info(f"Capacity = {capacity}, expert-choice with {indices.size(0)} slots per token")
+
+    dispatch_count = torch.full([num_global_experts], picks, dtype=torch.int64, device=scores.device)
+    dispatch_count.topk_ids = indices.t().long()
+    return (num_global_experts, list(indices.unbind(0)), list(locations.unbind(0)), list(gates.unbind(0)), capacity, dispatch_count), scores.new_zeros([])
+
+def extract_critical(scores, top_k, loss_fn=losses.gshard_loss, capacity_factor=1.0, batch_prioritized_routing=False, normalize_gate=True, alignment=1, group=None, inequivalent_tokens=False, expert_slots=None, num_expert_slots=0, routed=None, expert_choice=False, deterministic=False):
+    """
+      With `deterministic`, ties of scores go to the lowest expert id (or token id in batch-prioritized and expert-choice routing),
+      and native CPU ops with fixed-order reductions are used regardless of TUTEL_FUSED_EXPERTS, so that results
+      on CPU are bitwise identical for any number of threads.
+    """
+    if expert_choice:
+        assert expert_slots is None, "Expert-choice routing doesn't support replicated experts."
+        return extract_expert_choice_critical(scores, top_k, capacity_factor, alignment, group, inequivalent_tokens, deterministic)
+    num_global_experts = num_real_experts = int(scores.size(1))
     top_k, top_k_original = min(top_k, num_global_experts), top_k
-    topk_indices = torch.topk(scores, top_k, dim=1).indices
+    if routed is None and deterministic:
+        topk_indices = torch.sort(scores, dim=1, descending=True, stable=True).indices[:, :top_k]
+    elif routed is None:
+        topk_indices = torch.topk(scores, top_k, dim=1).indices
+    else:
+        topk_indices, topk_gates, l_loss = routed
 
     indices_s = [x.view(-1) for x in topk_indices.chunk(top_k, dim=1)]
 
     masks_se = [losses._one_hot_with_dtype(x, num_classes=num_global_experts, dtype=x.dtype) for x in indices_s]
-    gates_s = [(scores * x).sum(dim=1) for x in masks_se]
+    if routed is None:
+        gates_s = [(scores * x).sum(dim=1) for x in masks_se]
+        l_loss = loss_fn(scores, topk_indices) if loss_fn is not None else None
+    else:
+        gates_s = [x.view(-1) for x in topk_gates.chunk(top_k, dim=1)]
 
-    l_loss = loss_fn(scores, topk_indices) if loss_fn is not None else None
+    if expert_slots is not None:
+        # Dispatch to expert slots instead, where tokens of expert g alternate between slots expert_slots[g, :]
+        expert_slots = expert_slots.to(topk_indices.device)
+        replica_ids = torch.arange(topk_indices.size(0), device=topk_indices.device) % expert_slots.size(1)
+        num_global_experts = num_expert_slots
+        indices_s = [expert_slots[x, replica_ids] for x in indices_s]
+        masks_se = [losses._one_hot_with_dtype(x, num_classes=num_global_experts, dtype=x.dtype) for x in indices_s]
 
     if batch_prioritized_routing:
         importance_scores = -1 * scores.max(dim=1)[0]
-        compute_location = lambda x: compute_sorted_location(x, importance_scores)
+        compute_location = lambda x: compute_sorted_location(x, importance_scores, stable=deterministic)
     else:
         compute_location = fast_cumsum_sub_one
 
-    locations1 = compute_location(masks_se[0])
+    if batch_prioritized_routing and has_native_op('moe_sorted_locations', scores, force=deterministic):
+        # One radix sort by importance serves all ranks, and also yields dispatch counts.
+        locations, locations2 = torch.ops.tutel_ops.moe_sorted_locations(importance_scores.detach().float().contiguous(), torch.stack(indices_s).long(), num_global_experts)
+        locations_s = list(locations.unbind(0))
+    else:
+        locations1 = compute_location(masks_se[0])
 
-    locations_s = [torch.sum(locations1 * masks_se[0], dim=1).to(torch.int32)]
+        locations_s = [torch.sum(locations1 * masks_se[0], dim=1).to(torch.int32)]
 
-    if top_k > 1:
-        acc_base = None
-        for k in range(1, top_k):
-            acc_base = torch.sum(masks_se[k - 1], dim=0, keepdim=True) if acc_base is None else acc_base + torch.sum(masks_se[k - 1], dim=0, keepdim=True)
-            locations2 = compute_location(masks_se[k])
-            locations2 += acc_base
-            locations_s.append(torch.sum(locations2 * masks_se[k], dim=1).to(torch.int32))
+        if top_k > 1:
+            acc_base = None
+            for k in range(1, top_k):
+                acc_base = torch.sum(masks_se[k - 1], dim=0, keepdim=True) if acc_base is None else acc_base + torch.sum(masks_se[k - 1], dim=0, keepdim=True)
+                locations2 = compute_location(masks_se[k])
+                locations2 += acc_base
+                locations_s.append(torch.sum(locations2 * masks_se[k], dim=1).to(torch.int32))
+        else:
+            locations2 = locations1
+        locations2 = locations2[-1] + 1
 
-        if normalize_gate:
-            denom_s = torch.clamp(sum(gates_s), min=torch.finfo(gates_s[0].dtype).eps)
-            gates_s = [x / denom_s for x in gates_s]
-    else:
-        locations2 = locations1
-    locations2 = locations2[-1] + 1
+    if top_k > 1 and normalize_gate:
+        denom_s = torch.clamp(sum(gates_s), min=torch.finfo(gates_s[0].dtype).eps)
+        gates_s = [x / denom_s for x in gates_s]
 
     indices_s = [x.to(torch.int32) for x in indices_s]
 
@@ -185,12 +304,14 @@ def extract_critical(scores, top_k, loss_fn=losses.gshard_loss, capacity_factor=
     else:
         num_samples = int(scores.size(0))
 
-    samples_per_expert = (num_samples + num_global_experts - 1) // num_global_experts
+    samples_per_expert = (num_samples + num_real_experts - 1) // num_real_experts
+    global_counts = None
     if capacity_factor > 0:
         capacity = top_k * int(capacity_factor * samples_per_expert)
     else:
-        capacity = locations2.max()
-        capacity = int(simple_all_reduce(capacity, group=group, op=torch.distributed.ReduceOp.MAX))
+        # Dispatch counts of all devices are exchanged for the capacity, which also serve as the load of replicated experts
+        global_counts = simple_all_gather(locations2.view(1, -1), group=group)
+        capacity = int(global_counts.max())
         if capacity_factor < 0:
             capacity = min(capacity, top_k * int(-capacity_factor * samples_per_expert))
 
@@ -201,7 +322,7 @@ def extract_critical(scores, top_k, loss_fn=losses.gshard_loss, capacity_factor=
     if get_world_rank(group) == 0:
         logging.info(f"Capacity = {capacity}, real-time capacity-factor for top-{top_k_original} = {capacity / (top_k * samples_per_expert)}")
 
-    locations2.topk_ids = topk_indices
+    locations2.topk_ids, locations2.global_counts = topk_indices, global_counts
     return (num_global_experts, indices_s, locations_s, gates_s, capacity, locations2), l_loss
 
 def get_dispatch_count(critial_data):
@@ -234,9 +355,10 @@ def fast_encode(data, critial_data, is_postscore=True):
     dispatcher.update(*critial_data[1:-1], is_postscore=is_postscore)
     return dispatcher.encode(data).view(num_global_experts, -1, data.size(-1))
 
-def fast_decode(data, critial_data, is_postscore=True):
+def fast_decode(data, critial_data, is_postscore=True, residual=None):
+    """Combines expert outputs back to samples, which are accumulated into `residual` [samples, model_dim] in place if given."""
     assert data.is_contiguous(), "Input tensor for encode/decode should be in contiguous memory format."
     num_global_experts = critial_data[0]
     dispatcher = TutelMoeFastDispatcher(num_global_experts, 0, data.size(-1), data.dtype)
     dispatcher.update(*critial_data[1:-1], is_postscore=is_postscore)
-    return dispatcher.decode(data).view(-1, data.size(-1))
+    return dispatcher.decode(data, residual).view(-1, data.size(-1))
@@ -0,0 +1,93 @@
+# Copyright (c) Microsoft Corporation.
+# Licensed under the MIT license.
+
+import torch
+
+
+class KVCache:
+    """
+      Paged key/value cache over a fixed pool of `num_blocks` blocks of `block_size` token slots, stored per layer as
+      [num_blocks * block_size, kv_heads, head_dim] so that a slot id indexes one token. Each sequence owns a block table;
+      blocks come from and return to a free list in O(1), and sequences forked from a common prefix share its blocks by
+      reference count, copying a shared partial block on the first write to it.
+    """
+    def __init__(self, num_blocks, block_size, kv_heads, head_dim, num_layers=1, dtype=torch.bfloat16, device=None, with_values=True):
+        self.num_blocks, self.block_size = num_blocks, block_size
+        shape = [num_layers, num_blocks * block_size, kv_heads, head_dim]
+        self.key_cache = torch.zeros(shape, dtype=dtype, device=device)
+        self.val_cache = torch.zeros(shape, dtype=dtype, device=device) if with_values else None
+        self.free_blocks = list(range(num_blocks - 1, -1, -1))
+        self.ref_counts = [0] * num_blocks
+        self.block_tables, self.seq_lens = {}, {}
+
+    @property
+    def num_free_blocks(self):
+        return len(self.free_blocks)
+
+    def keys(self, layer=0):
+        return self.key_cache[layer]
+
+    def values(self, layer=0):
+        return self.val_cache[layer]
+
+    def add_sequence(self, seq_id, fork_from=None):
+        """Adds an empty sequence, or one sharing all tokens of the sequence `fork_from`."""
+        assert seq_id not in self.block_tables, f"Sequence `{seq_id}` already exists in the kv cache."
+        table = list(self.block_tables[fork_from]) if fork_from is not None else []
+        for b in table:
+            self.ref_counts[b] += 1
+        self.block_tables[seq_id], self.seq_lens[seq_id] = table, (self.seq_lens[fork_from] if fork_from is not None else 0)
+
+    def free_sequence(self, seq_id):
+        for b in self.block_tables.pop(seq_id):
+            self.ref_counts[b] -= 1
+            if self.ref_counts[b] == 0:
+                self.free_blocks.append(b)
+        del self.seq_lens[seq_id]
+
+    def blocks_needed(self, seq_id, num_tokens):
+        """Returns the number of free blocks that appending `num_tokens` to the sequence takes."""
+        length, table = self.seq_lens[seq_id], self.block_tables[seq_id]
+        needed = (length + num_tokens + self.block_size - 1) // self.block_size - len(table)
+        if num_tokens > 0 and length % self.block_size != 0 and self.ref_counts[table[-1]] > 1:
+            needed += 1
+        return needed
+
+    def _allocate(self):
+        b = self.free_blocks.pop()
+        self.ref_counts[b] = 1
+        return b
+
+    def append(self, seq_id, num_tokens=1):
+        """Reserves slots for the next `num_tokens` tokens of the sequence, and returns their slot ids as int64 [num_tokens]."""
+        needed = self.blocks_needed(seq_id, num_tokens)
+        assert needed <= len(self.free_blocks), f"Kv cache is out of blocks: {needed} needed, {len(self.free_blocks)} free."
+        length, table = self.seq_lens[seq_id], self.block_tables[seq_id]
+        offset = length % self.block_size
+        if num_tokens > 0 and offset != 0 and self.ref_counts[table[-1]] > 1:
+            src, dst = table[-1] * self.block_size, self._allocate() * self.block_size
+            for cache in (self.key_cache, self.val_cache):
+                if cache is not None:
+                    cache[:, dst:dst + offset] = cache[:, src:src + offset]
+            self.ref_counts[table[-1]] -= 1
+            table[-1] = dst // self.block_size
+        while len(table) * self.block_size < length + num_tokens:
+            table.append(self._allocate())
+        self.seq_lens[seq_id] = length + num_tokens
+        positions = torch.arange(length, length + num_tokens)
+        return torch.tensor(table, dtype=torch.int64)[positions // self.block_size] * self.block_size + positions % self.block_size
+
+    def slots(self, seq_id):
+        """Returns the slot ids of all tokens of the sequence as int64 [seq_len]."""
+        table = torch.tensor(self.block_tables[seq_id], dtype=torch.int64).view(-1, 1)
+        return (table * self.block_size + torch.arange(self.block_size)).view(-1)[:self.seq_lens[seq_id]]
+
+    def kv_indices(self, seq_ids):
+        """
+          Returns (kv_indices, kv_ranges) of the sequences on the cache device: int32 slot ids of their tokens back to back,
+          and int32 [len(seq_ids) + 1] offsets where the tokens of each sequence start, i.e. a one-token page table.
+        """
+        indices = [self.slots(x) for x in seq_ids]
+        ranges = torch.tensor([0] + [x.numel() for x in indices], dtype=torch.int64).cumsum(0)
+        indices = torch.cat(indices) if indices else torch.empty([0], dtype=torch.int64)
+        return indices.to(device=self.key_cache.device, dtype=torch.int32), ranges.to(device=self.key_cache.device, dtype=torch.int32)
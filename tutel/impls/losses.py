@@ -4,12 +4,47 @@
 import torch
 from torch.distributions.normal import Normal
 
+from .expert_ops import has_native_op
+
 def _one_hot_with_dtype(data, num_classes, dtype, hot_value=1):
     result = torch.zeros([data.size(0), num_classes], device=data.device, dtype=dtype)
     result.scatter_(1, data.unsqueeze(-1), hot_value)
     return result
 
-def gshard_loss(scores_w_noise, top_ids):
+class GshardLoss(torch.autograd.Function):
+    """gshard_loss() from per-expert statistics of one native pass, whose gradient is a broadcast row of [E]."""
+    @staticmethod
+    def forward(ctx, scores, top_ids):
+        num_samples, num_global_experts = int(scores.size(0)), int(scores.size(1))
+        me, ce = torch.ops.tutel_ops.moe_gshard_loss_stats(scores.contiguous(), top_ids)
+        coef = ce * (num_global_experts / (num_samples * num_samples))
+        ctx.save_for_backward(coef)
+        ctx.shape, ctx.dtype = scores.shape, scores.dtype
+        return torch.sum(me * coef).to(scores.dtype)
+
+    @staticmethod
+    def backward(ctx, grad):
+        coef, = ctx.saved_tensors
+        return (coef * grad.float()).to(ctx.dtype).expand(ctx.shape), None
+
+class LoadImportanceStats(torch.autograd.Function):
+    """[2, E] of per-expert importance and load, with the load CDF computed inline by one native pass over the scores."""
+    @staticmethod
+    def forward(ctx, scores, threshold, sigma):
+        scores, threshold = scores.contiguous(), threshold.float().contiguous()
+        ctx.save_for_backward(scores, threshold)
+        ctx.sigma = sigma
+        return torch.ops.tutel_ops.moe_load_importance_stats(scores, threshold, sigma)
+
+    @staticmethod
+    def backward(ctx, grad_stats):
+        scores, threshold = ctx.saved_tensors
+        grad_scores, grad_threshold = torch.ops.tutel_ops.moe_load_importance_backward(scores, threshold, ctx.sigma, grad_stats)
+        return grad_scores, grad_threshold, None
+
+def gshard_loss(scores_w_noise, top_ids, deterministic=False):
+    if has_native_op('moe_gshard_loss_stats', scores_w_noise, force=deterministic) and scores_w_noise.dim() == 2:
+        return GshardLoss.apply(scores_w_noise, top_ids)
     num_samples, num_global_experts = int(scores_w_noise.size(0)), int(scores_w_noise.size(1))
     mask = _one_hot_with_dtype(top_ids[:, 0], num_global_experts, dtype=scores_w_noise.dtype,
         hot_value=num_global_experts / num_samples)
@@ -18,7 +53,14 @@ def gshard_loss(scores_w_noise, top_ids):
     l_aux = torch.sum(me * ce) / num_samples
     return l_aux
 
-def load_importance_loss(scores_wo_noise, topk_logits, num_global_experts, gate_noise):
+def load_importance_loss(scores_wo_noise, topk_logits, num_global_experts, gate_noise, deterministic=False):
+    if has_native_op('moe_load_importance_stats', scores_wo_noise, force=deterministic) and scores_wo_noise.dim() == 2:
+        assert gate_noise > 0, "`gate_noise` must be > 0 for normalization in load_importance_loss()."
+        Impi, Load = LoadImportanceStats.apply(scores_wo_noise, topk_logits[:, -1], gate_noise / num_global_experts)
+        l_imp = Impi.var() / (Impi.mean() ** 2 + 1e-10)
+        l_load = Load.var() / (Load.mean() ** 2 + 1e-10)
+        return (l_imp + l_load) / 2.0
+
     def load_loss(scores_wo_noise, topk_logits, num_global_experts, gate_noise):
         assert gate_noise > 0, "`gate_noise` must be > 0 for normalization in load_importance_loss()."
         normal = Normal(
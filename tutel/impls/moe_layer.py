@@ -7,6 +7,7 @@ import copy
 import os
 import re
 import time
+import types
 import logging 
 import collections
 import importlib
@@ -19,8 +20,11 @@ from torch.nn import ModuleList
 import torch.nn.functional as F
 
 from ..impls import communicate as C
-from ..impls.fast_dispatch import fast_encode, fast_decode, extract_critical, get_dispatch_count
+from ..impls import expert_ops
+from ..gates.top import LinearTopKGate
+from ..impls.fast_dispatch import fast_encode, fast_decode, extract_critical, fused_gate_topk, get_dispatch_count
 from ..impls.overlap import a2a_ffn_overlap_forward
+from ..impls.replication import HotExpertReplicator
 from . import losses
 
 
@@ -99,6 +103,11 @@ class MOELayer(torch.nn.Module):
         is_gshard_loss=True,
         parallel_type='adaptive:1',
         use_2dh=False,
+        a2a_compression=None,
+        recompute=None,
+        replicate_hot_experts=0,
+        shared_experts=None,
+        deterministic=False,
         **kwargs
     ):
         super().__init__()
@@ -152,9 +161,16 @@ class MOELayer(torch.nn.Module):
             self.batch_prioritized_routing = True
         self.normalize_gate = normalize_gate
         self.is_gshard_loss = is_gshard_loss
+        self.deterministic = deterministic
 
         self.a2a_ffn_overlap_degree = a2a_ffn_overlap_degree
         self.use_2dh = use_2dh
+        self.a2a_compression = a2a_compression or None
+        assert self.a2a_compression in (None, 'fp8', 'int8'), "Unrecognized a2a_compression type: %s" % a2a_compression
+        # Both recompute from expert inputs and gathered params, replaying nothing before them (dispatch, all_to_all, gathers):
+        # 'expert_hidden' recomputes fc1 and activation in backward, 'full' recomputes fc1, activation and fc2.
+        self.recompute = recompute or None
+        assert self.recompute in (None, 'expert_hidden', 'full'), "Unrecognized recompute type: %s" % recompute
 
         if seeds is not None and seeds[1] is not None:
             torch.manual_seed(seeds[1])
@@ -234,6 +250,27 @@ class MOELayer(torch.nn.Module):
         if seeds is not None and len(seeds) > 2 and seeds[2] is not None:
             torch.manual_seed(seeds[2])
 
+        # Always-on experts replicated on every device, e.g. {'type': 'ffn', 'hidden_size_per_expert': ..}, or a module mapping [samples, model_dim]
+        self.shared_experts, self.shared_ctx, self.shared_combine_inplace = None, None, False
+        if isinstance(shared_experts, torch.nn.Module):
+            self.shared_experts = shared_experts
+        elif shared_experts is not None:
+            shared_experts = dict(shared_experts)
+            shared_type = shared_experts.pop('type')
+            assert re.match(r'[a-zA-Z0-9\_]+', shared_type), "Expert type must only include digits, letters and underline characters."
+            shared_experts.update({'model_dim': self.model_dim, 'num_experts_per_device': 1, 'sharded_count': 1})
+            self.shared_experts = importlib.import_module(f'...experts.{shared_type}', __name__).ExpertModule(**shared_experts)
+            # Outputs of these end with a matmul or addition that doesn't save them for backward, so that routed outputs may combine into them
+            self.shared_combine_inplace = shared_type in ('ffn', 'llama_ffn')
+            self.shared_ctx = types.SimpleNamespace(group=self.group, world_size=self.world_size, model_dim=self.model_dim, num_global_experts=1,
+                sharded_count=1, adaptive_degree=1, megablocks_size=0, dispatch_count=None, recompute=self.recompute)
+
+        self.replicator = None
+        if replicate_hot_experts > 0 and self.world_size > 1:
+            assert self.sharded_count == 1 and self.adaptive_degree != 0, "Replicating hot experts requires each expert to be owned by a single device."
+            assert all(p.size(0) == self.num_local_experts for p in self.experts.parameters()), "Replicating hot experts requires all expert params to be batched over local experts."
+            self.replicator = HotExpertReplicator(self.num_local_experts, self.world_size, replicate_hot_experts, self.group)
+
     def extra_repr(self):
         return 'Top-K(s) = %s, Total-Experts = %d [managed by %d device(s)],' % (
             [f'k={x.top_k}, noise={x.gate_noise}' for x in self.gates],
@@ -246,14 +283,42 @@ class MOELayer(torch.nn.Module):
             return self.gates.named_parameters()
         elif param_type == 'local_experts':
             return self.experts.named_parameters()
+        elif param_type == 'shared_experts':
+            return self.shared_experts.named_parameters() if self.shared_experts is not None else iter([])
         else:
-            raise Exception("Specified parameter type is not recognized: %s. Valid `param_type` includes: gate, local_experts." % param_type)
-
-    def expert_local(self, x, reserve_shape):
-        y = self.experts(x.view(x.size(0), x.size(1), *reserve_shape), self)
+            raise Exception("Specified parameter type is not recognized: %s. Valid `param_type` includes: gate, local_experts, shared_experts." % param_type)
+
+    def expert_local(self, x, reserve_shape, replica_experts=None):
+        experts = self.experts
+        if replica_experts is not None:
+            # Own experts are followed by replica slots, which run the same module over fetched replica params,
+            # while replica slots left unused by the plan receive no tokens and only produce zeros
+            replica_params = self.replicator.replica_params(self.experts.named_parameters(), replica_experts)
+            num_local_experts, num_used = self.num_local_experts, self.replicator.num_used_slots(replica_experts)
+
+            def experts(x, ctx):
+                y = self.experts(x[:num_local_experts], ctx)
+                ys = [y]
+                if num_used > 0:
+                    ys.append(torch.func.functional_call(self.experts, replica_params, (x[num_local_experts:num_local_experts + num_used], ctx)))
+                if num_used < self.replicator.slots_per_rank:
+                    ys.append(y.new_zeros([self.replicator.slots_per_rank - num_used] + list(y.shape[1:])))
+                return torch.cat(ys)
+        # Built-in experts checkpoint their own compute after param gathers, other experts are checkpointed as a whole
+        if self.recompute and torch.is_grad_enabled() and not getattr(self.experts, 'handles_recompute', False):
+            y = expert_ops.checkpoint(lambda x: experts(x.view(x.size(0), x.size(1), *reserve_shape), self), x)
+        else:
+            y = experts(x.view(x.size(0), x.size(1), *reserve_shape), self)
         self.protected_shape = y.shape
         return y.reshape(y.size(0), y.size(1), -1)
 
+    def shared_expert_local(self, x, reserve_shape):
+        if self.shared_ctx is None:
+            y = self.shared_experts(x)
+        else:
+            y = self.shared_experts(x.view(1, x.size(0), *reserve_shape), self.shared_ctx)
+        return y.reshape(x.size(0), -1)
+
     def forward(self, input: Tensor, gate_index=0, capacity_factor=None, top_k=None, a2a_ffn_overlap_degree=None, reserve_dims=1, inequivalent_tokens=False, adaptive_r=None, megablocks_size=0):
         if self.skip_moe:
             result_output = input
@@ -281,28 +346,41 @@ class MOELayer(torch.nn.Module):
             if self.num_local_experts <= 1 or torch.is_grad_enabled() or self.world_size > 1:
                 megablocks_size = 0
 
-        def routing():
-            logits = gctx(x)
+        # Tokens are only dispatched to expert slots including replica slots once the plan places any replica
+        if self.replicator is not None and self.replicator.has_replicas:
+            replica_plan = (self.replicator.expert_slots, self.replicator.replica_experts)
+        else:
+            replica_plan = (None, None)
 
-            if self.training and gctx.gate_noise > 0:
-                logits_w_noise = logits + gctx.gate_noise * torch.randn_like(logits) / self.num_global_experts
+        def routing():
+            routed, _loss_fn = None, None
+            if self.is_gshard_loss and not (self.training and gctx.gate_noise > 0) and type(gctx) is LinearTopKGate and expert_ops.has_native_op('moe_gate_topk', x, force=self.deterministic):
+                wg = gctx.wg.float() if gctx.fp32_gate else gctx.wg
+                logits_dtype = wg.weight.dtype
+                scores, routed = fused_gate_topk(x, wg.weight, top_k)
             else:
-                logits_w_noise = logits
+                logits = gctx(x)
+                logits_dtype = logits.dtype
 
-            scores = F.softmax(logits_w_noise, dim=1)
-            if self.is_gshard_loss:
-                _loss_fn = lambda gates, topk_ids: losses.gshard_loss(gates, topk_ids)
-            else:
-                _loss_fn = lambda gates, topk_ids: losses.load_importance_loss(
-                    F.softmax(logits, dim=1), logits_w_noise.gather(index=topk_ids, dim=1),
-                    self.num_global_experts, gctx.gate_noise)
+                if self.training and gctx.gate_noise > 0:
+                    logits_w_noise = logits + gctx.gate_noise * torch.randn_like(logits) / self.num_global_experts
+                else:
+                    logits_w_noise = logits
+
+                scores = F.softmax(logits_w_noise, dim=1)
+                if self.is_gshard_loss:
+                    _loss_fn = lambda gates, topk_ids: losses.gshard_loss(gates, topk_ids, deterministic=self.deterministic)
+                else:
+                    _loss_fn = lambda gates, topk_ids: losses.load_importance_loss(
+                        F.softmax(logits, dim=1), logits_w_noise.gather(index=topk_ids, dim=1),
+                        self.num_global_experts, gctx.gate_noise, deterministic=self.deterministic)
 
             mega_up = max(megablocks_size, 1)
             alignment = (self.sharded_count * a2a_ffn_overlap_degree + mega_up - 1) // mega_up * mega_up
             if alignment > 256:
                 alignment = (alignment + 127) // 128 * 128
 
-            return logits.dtype, extract_critical(scores,
+            return logits_dtype, extract_critical(scores,
                 top_k = top_k,
                 loss_fn = _loss_fn,
                 capacity_factor = capacity_factor if capacity_factor is not None else gctx.capacity_factor,
@@ -311,6 +389,11 @@ class MOELayer(torch.nn.Module):
                 group = self.group,
                 alignment = alignment,
                 inequivalent_tokens = inequivalent_tokens,
+                expert_slots = replica_plan[0],
+                num_expert_slots = self.replicator.num_slots if replica_plan[0] is not None else 0,
+                routed = routed,
+                expert_choice = getattr(gctx, 'expert_choice', False),
+                deterministic = self.deterministic,
             )
 
 
@@ -326,39 +409,60 @@ class MOELayer(torch.nn.Module):
 
         self.megablocks_size = megablocks_size
         self.dispatch_count = get_dispatch_count(crit)
-        y = fast_encode(x.to(logits_dtype), crit, self.is_postscore).to(x.dtype)
 
         if adaptive_r is not None:
             self.adaptive_degree = adaptive_r
 
-        if self.adaptive_degree == 0:
-            y = self.expert_local(y, original_shape[-reserve_dims:])
-        else:
-            if self.auto_parallel:
-                self.use_model_parallel = (y.numel() * (self.sharded_count - 1) * 2 < sum([x.numel() for x in self.experts.parameters()]))
-
-            if self.num_global_experts < self.world_size:
-                if self.use_model_parallel:
-                    y = y.repeat(1, self.adaptive_degree, 1).view(self.world_size, -1, y.size(2))
-                else:
-                    y = y.view(self.world_size, -1, y.size(2))
+        def dispatch_and_compute(x):
+            y = fast_encode(x.to(logits_dtype), crit, self.is_postscore).to(x.dtype)
+            shared_y = None
 
-            if a2a_ffn_overlap_degree > 1 and y.is_cuda:
-                def expert_fn(expert_input):
-                    return self.expert_local(expert_input, original_shape[-reserve_dims:])
-                y = a2a_ffn_overlap_forward(y, expert_fn=expert_fn, a2a_ffn_overlap_degree=a2a_ffn_overlap_degree, use_2dh=self.use_2dh, group=self.group)
-            else:
-                y = C.all_to_all(y, 1, 0, use_2dh=self.use_2dh, group=self.group)
+            if self.adaptive_degree == 0:
                 y = self.expert_local(y, original_shape[-reserve_dims:])
-                y = C.all_to_all(y, 0, 1, use_2dh=self.use_2dh, group=self.group)
-
-            if self.num_global_experts < self.world_size:
-                if self.use_model_parallel:
-                    y = torch.sum(y.view(self.num_global_experts, self.adaptive_degree, -1, y.size(2)), dim=1)
+            else:
+                if self.auto_parallel:
+                    self.use_model_parallel = (y.numel() * (self.sharded_count - 1) * 2 < sum([x.numel() for x in self.experts.parameters()]))
+
+                if self.num_global_experts < self.world_size:
+                    if self.use_model_parallel:
+                        y = y.repeat(1, self.adaptive_degree, 1).view(self.world_size, -1, y.size(2))
+                    else:
+                        y = y.view(self.world_size, -1, y.size(2))
+
+                if a2a_ffn_overlap_degree > 1 and y.is_cuda and not self.a2a_compression:
+                    def expert_fn(expert_input):
+                        return self.expert_local(expert_input, original_shape[-reserve_dims:], replica_plan[1])
+                    y = a2a_ffn_overlap_forward(y, expert_fn=expert_fn, a2a_ffn_overlap_degree=a2a_ffn_overlap_degree, use_2dh=self.use_2dh, group=self.group)
+                elif self.shared_experts is not None and not self.use_2dh:
+                    # Shared experts compute local tokens while routed tokens are in flight
+                    f_a2a = C.all_to_all(y, 1, 0, background=True, group=self.group, compression=self.a2a_compression)
+                    shared_y = self.shared_expert_local(x, original_shape[-reserve_dims:])
+                    y = self.expert_local(f_a2a(), original_shape[-reserve_dims:], replica_plan[1])
+                    y = C.all_to_all(y, 0, 1, use_2dh=self.use_2dh, group=self.group, compression=self.a2a_compression)
                 else:
-                    y = y.view(self.num_global_experts, -1, y.size(2))
-
-        y = fast_decode(y.to(logits_dtype), crit, self.is_postscore)
+                    y = C.all_to_all(y, 1, 0, use_2dh=self.use_2dh, group=self.group, compression=self.a2a_compression)
+                    y = self.expert_local(y, original_shape[-reserve_dims:], replica_plan[1])
+                    y = C.all_to_all(y, 0, 1, use_2dh=self.use_2dh, group=self.group, compression=self.a2a_compression)
+
+                if self.num_global_experts < self.world_size:
+                    if self.use_model_parallel:
+                        y = torch.sum(y.view(self.num_global_experts, self.adaptive_degree, -1, y.size(2)), dim=1)
+                    else:
+                        y = y.view(self.num_global_experts, -1, y.size(2))
+
+            if self.shared_experts is None:
+                return fast_decode(y.to(logits_dtype), crit, self.is_postscore)
+            if shared_y is None:
+                shared_y = self.shared_expert_local(x, original_shape[-reserve_dims:])
+            if not expert_ops.TUTEL_FUSED_EXPERTS or not self.shared_combine_inplace:
+                return fast_decode(y.to(logits_dtype), crit, self.is_postscore) + shared_y.to(logits_dtype)
+            # Routed outputs are combined on top of shared outputs, saving a separate output and addition
+            return fast_decode(y.to(logits_dtype), crit, self.is_postscore, residual=shared_y.to(logits_dtype))
+
+        y = dispatch_and_compute(x)
+
+        if self.replicator is not None:
+            self.replicator.update(self.dispatch_count, *replica_plan)
 
         y = y.view(list(original_shape[:-reserve_dims]) + list(self.protected_shape[-reserve_dims:])).to(original_dtype)
         self.l_aux = y.l_aux = l_aux
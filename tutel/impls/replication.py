@@ -0,0 +1,143 @@
+# Copyright (c) Microsoft Corporation.
+# Licensed under the MIT license.
+
+import torch
+import torch.distributed as dist
+
+from ..impls import communicate as C
+
+
+def plan_replicas(load, num_local_experts, world_size, num_hot_experts, slots_per_rank):
+    """
+      Greedily gives each of the `num_hot_experts` most loaded experts one replica on the least loaded device
+      with a free replica slot, as long as moving half of its tokens there lowers the load of the owner below it.
+      Returns (expert_slots, replica_experts): expert_slots[g] holds the two slots tokens of expert g alternate between,
+      replica_experts[r * slots_per_rank + i] is the expert served by replica slot i of device r, or -1.
+    """
+    num_slots_per_rank = num_local_experts + slots_per_rank
+    experts = torch.arange(load.numel())
+    own_slots = experts // num_local_experts * num_slots_per_rank + experts % num_local_experts
+    expert_slots = torch.stack([own_slots, own_slots], dim=1)
+    replica_experts = [-1] * (world_size * slots_per_rank)
+
+    load = load.double().cpu()
+    rank_load, used = load.view(world_size, num_local_experts).sum(dim=1).tolist(), [0] * world_size
+    for g in load.argsort(descending=True)[:num_hot_experts].tolist():
+        owner, half = g // num_local_experts, float(load[g]) / 2
+        candidates = [r for r in range(world_size) if r != owner and used[r] < slots_per_rank]
+        if not candidates or half <= 0:
+            continue
+        r = min(candidates, key=lambda r: rank_load[r])
+        if rank_load[r] + half >= rank_load[owner]:
+            continue
+        expert_slots[g, 1] = r * num_slots_per_rank + num_local_experts + used[r]
+        replica_experts[r * slots_per_rank + used[r]] = g
+        rank_load[owner], rank_load[r], used[r] = rank_load[owner] - half, rank_load[r] + half, used[r] + 1
+    return expert_slots, replica_experts
+
+
+def _replica_transfers(replica_experts, num_local_experts, slots_per_rank, group):
+    # (local expert id on owner, replica slot id on receiver, owner global rank, receiver global rank, role of this device)
+    rank = C.get_world_rank(group)
+    global_rank = lambda r: r if group is None or group is dist.group.WORLD else dist.get_global_rank(group, r)
+    for i, g in enumerate(replica_experts):
+        if g < 0:
+            continue
+        owner, receiver = g // num_local_experts, i // slots_per_rank
+        if rank in (owner, receiver):
+            yield g % num_local_experts, i % slots_per_rank, global_rank(owner), global_rank(receiver), rank == owner
+
+
+class ReplicaFetch(torch.autograd.Function):
+    """
+      Sends the weights of replicated experts from their owners to the devices serving the replicas,
+      and reduces replica gradients back into the owner's weights in backward.
+    """
+    @staticmethod
+    def forward(ctx, param: torch.Tensor, replica_experts, num_local_experts, slots_per_rank, group):
+        ctx.replica_experts, ctx.num_local_experts, ctx.slots_per_rank, ctx.group = replica_experts, num_local_experts, slots_per_rank, group
+        output = param.new_zeros([slots_per_rank] + list(param.shape[1:]))
+        ops = []
+        for local_id, slot_id, owner, receiver, is_owner in _replica_transfers(replica_experts, num_local_experts, slots_per_rank, group):
+            if is_owner:
+                ops.append(dist.P2POp(dist.isend, param[local_id].detach().contiguous(), receiver, group))
+            else:
+                ops.append(dist.P2POp(dist.irecv, output[slot_id], owner, group))
+        for req in (dist.batch_isend_irecv(ops) if ops else []):
+            req.wait()
+        return output
+
+    @staticmethod
+    def backward(ctx, grad_output: torch.Tensor):
+        grad_output = grad_output.contiguous()
+        grad_param = grad_output.new_zeros([ctx.num_local_experts] + list(grad_output.shape[1:]))
+        ops, received = [], []
+        for local_id, slot_id, owner, receiver, is_owner in _replica_transfers(ctx.replica_experts, ctx.num_local_experts, ctx.slots_per_rank, ctx.group):
+            if is_owner:
+                received.append((local_id, torch.empty_like(grad_output[0])))
+                ops.append(dist.P2POp(dist.irecv, received[-1][1], receiver, ctx.group))
+            else:
+                ops.append(dist.P2POp(dist.isend, grad_output[slot_id], owner, ctx.group))
+        for req in (dist.batch_isend_irecv(ops) if ops else []):
+            req.wait()
+        for local_id, grad in received:
+            grad_param[local_id] += grad
+        return grad_param, None, None, None, None
+
+
+class HotExpertReplicator:
+    """
+      Tracks the per-expert load over the group, and places one replica of each of the `num_hot_experts` hottest
+      experts on under-loaded devices. Device r serves `num_local_experts + slots_per_rank` expert slots: its own
+      experts followed by replica slots, and routing alternates the tokens of a replicated expert between both copies.
+    """
+    def __init__(self, num_local_experts, world_size, num_hot_experts, group, load_decay=0.9):
+        self.num_local_experts, self.world_size, self.num_hot_experts, self.group = num_local_experts, world_size, num_hot_experts, group
+        self.slots_per_rank = (num_hot_experts + world_size - 1) // world_size
+        self.num_slots = world_size * (num_local_experts + self.slots_per_rank)
+        self.load_decay = load_decay
+        self.load = torch.zeros([num_local_experts * world_size], dtype=torch.float64)
+        self.expert_slots, self.replica_experts = plan_replicas(self.load, num_local_experts, world_size, 0, self.slots_per_rank)
+        self.cache = None
+
+    @property
+    def has_replicas(self):
+        return any(g >= 0 for g in self.replica_experts)
+
+    def num_used_slots(self, replica_experts):
+        """Returns the number of replica slots in use on this device, which are always its first ones."""
+        rank = C.get_world_rank(self.group)
+        return sum(g >= 0 for g in replica_experts[rank * self.slots_per_rank:(rank + 1) * self.slots_per_rank])
+
+    def update(self, dispatch_count, expert_slots, replica_experts):
+        """Accumulates the load of a step routed with the given plan (None if without replicas), then re-plans replicas for the next step."""
+        counts = getattr(dispatch_count, 'global_counts', None)
+        assert counts is not None, "Replicating hot experts requires dropless top-k routing (capacity_factor <= 0)."
+        counts = counts.to(torch.float64).sum(dim=0).cpu()
+        if expert_slots is None:
+            load = counts
+        else:
+            slot_experts = torch.full([self.num_slots], -1, dtype=torch.int64)
+            slot_experts[expert_slots[:, 0]] = torch.arange(expert_slots.size(0))
+            for i, g in enumerate(replica_experts):
+                if g >= 0:
+                    slot_experts[i // self.slots_per_rank * (self.num_local_experts + self.slots_per_rank) + self.num_local_experts + i % self.slots_per_rank] = g
+            valid = slot_experts >= 0
+            load = torch.zeros_like(self.load).index_add_(0, slot_experts[valid], counts[valid])
+        self.load = self.load * self.load_decay + load
+
+        new_slots, new_replicas = plan_replicas(self.load, self.num_local_experts, self.world_size, self.num_hot_experts, self.slots_per_rank)
+        if new_replicas != self.replica_experts:
+            self.expert_slots, self.replica_experts = new_slots, new_replicas
+
+    def replica_params(self, named_params, replica_experts):
+        """Returns {name: [num_used_slots, ..]} of the expert params served by the replica slots in use on this device."""
+        named_params, num_used = list(named_params), self.num_used_slots(replica_experts)
+        fetch = lambda p: ReplicaFetch.apply(p, replica_experts, self.num_local_experts, self.slots_per_rank, self.group)[:num_used]
+        if torch.is_grad_enabled() and any(p.requires_grad for _, p in named_params):
+            return {n: fetch(p) for n, p in named_params}
+        # Without autograd, replicas are only re-sent after a re-plan or a weight update.
+        key = (tuple(replica_experts), tuple((id(p), p._version) for _, p in named_params))
+        if self.cache is None or self.cache[0] != key:
+            self.cache = (key, {n: fetch(p) for n, p in named_params})
+        return self.cache[1]
@@ -64,6 +64,27 @@ def create_backward_data(param_dtype, is_cuda=True):
   ''')
 
 
+def create_combine_data(param_dtype, is_cuda=True):
+  if not is_cuda:
+    return JitCompiler.generate_cpu_kernel(kernel_type=3)
+
+  return JitCompiler.generate_kernel({'dtype': get_kernel_dtype(param_dtype), 'IS_FLOAT': 1 if param_dtype == torch.float32 else 0}, '''
+    #define __dtype @dtype@
+
+    extern "C" __global__ __launch_bounds__(1024) void execute(__dtype* __restrict__ gates1_s, int* __restrict__ indices1_s, int* __restrict__ locations1_s, __dtype* __restrict__ combined_output, __dtype* __restrict__ expert_output, int samples, int hidden, int capacity) {
+      // [thread_extent] blockIdx.x = 512
+      // [thread_extent] threadIdx.x = 1024
+
+      for (int i = blockIdx.x; i < samples; i += gridDim.x)
+          if (locations1_s[i] < capacity && indices1_s[i] >= 0) {
+              #pragma unroll
+              for (int j = threadIdx.x; j < hidden; j += 1024)
+                  combined_output[i * hidden + j] = combined_output[i * hidden + j] + gates1_s[i] * expert_output[(indices1_s[i] * capacity + locations1_s[i]) * (hidden) + j];
+          }
+    }
+  ''')
+
+
 def create_backward_gate(param_dtype, is_cuda=True):
   if not is_cuda:
     return JitCompiler.generate_cpu_kernel(kernel_type=2)
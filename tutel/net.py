@@ -2,14 +2,20 @@
 # Licensed under the MIT license.
 
 import logging
+import contextlib
 
-from .impls.communicate import get_world_size, get_world_rank, create_groups_from_world, create_standalone_group, barrier
+import torch
+import torch.distributed as dist
+
+from .impls.communicate import get_world_size, get_world_rank, create_groups_from_world, create_standalone_group, get_group_from_ranks, barrier
 # Communication without Backward Compute
 from .impls.communicate import simple_broadcast, simple_all_reduce, simple_all_to_all,simple_split, simple_reduce_scatter, simple_all_gather
 # Communication with Backward Compute
 from .impls.communicate import all_to_all, all_to_all_single, all_gather, zero_gather, zero_scatter, spatial_split, reduce_scatter, allreduce_forward, allreduce_backward
 # Communication with Batch-based Compute
 from .impls.communicate import batch_all_to_all_v, batch_all_gather_v
+# Asynchronous Prefetch of Sharded Params
+from .impls.communicate import zero_gather_prefetch, zero_gather_synchronize_grads
 
 
 class TutelDistributedOptimizer:
@@ -56,3 +62,126 @@ class TutelDistributedOptimizer:
         self.chunk_grad()
         self.local_optim.step()
         self.restore()
+
+
+class GradientSynchronizer:
+    """
+      Average grads of shared params over `group` in flat buckets of at most `bucket_size_mb`.
+      Each bucket starts an asynchronous all_reduce once all its grads are accumulated in backward,
+      and synchronize() launches the remaining buckets and copies all results back to `param.grad`.
+      Every rank in the group must call synchronize() after each backward it doesn't run under no_sync(),
+      even if it produced no grads, and ranks must agree on which backwards run under no_sync().
+
+      Expert params (tagged `_tutel_expert` by MOELayer, or `skip_allreduce`) are excluded, since their
+      grads are either owned by local experts, or already reduced within sharded groups by zero_gather.
+      If `expert_group` is specified (e.g. data_group of replicated experts), expert grads are averaged over it instead.
+    """
+    class Bucket:
+        def __init__(self, params, group):
+            self.params, self.group = params, group
+            self.offsets = [0]
+            for p in params:
+                self.offsets.append(self.offsets[-1] + p.numel())
+            self.buffer = torch.zeros([self.offsets[-1]], dtype=params[0].dtype, device=params[0].device)
+            self.reset()
+
+        def reset(self):
+            self.pending, self.ready, self.future_op = len(self.params), set(), None
+
+    def __init__(self, params, group=None, bucket_size_mb=25, expert_group=None):
+        self.group = group
+        self.enabled = True
+        self.buckets, self.handles, self.param_buckets = [], [], {}
+        bucket_bytes = max(int(bucket_size_mb * 1024 * 1024), 1)
+
+        params = [x for x in params if x.requires_grad]
+        shared_params = [x for x in params if not hasattr(x, '_tutel_expert') and not hasattr(x, 'skip_allreduce')]
+        expert_params = [x for x in params if hasattr(x, '_tutel_expert') or hasattr(x, 'skip_allreduce')]
+        candidates = [(shared_params, group)] + ([(expert_params, expert_group)] if expert_group is not None else [])
+
+        # Grads are mostly produced in reverse order of registration, so buckets are filled from the tail.
+        for params, group in candidates:
+            if get_world_size(group) == 1:
+                continue
+            buckets, sizes = {}, {}
+            for p in reversed(params):
+                key, nbytes = (p.dtype, p.device), p.numel() * p.element_size()
+                if key in buckets and sizes[key] + nbytes > bucket_bytes:
+                    self.buckets.append(GradientSynchronizer.Bucket(buckets.pop(key), group))
+                    sizes.pop(key)
+                buckets.setdefault(key, []).append(p)
+                sizes[key] = sizes.get(key, 0) + nbytes
+            for key in buckets:
+                self.buckets.append(GradientSynchronizer.Bucket(buckets[key], group))
+
+        for i, bucket in enumerate(self.buckets):
+            for j, p in enumerate(bucket.params):
+                self.param_buckets[p] = (i, j)
+                self.handles.append(self._register_hook(p))
+        self.next_bucket = 0
+
+    def _register_hook(self, param):
+        if hasattr(param, 'register_post_accumulate_grad_hook'):
+            return param.register_post_accumulate_grad_hook(self._on_grad_ready)
+        grad_acc = param.expand_as(param).grad_fn.next_functions[0][0]
+        handle = grad_acc.register_hook(lambda *args: self._on_grad_ready(param))
+        handle.grad_acc = grad_acc
+        return handle
+
+    def _on_grad_ready(self, param):
+        if not self.enabled or param.grad is None:
+            return
+        i, j = self.param_buckets[param]
+        bucket = self.buckets[i]
+        if j in bucket.ready:
+            return
+        bucket.buffer[bucket.offsets[j]:bucket.offsets[j + 1]].copy_(param.grad.view(-1))
+        bucket.ready.add(j)
+        bucket.pending -= 1
+        self._launch_ready_buckets()
+
+    def _launch_ready_buckets(self):
+        # Buckets are always launched in the same index order, so that collectives are matched across ranks.
+        while self.next_bucket < len(self.buckets) and self.buckets[self.next_bucket].pending == 0:
+            bucket = self.buckets[self.next_bucket]
+            bucket.buffer.div_(get_world_size(bucket.group))
+            bucket.future_op = dist.all_reduce(bucket.buffer, group=bucket.group, async_op=True)
+            self.next_bucket += 1
+
+    def synchronize(self):
+        """Launch the remaining buckets (params without grads in this backward contribute zeros), and wait for all of them."""
+        if not self.enabled:
+            return
+        for bucket in self.buckets[self.next_bucket:]:
+            for j in range(len(bucket.params)):
+                if j not in bucket.ready:
+                    bucket.buffer[bucket.offsets[j]:bucket.offsets[j + 1]].zero_()
+            bucket.pending = 0
+        self._launch_ready_buckets()
+
+        for bucket in self.buckets:
+            if bucket.future_op is None:
+                continue
+            bucket.future_op.wait()
+            for j, p in enumerate(bucket.params):
+                grad = bucket.buffer[bucket.offsets[j]:bucket.offsets[j + 1]].view_as(p)
+                if p.grad is None:
+                    p.grad = grad.clone()
+                else:
+                    p.grad.copy_(grad)
+            bucket.reset()
+        self.next_bucket = 0
+
+    @contextlib.contextmanager
+    def no_sync(self):
+        """Skip synchronization within this context, e.g. for gradient accumulation steps."""
+        enabled, self.enabled = self.enabled, False
+        try:
+            yield
+        finally:
+            self.enabled = enabled
+
+    def remove(self):
+        for handle in self.handles:
+            handle.remove()
+        self.handles = []
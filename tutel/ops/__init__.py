@@ -2,6 +2,7 @@
 # Licensed under the MIT license.
 
 import os
+import functools
 import torch
 import tutel_custom_kernel
 
@@ -14,6 +15,13 @@ if 'OP_LOADER' not in os.environ:
         suffix = 'rocm'
     os.environ['OP_LOADER'] = os.path.join(os.path.dirname(os.path.abspath(__file__)), suffix)
 
+TUTEL_NATIVE_QUANT = int(os.environ.get('TUTEL_NATIVE_QUANT', 1)) > 0
+
+def _has_native_quant(name, x, dtype=None):
+  if dtype is not None and dtype not in (torch.float32, torch.bfloat16, torch.float16):
+    return False
+  return TUTEL_NATIVE_QUANT and not x.is_cuda and hasattr(torch.ops.tutel_ops, name)
+
 def pad_at_dim(x, dim, new_size):
   padded_shape = list(x.shape)
   if padded_shape[dim] == new_size:
@@ -27,6 +35,10 @@ def pad_at_dim(x, dim, new_size):
 def to_float8_rowwise(
     x: torch.Tensor, dim=-1, dtype: torch.dtype = torch.float8_e4m3fn, max_scale=None
 ):
+    if dtype == torch.float8_e4m3fn and dim in (-1, x.dim() - 1) and _has_native_quant('to_float8_rowwise', x, x.dtype):
+        x_scl_sat, scale_inv = torch.ops.tutel_ops.to_float8_rowwise(x, max_scale if max_scale is not None else 224.0)
+        x_scl_sat.scale_inv = scale_inv
+        return x_scl_sat
     # sum_val = x.float().sum(dim=dim, keepdim=True) / x.size(dim)
     # x = x - sum_val
     min_val, max_val = x.aminmax(dim=dim, keepdim=True)
@@ -44,6 +56,8 @@ def to_float8_rowwise(
 def to_float8_blockwise(w, block_size=128):
   shape = w.shape
   assert w.dim() in (2, 3)
+  if _has_native_quant('to_float8_blockwise', w, w.dtype):
+    return tuple(torch.ops.tutel_ops.to_float8_blockwise(w, block_size))
   if w.dim() == 2:
     w = w.unsqueeze(0)
   ws_shape = [w.size(0), (w.size(1) + block_size - 1) // block_size, (w.size(2) + block_size - 1) // block_size]
@@ -67,6 +81,8 @@ def from_float8_blockwise(w, w_scale, block_size=128, dtype=torch.bfloat16):
 
 def to_float4_groupwise(w):
   assert w.size(-1) % 16 == 0
+  if _has_native_quant('to_float4_groupwise', w, w.dtype):
+    return tuple(torch.ops.tutel_ops.to_float4_groupwise(w))
   x = w.view(-1, 16)
   scale_b = x.abs().amax(-1, keepdim=True).float() / 6
   scale_b = torch.where(scale_b > 1e-4, scale_b, 1e-4).to(scale_b.dtype)
@@ -79,6 +95,8 @@ def to_float4_groupwise(w):
 
 def from_float4_groupwise(w, scale, scale_o=None, input_scale=None, dtype=torch.bfloat16):
   assert w.dtype == torch.uint8
+  if _has_native_quant('from_float4_groupwise', w, dtype) and (scale_o is None or w.dim() >= 2):
+    return torch.ops.tutel_ops.from_float4_groupwise(w.contiguous(), scale.contiguous(), scale_o, dtype)
   fp4_e2m1_table = torch.tensor([0, 0.5, 1, 1.5, 2, 3, 4, 6, -0, -0.5, -1, -1.5, -2, -3, -4, -6], dtype=torch.bfloat16, device=w.device)
   w = w.to(torch.int16)
   w = ((w & 15) + ((w >> 4) << 8)).view(torch.int8).to(torch.int32)
@@ -121,7 +139,9 @@ def from_mxfp4(p):
 
 import numpy as np
 
-def marlin_pack(w_unpacked):
+def marlin_pack(w_unpacked, out=None):
+    if _has_native_quant('marlin_pack_fp4', w_unpacked):
+        return torch.ops.tutel_ops.marlin_pack_fp4(w_unpacked.contiguous(), 0, out)
 
     def _get_marlin_perms(device):
         perm = []
@@ -178,35 +198,32 @@ def marlin_pack(w_unpacked):
     w = w.to(torch.int32)
     for i in range(8):
         marlin_weight |= (w[:, :, i::8] << (4 * i))
-    return marlin_weight
+    return marlin_weight if out is None else out.copy_(marlin_weight)
 
 
-def marlin_permute_scales(s, group_size):
+@functools.lru_cache(maxsize=None)
+def _marlin_scale_index(size_n, k_groups, group_size):
+    # all layout moves of `marlin_permute_scales()` composed into one gather index over a [size_n, k_groups] expert
+    scale_perm = [i + 8 * j for i in range(8) for j in range(8)]
+    scale_perm_single = [2 * i + j for i in range(4) for j in [0, 1, 8, 9, 16, 17, 24, 25]]
+    idx = torch.arange(size_n * k_groups, dtype=torch.int32).view(1, size_n, k_groups).transpose(1, 2)
+    if group_size < k_groups * group_size and group_size != -1:
+        idx = idx.reshape((1, -1, len(scale_perm)))[:, :, scale_perm]
+    else:
+        idx = idx.reshape((1, -1, len(scale_perm_single)))[:, :, scale_perm_single]
+    idx = idx.reshape((1, -1, size_n))
+    # 8 is the number of scale number using by one thread
+    idx = idx.view(1, idx.size(1) // 2, 2, -1, 8).permute(0, 1, 3, 2, 4).reshape(1, idx.size(1), -1)
+    # fit the layout of fp8 dequantization
+    idx = idx.view(1, -1, 4)[:, :, [0, 2, 1, 3]].view(1, idx.size(1), -1)
+    return idx.flatten()
 
-    def get_scale_perms():
-        scale_perm: list[int] = []
-        for i in range(8):
-            scale_perm.extend([i + 8 * j for j in range(8)])
-        scale_perm_single: list[int] = []
-        for i in range(4):
-            scale_perm_single.extend([2 * i + j for j in [0, 1, 8, 9, 16, 17, 24, 25]])
-        return scale_perm, scale_perm_single
+def marlin_permute_scales(s, group_size):
 
     def nvfp4_marlin_process_scales(marlin_scales):
         # convert to half first, we would convert to fp8 later
         marlin_scales = marlin_scales.to(torch.half)
 
-        # 8 is the number of scale number using by one thread
-        marlin_scales = marlin_scales.view(marlin_scales.size(0), marlin_scales.size(1) // 2, 2, -1, 8)
-        marlin_scales = marlin_scales.permute(0, 1, 3, 2, 4).reshape(
-            marlin_scales.size(0), marlin_scales.size(1) * 2, -1
-        )
-
-        # fit the layout of fp8 dequantization
-        marlin_scales = marlin_scales.view(marlin_scales.size(0), -1, 4)[:, :, [0, 2, 1, 3]].view(
-            marlin_scales.size(0), marlin_scales.size(1), -1
-        )
-
         # We assume that weight_scale (FP8-S1E4M3) is always greater
         # than or equal to 0. So we can convert
         # (weight_scale * (2 ** 7) to a special FP8-S0E5M3 format.
@@ -220,26 +237,17 @@ def marlin_permute_scales(s, group_size):
         return marlin_scales
 
     def mxfp4_marlin_process_scales(marlin_scales):
-        marlin_scales = marlin_scales.view(marlin_scales.size(0), marlin_scales.size(1) // 2, 2, -1, 8)
-        marlin_scales = marlin_scales.permute(0, 1, 3, 2, 4).reshape(
-            marlin_scales.size(0), marlin_scales.size(1) * 2, -1
-        )
-        marlin_scales = marlin_scales.view(marlin_scales.size(0), -1, 4)[:, :, [0, 2, 1, 3]].view(
-            marlin_scales.size(0), marlin_scales.size(1), -1
-        )
         marlin_scales = marlin_scales.to(torch.float8_e8m0fnu)
         return marlin_scales
 
     if group_size != 16:
       s = s.view(torch.float8_e8m0fnu)
-    s = s.transpose(1, 2).to(torch.bfloat16)
-    size_k, size_n = s.size(-2) * group_size, s.size(-1)
-    scale_perm, scale_perm_single = get_scale_perms()
-    if group_size < size_k and group_size != -1:
-        s = s.reshape((s.size(0), -1, len(scale_perm)))[:, :, scale_perm]
-    else:
-        s = s.reshape((s.size(0), -1, len(scale_perm_single)))[:, :, scale_perm_single]
-    s = s.reshape((s.size(0), -1, size_n)).contiguous()
+    E, size_n, k_groups = s.shape
+    index = _marlin_scale_index(size_n, k_groups, group_size).to(s.device)
+    # fp8 scales are gathered as bytes, since index_select() doesn't cover fp8 types
+    flat = s.reshape(E, -1)
+    flat = flat.view(torch.uint8).index_select(1, index).view(s.dtype) if flat.element_size() == 1 else flat.index_select(1, index)
+    s = flat.view(E, k_groups, size_n).to(torch.bfloat16)
     if group_size != 16:
         s = mxfp4_marlin_process_scales(s)
     else:
@@ -257,9 +265,14 @@ def marlin_nvfp4_process_global_scale(global_scale):
     exponent_bias = 2 ** (target_exponent - 1) - 2 ** (fp4_exponent - 1)
     return global_scale * (2.0 ** (exponent_bias - 7))
 
-def marlin_unpack(marlin_weight, group_size):
+def marlin_unpack(marlin_weight, group_size, out=None):
     # reverse process of `marlin_pack()`
     # group_size 32/16 for mxfp4/nvfp4
+    if _has_native_quant('marlin_unpack_fp4', marlin_weight):
+        E, K, N = marlin_weight.size(0), marlin_weight.size(1) * 16, marlin_weight.size(2) // 2
+        if K % group_size != 0:
+            raise ValueError(f"In_features ({K}) should be able to be divided by group_size ({group_size})")
+        return torch.ops.tutel_ops.marlin_unpack_fp4(marlin_weight.contiguous(), 0, out).view(E, N, K // group_size, group_size // 2)
 
     def _get_marlin_perms(device):
         perm = []
@@ -328,13 +341,15 @@ def marlin_unpack(marlin_weight, group_size):
     
     w_unpacked = pack_weight_4d(w.reshape(E, K, N))
     
-    return w_unpacked
+    return w_unpacked if out is None else out.view(w_unpacked.shape).copy_(w_unpacked)
 
-def marlin_nvfp4_pack(x: torch.Tensor) -> torch.Tensor:
+def marlin_nvfp4_pack(x: torch.Tensor, out=None) -> torch.Tensor:
     """
     Input:  x.shape = [E, N, K // 8, 8], dtype=torch.uint8
     Output: y.shape = [E, K // 16, N << 1], dtype=torch.int32
     """
+    if _has_native_quant('marlin_pack_fp4', x):
+        return torch.ops.tutel_ops.marlin_pack_fp4(x.contiguous(), 1, out)
     E, N, G, half_group_size = x.shape
     K = G * half_group_size * 2
 
@@ -349,14 +364,16 @@ def marlin_nvfp4_pack(x: torch.Tensor) -> torch.Tensor:
     marlin_weight = w_pack[..., 0].clone()
     for i in range(1, 8):
         marlin_weight |= (w_pack[..., i] << (4 * i))
-    return marlin_weight
+    return marlin_weight if out is None else out.copy_(marlin_weight)
 
 
-def marlin_nvfp4_revert(y: torch.Tensor) -> torch.Tensor:
+def marlin_nvfp4_revert(y: torch.Tensor, out=None) -> torch.Tensor:
     """
     Input: y.shape = [E, K // 16, N << 1], dtype=torch.int32
     Output:  x.shape = [E, N, K // 8, 8], dtype=torch.uint8
     """
+    if _has_native_quant('marlin_unpack_fp4', y):
+        return torch.ops.tutel_ops.marlin_unpack_fp4(y.contiguous(), 1, out).view(y.size(0), y.size(2) // 2, y.size(1), 8)
     E = y.shape[0]
     K = y.shape[1] * 16
     N = y.shape[2] // 2
@@ -372,7 +389,7 @@ def marlin_nvfp4_revert(y: torch.Tensor) -> torch.Tensor:
     high = w_unpacked[..., 1::2]
     packed_bytes = low.to(torch.uint8) | (high.to(torch.uint8) << 4)
     x = packed_bytes.view(E, N, K // 16, 8).to(torch.uint8)
-    return x
+    return x if out is None else out.view(x.shape).copy_(x)
 
 def marlin_nvfp4_revert_transposed(y: torch.Tensor, nvfp4_groupscale: torch.Tensor, nvfp4_oscale: torch.Tensor) -> torch.Tensor:
     """
@@ -401,6 +418,33 @@ def marlin_nvfp4_revert_transposed(y: torch.Tensor, nvfp4_groupscale: torch.Tens
     return z.flatten(1, 2).to(scales_bf16.dtype)
 
 
+def moe_scaled_topk(logits, top_k, bias=None, n_group=1, topk_group=1, score_func='sigmoid', routed_scale=1.0, normalize=True):
+    """
+    Scaled top-k routing of DeepSeek-V3 / Kimi-K2 (score_func='sigmoid', with bias and grouped selection) and Qwen3 (score_func='softmax'),
+    or over scores computed by the caller (score_func='none').
+    Input: logits.shape = [..., E], bias.shape = [E]
+    Output: top_scores.shape = [samples, top_k], dtype=torch.float32
+            top_ids.shape = [samples, top_k], dtype=torch.int32
+    """
+    score_funcs = ('softmax', 'sigmoid', 'none')
+    assert score_func in score_funcs, f"Unrecognized score_func for moe_scaled_topk: {score_func}"
+    if _has_native_quant('moe_scaled_topk', logits, logits.dtype):
+        return tuple(torch.ops.tutel_ops.moe_scaled_topk(logits, bias, top_k, n_group, topk_group, score_funcs.index(score_func), routed_scale, normalize, None, None))
+    logits = logits.view(-1, logits.size(-1)).float()
+    scores = {'softmax': lambda: logits.softmax(dim=-1), 'sigmoid': logits.sigmoid, 'none': lambda: logits}[score_func]()
+    keys = scores + bias.float() if bias is not None else scores
+    if n_group > 1 and topk_group < n_group:
+        group_keys = keys.view(keys.size(0), n_group, -1)
+        group_keys = group_keys.topk(min(2, group_keys.size(-1)), dim=-1).values.sum(dim=-1)
+        group_mask = torch.zeros_like(group_keys, dtype=torch.bool).scatter_(1, group_keys.topk(topk_group, dim=-1).indices, True)
+        keys = keys.masked_fill(~group_mask.repeat_interleave(keys.size(-1) // n_group, dim=-1), float('-inf'))
+    top_ids = keys.topk(top_k, dim=-1).indices
+    top_scores = scores.gather(-1, top_ids)
+    if normalize:
+        top_scores = top_scores / (top_scores.sum(dim=-1, keepdim=True) + 1e-20)
+    return top_scores * routed_scale, top_ids.to(torch.int32)
+
+
 def __getattr__(name):
   fn = getattr(torch.ops.tutel_ops, name)
   return torch.compiler.disable(fn, recursive=True)
@@ -0,0 +1,6 @@
+# Copyright (c) Microsoft Corporation.
+# Licensed under the MIT license.
+
+
+# Paged KV-Cache Management
+from .impls.kv_cache import KVCache